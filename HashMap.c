@@ -1,103 +1,655 @@
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "HashMap.h"
+#include "ebr.h"
+#include "slab.h"
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+// The table starts small, since most folders have few children, and grows or
+// shrinks by a factor of two as the load factor leaves [1/8, 1].
+#define MIN_BUCKETS 8
+
+// Resizing is incremental: the old table is kept next to the new one and every
+// modifying operation moves this many old buckets over, so no single insert
+// pays for rehashing the whole map.
+#define REHASH_STEP 2
+
+// Pairs store their key inline, in the smallest size class that fits it.
+// Keys longer than the last class are allocated with plain malloc.
+#define N_PAIR_CLASSES 5
+#define PAIR_CLASS_MALLOC N_PAIR_CLASSES
+
+// Besides the hash chains, pairs are indexed in key order by a two-level
+// B+-tree: sorted blocks of at most BLOCK_MAX entries under a sorted array
+// of blocks. Iteration in key order is then linear, and finding a key takes
+// two binary searches. Entries keep the first 8 bytes of the key, so the
+// searches rarely have to look at the pairs themselves. Blocks start small
+// (most folders have few children) and double up to BLOCK_MAX.
+#define BLOCK_MAX 64
+#define BLOCK_MIN_CAPACITY 4
+
+// Bucket tables of up to MIN_BUCKETS << (N_TABLE_CLASSES - 1) buckets,
+// blocks of every capacity and arrays of up to MIN_BLOCK_REFS blocks come
+// from slab caches too, so a folder that fills up and empties again (or a
+// new one getting its first children) never calls malloc. Only tables and
+// block arrays of large maps do, a few times as they grow.
+#define N_TABLE_CLASSES 4
+#define N_BLOCK_CLASSES 5 // BLOCK_MIN_CAPACITY << (N_BLOCK_CLASSES - 1) == BLOCK_MAX
+#define MIN_BLOCK_REFS 4
+
+// Lookups may run concurrently with one modifying thread (see HashMap.h).
+// Pointers they follow are therefore atomic: published with release stores
+// and read with acquire loads. Pairs and tables that a modification unlinks
+// are freed through ebr_retire, so a concurrent lookup never touches freed
+// memory. Everything else, including the key order index, is only accessed
+// by the modifying thread or while the map is not modified.
 
 typedef struct Pair Pair;
 
 struct Pair {
-    char* key;
     void* value;
-    Pair* next; // Next item in a single-linked list.
+    _Atomic(Pair*) next; // Next item in a single-linked list.
+    unsigned int hash; // Full hash of key, so rehashing never rereads it.
+    unsigned int length; // Length of key.
+    unsigned char size_class;
+    char key[]; // Null-terminated copy of the key.
 };
 
+static SlabCache pair_caches[N_PAIR_CLASSES] = {
+    SLAB_CACHE_INITIALIZER(sizeof(Pair) + 16),
+    SLAB_CACHE_INITIALIZER(sizeof(Pair) + 32),
+    SLAB_CACHE_INITIALIZER(sizeof(Pair) + 64),
+    SLAB_CACHE_INITIALIZER(sizeof(Pair) + 128),
+    SLAB_CACHE_INITIALIZER(sizeof(Pair) + 256),
+};
+
+typedef struct {
+    unsigned long long prefix; // key_prefix of the key of pair.
+    Pair* pair;
+} Entry;
+
+typedef struct {
+    int count;
+    int capacity;
+    Entry entries[]; // Sorted by key.
+} Block;
+
+typedef struct {
+    unsigned long long prefix; // Prefix of the first key in block.
+    Block* block; // Never empty.
+} BlockRef;
+
+// A bucket array together with its size, so that a lookup always indexes
+// an array with the size it was allocated with.
+typedef struct {
+    size_t n_buckets; // Always a power of two.
+    _Atomic(Pair*) buckets[]; // Linked lists of key-value pairs.
+} Table;
+
 struct HashMap {
-    Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
+    _Atomic(Table*) table; // NULL before the first insert.
+    _Atomic(Table*) old_table; // Table being drained by an incremental rehash, or NULL.
+    atomic_size_t rehash_pos; // Old buckets below this index are already moved.
     size_t size; // total number of entries in map.
+    BlockRef* blocks; // Key order index, sorted by first key.
+    size_t n_blocks, blocks_capacity;
+};
+
+static SlabCache map_cache = SLAB_CACHE_INITIALIZER(sizeof(HashMap));
+
+#define TABLE_SIZE(n_buckets) (sizeof(Table) + (n_buckets) * sizeof(Pair*))
+#define BLOCK_SIZE(capacity) (sizeof(Block) + (capacity) * sizeof(Entry))
+
+static SlabCache table_caches[N_TABLE_CLASSES] = {
+    SLAB_CACHE_INITIALIZER(TABLE_SIZE(MIN_BUCKETS)),
+    SLAB_CACHE_INITIALIZER(TABLE_SIZE(MIN_BUCKETS << 1)),
+    SLAB_CACHE_INITIALIZER(TABLE_SIZE(MIN_BUCKETS << 2)),
+    SLAB_CACHE_INITIALIZER(TABLE_SIZE(MIN_BUCKETS << 3)),
 };
 
-static unsigned int get_hash(const char* key);
+static SlabCache block_caches[N_BLOCK_CLASSES] = {
+    SLAB_CACHE_INITIALIZER(BLOCK_SIZE(BLOCK_MIN_CAPACITY)),
+    SLAB_CACHE_INITIALIZER(BLOCK_SIZE(BLOCK_MIN_CAPACITY << 1)),
+    SLAB_CACHE_INITIALIZER(BLOCK_SIZE(BLOCK_MIN_CAPACITY << 2)),
+    SLAB_CACHE_INITIALIZER(BLOCK_SIZE(BLOCK_MIN_CAPACITY << 3)),
+    SLAB_CACHE_INITIALIZER(BLOCK_SIZE(BLOCK_MIN_CAPACITY << 4)),
+};
+
+static SlabCache block_refs_cache = SLAB_CACHE_INITIALIZER(MIN_BLOCK_REFS * sizeof(BlockRef));
+
+// The size class of `size` among `min` << 0, 1, ..., or `n_classes` if it is
+// larger.
+static int size_class_of(size_t size, size_t min, int n_classes)
+{
+    int size_class = 0;
+    while (size_class < n_classes && min << size_class < size)
+        size_class++;
+    return size_class;
+}
+
+#define LOAD(x) atomic_load_explicit(&(x), memory_order_acquire)
+#define STORE(x, v) atomic_store_explicit(&(x), (v), memory_order_release)
+
+static Pair* pair_new(const char* key, size_t len)
+{
+    int size_class = 0;
+    while (size_class < N_PAIR_CLASSES && (size_t)16 << size_class <= len)
+        size_class++;
+    Pair* p;
+    if (size_class == PAIR_CLASS_MALLOC) {
+        p = malloc(sizeof(Pair) + len + 1);
+        if (!p)
+            return NULL;
+    } else {
+        p = slab_alloc(&pair_caches[size_class]);
+    }
+    p->size_class = size_class;
+    p->length = len;
+    memcpy(p->key, key, len);
+    p->key[len] = '\0';
+    return p;
+}
+
+static void pair_free(void* pair)
+{
+    Pair* p = pair;
+    if (p->size_class == PAIR_CLASS_MALLOC)
+        free(p);
+    else
+        slab_free(&pair_caches[p->size_class], p);
+}
+
+static Table* table_new(size_t n_buckets)
+{
+    int size_class = size_class_of(n_buckets, MIN_BUCKETS, N_TABLE_CLASSES);
+    Table* table;
+    if (size_class < N_TABLE_CLASSES) {
+        table = slab_alloc(&table_caches[size_class]);
+        memset(table, 0, TABLE_SIZE(n_buckets));
+    } else {
+        table = calloc(1, TABLE_SIZE(n_buckets));
+        if (!table)
+            return NULL;
+    }
+    table->n_buckets = n_buckets;
+    return table;
+}
+
+static void table_free(void* arg)
+{
+    Table* table = arg;
+    int size_class = size_class_of(table->n_buckets, MIN_BUCKETS, N_TABLE_CLASSES);
+    if (size_class < N_TABLE_CLASSES)
+        slab_free(&table_caches[size_class], table);
+    else
+        free(table);
+}
+
+// Capacity is a power of two from BLOCK_MIN_CAPACITY to BLOCK_MAX.
+static Block* block_new(int capacity)
+{
+    Block* block = slab_alloc(
+        &block_caches[size_class_of(capacity, BLOCK_MIN_CAPACITY, N_BLOCK_CLASSES)]);
+    block->count = 0;
+    block->capacity = capacity;
+    return block;
+}
+
+static void block_free(Block* block)
+{
+    if (block)
+        slab_free(&block_caches[size_class_of(block->capacity, BLOCK_MIN_CAPACITY,
+                                              N_BLOCK_CLASSES)],
+                  block);
+}
+
+// Capacity is at least MIN_BLOCK_REFS.
+static BlockRef* block_refs_new(size_t capacity)
+{
+    if (capacity == MIN_BLOCK_REFS)
+        return slab_alloc(&block_refs_cache);
+    return malloc(capacity * sizeof(BlockRef));
+}
+
+static void block_refs_free(BlockRef* blocks, size_t capacity)
+{
+    if (capacity == MIN_BLOCK_REFS)
+        slab_free(&block_refs_cache, blocks);
+    else
+        free(blocks);
+}
 
 HashMap* hmap_new()
 {
-    HashMap* map = malloc(sizeof(HashMap));
-    if (!map)
-        return NULL;
-    memset(map, 0, sizeof(HashMap));
+    HashMap* map = slab_alloc(&map_cache);
+    atomic_init(&map->table, NULL);
+    atomic_init(&map->old_table, NULL);
+    atomic_init(&map->rehash_pos, 0);
+    map->size = 0;
+    map->blocks = NULL;
+    map->n_blocks = 0;
+    map->blocks_capacity = 0;
     return map;
 }
 
-void hmap_free(HashMap* map)
+static void free_chains(Table* table, size_t from)
 {
-    for (int h = 0; h < N_BUCKETS; ++h) {
-        for (Pair* p = map->buckets[h]; p;) {
+    for (size_t h = from; h < table->n_buckets; ++h) {
+        for (Pair* p = LOAD(table->buckets[h]); p;) {
             Pair* q = p;
-            p = p->next;
-            free(q->key);
-            free(q);
+            p = LOAD(p->next);
+            pair_free(q);
         }
     }
-    free(map);
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+void hmap_free(HashMap* map)
+{
+    Table* old_table = LOAD(map->old_table);
+    if (old_table) {
+        // Only the not yet migrated part of the old table holds pairs.
+        free_chains(old_table, LOAD(map->rehash_pos));
+        table_free(old_table);
+    }
+    Table* table = LOAD(map->table);
+    if (table) {
+        free_chains(table, 0);
+        table_free(table);
+    }
+    for (size_t i = 0; i < map->n_blocks; ++i)
+        block_free(map->blocks[i].block);
+    block_refs_free(map->blocks, map->blocks_capacity);
+    slab_free(&map_cache, map);
+}
+
+// Return the head of the chain that holds (or would hold) `hash`.
+static _Atomic(Pair*)* chain_of(HashMap* map, unsigned int hash)
+{
+    Table* old_table = LOAD(map->old_table);
+    if (old_table) {
+        size_t h = hash & (old_table->n_buckets - 1);
+        if (h >= LOAD(map->rehash_pos))
+            return &old_table->buckets[h];
+    }
+    Table* table = LOAD(map->table);
+    return &table->buckets[hash & (table->n_buckets - 1)];
+}
+
+// Move up to `steps` buckets of the old table into the current one.
+// A lookup racing with this may miss keys (it is told to retry by its
+// caller), but it always sees well-formed, null-terminated chains.
+static void rehash_step(HashMap* map, size_t steps)
+{
+    Table* old_table = LOAD(map->old_table);
+    Table* table = LOAD(map->table);
+    size_t pos = LOAD(map->rehash_pos);
+    while (old_table && steps--) {
+        Pair* p = LOAD(old_table->buckets[pos]);
+        while (p) {
+            Pair* next = LOAD(p->next);
+            size_t h = p->hash & (table->n_buckets - 1);
+            STORE(p->next, LOAD(table->buckets[h]));
+            STORE(table->buckets[h], p);
+            p = next;
+        }
+        STORE(old_table->buckets[pos], NULL);
+        if (++pos == old_table->n_buckets) {
+            STORE(map->old_table, NULL);
+            ebr_retire(old_table, table_free);
+            old_table = NULL;
+            pos = 0;
+        }
+        STORE(map->rehash_pos, pos);
+    }
+}
+
+// Start moving entries into a fresh table of `n_buckets` buckets.
+static void start_rehash(HashMap* map, size_t n_buckets)
+{
+    // A previous resize that is still running is finished first. This only
+    // happens when the map oscillates around a threshold.
+    Table* old_table = LOAD(map->old_table);
+    if (old_table)
+        rehash_step(map, old_table->n_buckets);
+    Table* table = table_new(n_buckets);
+    if (!table)
+        return; // Keep the current table, it is only slower.
+    Table* current = LOAD(map->table);
+    if (current) {
+        STORE(map->rehash_pos, 0);
+        STORE(map->old_table, current);
+    }
+    STORE(map->table, table);
+}
+
+static void maybe_resize(HashMap* map)
+{
+    if (LOAD(map->old_table))
+        return;
+    size_t n_buckets = LOAD(map->table)->n_buckets;
+    if (map->size > n_buckets)
+        start_rehash(map, n_buckets * 2);
+    else if (n_buckets > MIN_BUCKETS && map->size < n_buckets / 8)
+        start_rehash(map, n_buckets / 2);
+}
+
+static Pair* hmap_find(HashMap* map, const char* key, size_t length, unsigned int hash)
 {
-    for (Pair* p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
+    if (!LOAD(map->table))
+        return NULL;
+    for (Pair* p = LOAD(*chain_of(map, hash)); p; p = LOAD(p->next)) {
+        if (p->hash == hash && p->length == length && memcmp(key, p->key, length) == 0)
             return p;
     }
     return NULL;
 }
 
-void* hmap_get(HashMap* map, const char* key)
+// The first 8 characters of a key as a big-endian number, padded with zeros.
+// Keys contain no null characters, so comparing prefixes gives the order
+// of strcmp, unless the prefixes are equal.
+static unsigned long long key_prefix(const char* key, size_t length)
+{
+    unsigned long long prefix = 0;
+    for (size_t i = 0; i < 8; ++i)
+        prefix = prefix << 8 | (i < length ? (unsigned char)key[i] : 0);
+    return prefix;
+}
+
+// Compare the key of `p` (with the given prefix) with `key`, like strcmp.
+static int compare_key(unsigned long long p_prefix, Pair* p, unsigned long long prefix,
+                       const char* key, size_t length)
+{
+    if (p_prefix != prefix)
+        return p_prefix < prefix ? -1 : 1;
+    size_t common = p->length < length ? p->length : length;
+    int cmp = memcmp(p->key, key, common);
+    if (cmp != 0)
+        return cmp;
+    return p->length < length ? -1 : p->length > length;
+}
+
+// Return the index of the block that holds (or would hold) `key`: the last
+// one whose first key is not greater than it, or the first one.
+static size_t find_block(HashMap* map, unsigned long long prefix, const char* key,
+                         size_t length)
+{
+    size_t lo = 0, hi = map->n_blocks; // Answer in [lo, hi).
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        const BlockRef* ref = &map->blocks[mid];
+        if (compare_key(ref->prefix, ref->block->entries[0].pair, prefix, key, length) <= 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Return the position of the first entry in `block` not less than `key`.
+static int find_entry(Block* block, unsigned long long prefix, const char* key,
+                      size_t length)
+{
+    int lo = 0, hi = block->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const Entry* e = &block->entries[mid];
+        if (compare_key(e->prefix, e->pair, prefix, key, length) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Make room for a block reference at index `i`.
+static bool insert_block_ref(HashMap* map, size_t i)
+{
+    if (map->n_blocks == map->blocks_capacity) {
+        size_t capacity = map->blocks_capacity ? 2 * map->blocks_capacity : MIN_BLOCK_REFS;
+        BlockRef* blocks = block_refs_new(capacity);
+        if (!blocks)
+            return false;
+        if (map->n_blocks) // map->blocks is NULL in a new map
+            memcpy(blocks, map->blocks, map->n_blocks * sizeof(BlockRef));
+        block_refs_free(map->blocks, map->blocks_capacity);
+        map->blocks = blocks;
+        map->blocks_capacity = capacity;
+    }
+    memmove(&map->blocks[i + 1], &map->blocks[i], (map->n_blocks - i) * sizeof(BlockRef));
+    map->n_blocks++;
+    return true;
+}
+
+static void remove_block_ref(HashMap* map, size_t i)
+{
+    block_free(map->blocks[i].block);
+    memmove(&map->blocks[i], &map->blocks[i + 1], (map->n_blocks - i - 1) * sizeof(BlockRef));
+    map->n_blocks--;
+}
+
+static bool order_insert(HashMap* map, Pair* p)
+{
+    unsigned long long prefix = key_prefix(p->key, p->length);
+    if (!map->n_blocks) {
+        Block* block = block_new(BLOCK_MIN_CAPACITY);
+        if (!insert_block_ref(map, 0)) {
+            block_free(block);
+            return false;
+        }
+        map->blocks[0].block = block;
+    }
+    // Keys often come in increasing order (bulk loads, images), so check
+    // the end first.
+    size_t b = map->n_blocks - 1;
+    Block* block = map->blocks[b].block;
+    int pos = block->count;
+    const Entry* last = block->count ? &block->entries[block->count - 1] : NULL;
+    if (last && compare_key(last->prefix, last->pair, prefix, p->key, p->length) > 0) {
+        b = find_block(map, prefix, p->key, p->length);
+        block = map->blocks[b].block;
+        pos = find_entry(block, prefix, p->key, p->length);
+    }
+    if (block->count == block->capacity) {
+        if (block->capacity < BLOCK_MAX) {
+            Block* larger = block_new(2 * block->capacity);
+            larger->count = block->count;
+            memcpy(larger->entries, block->entries, block->count * sizeof(Entry));
+            block_free(block);
+            block = larger;
+            map->blocks[b].block = block;
+        } else {
+            // Split the block in halves, or start a new one when appending,
+            // so that keys inserted in order fill blocks completely.
+            bool append = b + 1 == map->n_blocks && pos == block->count;
+            Block* upper = block_new(BLOCK_MAX);
+            if (!insert_block_ref(map, b + 1)) {
+                block_free(upper);
+                return false;
+            }
+            upper->count = append ? 0 : BLOCK_MAX / 2;
+            block->count -= upper->count;
+            memcpy(upper->entries, &block->entries[block->count],
+                   upper->count * sizeof(Entry));
+            map->blocks[b + 1].block = upper;
+            if (pos > block->count || append) {
+                pos -= block->count;
+                block = upper;
+                b++;
+            } else {
+                map->blocks[b + 1].prefix = upper->entries[0].prefix;
+            }
+        }
+    }
+    memmove(&block->entries[pos + 1], &block->entries[pos],
+            (block->count - pos) * sizeof(Entry));
+    block->entries[pos].prefix = prefix;
+    block->entries[pos].pair = p;
+    block->count++;
+    map->blocks[b].prefix = block->entries[0].prefix;
+    return true;
+}
+
+static void order_remove(HashMap* map, Pair* p)
+{
+    unsigned long long prefix = key_prefix(p->key, p->length);
+    size_t b = find_block(map, prefix, p->key, p->length);
+    Block* block = map->blocks[b].block;
+    int pos = find_entry(block, prefix, p->key, p->length);
+    assert(pos < block->count && block->entries[pos].pair == p);
+    block->count--;
+    memmove(&block->entries[pos], &block->entries[pos + 1],
+            (block->count - pos) * sizeof(Entry));
+    if (!block->count) {
+        remove_block_ref(map, b);
+        return;
+    }
+    map->blocks[b].prefix = block->entries[0].prefix;
+    // Merge with the next block if both are at most a quarter full, so that
+    // blocks stay at least that full on average.
+    if (b + 1 < map->n_blocks) {
+        Block* next = map->blocks[b + 1].block;
+        if (block->count + next->count <= BLOCK_MAX / 2 &&
+            block->count + next->count <= block->capacity) {
+            memcpy(&block->entries[block->count], next->entries,
+                   next->count * sizeof(Entry));
+            block->count += next->count;
+            remove_block_ref(map, b + 1);
+        }
+    }
+}
+
+HashMap* hmap_copy(HashMap* map)
 {
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
+    HashMap* copy = hmap_new();
+    if (!map->size)
+        return copy;
+    size_t n_buckets = MIN_BUCKETS;
+    while (n_buckets < map->size)
+        n_buckets *= 2;
+    Table* table = table_new(n_buckets);
+    if (!table) {
+        hmap_free(copy);
+        return NULL;
+    }
+    STORE(copy->table, table);
+    size_t blocks_capacity = MIN_BLOCK_REFS;
+    while (blocks_capacity < map->n_blocks)
+        blocks_capacity *= 2;
+    copy->blocks = block_refs_new(blocks_capacity);
+    if (!copy->blocks) {
+        hmap_free(copy);
+        return NULL;
+    }
+    copy->blocks_capacity = blocks_capacity;
+    // Blocks are copied as they are, so the key order needs no searching.
+    for (size_t b = 0; b < map->n_blocks; ++b) {
+        const Block* from = map->blocks[b].block;
+        Block* block = block_new(from->capacity);
+        copy->blocks[b].prefix = map->blocks[b].prefix;
+        copy->blocks[b].block = block;
+        copy->n_blocks++;
+        for (int i = 0; i < from->count; ++i) {
+            const Pair* p = from->entries[i].pair;
+            Pair* new_p = pair_new(p->key, p->length);
+            if (!new_p) {
+                hmap_free(copy);
+                return NULL;
+            }
+            new_p->value = p->value;
+            new_p->hash = p->hash;
+            _Atomic(Pair*)* chain = &table->buckets[p->hash & (n_buckets - 1)];
+            atomic_init(&new_p->next, LOAD(*chain));
+            STORE(*chain, new_p);
+            block->entries[i].prefix = from->entries[i].prefix;
+            block->entries[i].pair = new_p;
+            block->count++;
+            copy->size++;
+        }
+    }
+    return copy;
+}
+
+void* hmap_get_hashed(HashMap* map, const char* key, size_t length, unsigned int hash)
+{
+    Pair* p = hmap_find(map, key, length, hash);
     if (p)
         return p->value;
     else
         return NULL;
 }
 
-bool hmap_insert(HashMap* map, const char* key, void* value)
+void* hmap_get(HashMap* map, const char* key)
+{
+    size_t length = strlen(key);
+    return hmap_get_hashed(map, key, length, hmap_hash(key, length));
+}
+
+bool hmap_insert_hashed(HashMap* map, const char* key, size_t length, unsigned int hash,
+                        void* value)
 {
     if (!value)
         return false;
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
+    Pair* p = hmap_find(map, key, length, hash);
     if (p)
         return false; // Already exists.
-    Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
+    if (!LOAD(map->table)) {
+        start_rehash(map, MIN_BUCKETS);
+        if (!LOAD(map->table))
+            return false;
+    }
+    Pair* new_p = pair_new(key, length);
+    if (!new_p)
+        return false;
+    if (!order_insert(map, new_p)) {
+        pair_free(new_p);
+        return false;
+    }
     new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
+    new_p->hash = hash;
+    _Atomic(Pair*)* chain = chain_of(map, hash);
+    atomic_init(&new_p->next, LOAD(*chain));
+    STORE(*chain, new_p);
     map->size++;
+    rehash_step(map, REHASH_STEP);
+    maybe_resize(map);
     return true;
 }
 
-bool hmap_remove(HashMap* map, const char* key)
+bool hmap_insert(HashMap* map, const char* key, void* value)
 {
-    int h = get_hash(key);
-    Pair** pp = &(map->buckets[h]);
-    while (*pp) {
-        Pair* p = *pp;
-        if (strcmp(key, p->key) == 0) {
-            *pp = p->next;
-            free(p->key);
-            free(p);
+    size_t length = strlen(key);
+    return hmap_insert_hashed(map, key, length, hmap_hash(key, length), value);
+}
+
+bool hmap_remove_hashed(HashMap* map, const char* key, size_t length, unsigned int hash)
+{
+    if (!LOAD(map->table))
+        return false;
+    _Atomic(Pair*)* pp = chain_of(map, hash);
+    Pair* p;
+    while ((p = LOAD(*pp))) {
+        if (p->hash == hash && p->length == length && memcmp(key, p->key, length) == 0) {
+            STORE(*pp, LOAD(p->next));
+            order_remove(map, p);
+            ebr_retire(p, pair_free);
             map->size--;
+            rehash_step(map, REHASH_STEP);
+            maybe_resize(map);
             return true;
         }
-        pp = &(p->next);
+        pp = &p->next;
     }
     return false;
 }
 
+bool hmap_remove(HashMap* map, const char* key)
+{
+    size_t length = strlen(key);
+    return hmap_remove_hashed(map, key, length, hmap_hash(key, length));
+}
+
 size_t hmap_size(HashMap* map)
 {
     return map->size;
@@ -105,30 +657,41 @@ size_t hmap_size(HashMap* map)
 
 HashMapIterator hmap_iterator(HashMap* map)
 {
-    HashMapIterator it = { 0, map->buckets[0] };
+    (void)map;
+    HashMapIterator it = { 0, 0 };
+    return it;
+}
+
+HashMapIterator hmap_lower_bound(HashMap* map, const char* key)
+{
+    HashMapIterator it = { 0, 0 };
+    if (map->n_blocks) {
+        size_t length = strlen(key);
+        unsigned long long prefix = key_prefix(key, length);
+        it.block = find_block(map, prefix, key, length);
+        it.entry = find_entry(map->blocks[it.block].block, prefix, key, length);
+    }
     return it;
 }
 
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
 {
-    Pair* p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
-        p = map->buckets[++it->bucket];
+    if (it->block < map->n_blocks && it->entry == map->blocks[it->block].block->count) {
+        it->block++;
+        it->entry = 0;
     }
-    if (!p)
+    if (it->block >= map->n_blocks)
         return false;
+    Pair* p = map->blocks[it->block].block->entries[it->entry++].pair;
     *key = p->key;
     *value = p->value;
-    it->pair = p->next;
     return true;
 }
 
-static unsigned int get_hash(const char* key)
+unsigned int hmap_hash(const char* key, size_t length)
 {
-    unsigned int hash = 17;
-    while (*key) {
-        hash = (hash << 3) + hash + *key;
-        ++key;
-    }
-    return hash % N_BUCKETS;
+    unsigned int hash = HMAP_HASH_INIT;
+    for (size_t i = 0; i < length; ++i)
+        hash = hmap_hash_step(hash, key[i]);
+    return hmap_hash_finish(hash);
 }
@@ -10,10 +10,21 @@ typedef struct HashMap HashMap;
 // Create a new, empty map.
 HashMap* hmap_new();
 
+// Return a new map with the same keys and values as `map`, or NULL if
+// memory ran out. Takes linear time. `map` is only read, like by hmap_next.
+HashMap* hmap_copy(HashMap* map);
+
 // Clear the map and free its memory. This frees the map and the keys
 // copied by hmap_insert, but does not free any values.
 void hmap_free(HashMap* map);
 
+// Concurrency: the map is not synchronized, except that hmap_get and
+// hmap_get_hashed may run concurrently with a single thread modifying the
+// map, provided they run inside an EBR read section (see ebr.h). Such a
+// lookup never touches freed memory, but its result may be wrong while the
+// modification is in progress, so the caller has to validate it (e.g. with
+// a sequence counter bumped around modifications).
+
 // Get the value stored under `key`, or NULL if not present.
 void* hmap_get(HashMap* map, const char* key);
 
@@ -27,14 +38,57 @@ bool hmap_insert(HashMap* map, const char* key, void* value);
 // or do nothing and return false if `key` was not present.
 bool hmap_remove(HashMap* map, const char* key);
 
+// Hashing of keys is exposed so that callers which scan a key anyway (like
+// the path tokenizer) can hash it in the same pass:
+//     unsigned int hash = HMAP_HASH_INIT;
+//     for (size_t i = 0; i < length; ++i)
+//         hash = hmap_hash_step(hash, key[i]);
+//     hash = hmap_hash_finish(hash);
+// gives the same value as hmap_hash(key, length). The hash is 32-bit FNV-1a
+// followed by the murmur3 finalizer.
+#define HMAP_HASH_INIT 2166136261u
+
+static inline unsigned int hmap_hash_step(unsigned int hash, char c)
+{
+    return (hash ^ (unsigned char)c) * 16777619u;
+}
+
+static inline unsigned int hmap_hash_finish(unsigned int hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Return the hash of the first `length` characters of `key`.
+unsigned int hmap_hash(const char* key, size_t length);
+
+// Variants of hmap_get, hmap_insert and hmap_remove for a key given as
+// `length` characters (not necessarily null-terminated) with a precomputed
+// `hash` (see hmap_hash). Stored hashes and lengths are compared before
+// any key bytes.
+void* hmap_get_hashed(HashMap* map, const char* key, size_t length, unsigned int hash);
+bool hmap_insert_hashed(HashMap* map, const char* key, size_t length, unsigned int hash,
+                        void* value);
+bool hmap_remove_hashed(HashMap* map, const char* key, size_t length, unsigned int hash);
+
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
 typedef struct HashMapIterator HashMapIterator;
 
 // Return an iterator to the map. See `hmap_next`.
+// Iterators visit keys in increasing order (as compared by strcmp); the map
+// keeps them sorted, so a full iteration takes linear time.
 HashMapIterator hmap_iterator(HashMap* map);
 
+// Return an iterator to the first element whose key is not less than `key`,
+// in O(log n) time.
+HashMapIterator hmap_lower_bound(HashMap* map, const char* key);
+
 // Set `*key` and `*value` to the current element pointed by iterator and
 // move the iterator to the next element.
 // If there are no more elements, leaves `*key` and `*value` unchanged and
@@ -52,6 +106,6 @@ HashMapIterator hmap_iterator(HashMap* map);
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
 
 struct HashMapIterator {
-    int bucket;
-    void* pair;
+    size_t block;
+    int entry;
 };
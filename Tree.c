@@ -1,543 +1,3306 @@
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 #include "Tree.h"
 #include "path_utils.h"
+#include "rwlock.h"
+#include "rbias.h"
+#include "contention.h"
+#include "dcache.h"
+#include "ebr.h"
+#include "image.h"
+#include "journal.h"
+#include "latency.h"
 #include "err.h"
+#include "slab.h"
 
 // Error of trying to move a folder into it's own subtree.
 // For example moving /a/ to /a/b/c/, when /a/b/ exists.
 #define EILLEGALMOVE -1
 
+// Liczba prób optymistycznego przejścia ścieżki, zanim przejdziemy do
+// przechodzenia z protokołami czytelnika.
+#define OPTIMISTIC_ATTEMPTS 4
+
+// Ścieżki o co najmniej tylu komponentach są zapamiętywane w dcache.
+// Krótsze przechodzi się szybciej, niż sprawdza się wpis.
+#define DCACHE_MIN_COMPONENTS 2
+
+// Listy folderów o co najmniej tylu synach są zapamiętywane w folderze.
+// Krótsze buduje się szybciej, niż trzyma się je w pamięci.
+#define LISTING_CACHE_MIN_CHILDREN 16
+
+// Napis zwracany przez tree_list_shared, poprzedzony licznikiem referencji.
+typedef struct {
+    atomic_uint refs;
+    unsigned int seq; // Tree.seq folderu w chwili budowania napisu
+    char text[];
+} Listing;
+
+typedef struct Version Version;
+
+// Multizbiór wysokości synów folderu: pary (wysokość, liczba synów o niej),
+// rosnąco według wysokości. Opublikowany w folderze się nie zmienia: zmiana
+// tworzy nowy (zob. change_heights), więc pamięć na multizbiory bierzemy ze
+// slabu, z klas na SLAB_HEIGHTS, 2 * SLAB_HEIGHTS, ... par. Dopiero
+// multizbiory większe niż największa klasa (synowie o ponad
+// SLAB_HEIGHTS << (HEIGHT_CLASSES - 1) różnych wysokościach) są z malloc.
+#define SLAB_HEIGHTS 2
+#define HEIGHT_CLASSES 5
+
+typedef struct {
+    int height;
+    long count; // chwilowo może być ujemna, zob. change_heights
+} HeightCount;
+
+typedef struct {
+    int size, capacity;
+    HeightCount entries[];
+} Heights;
+
+// Część liczników folderu na osobnej linii pamięci: każdy wątek zmienia
+// zawsze tę samą część (zob. shard_index). Liczba potomków folderu
+// z częściami to suma descendants z nich i z folderu (zob.
+// count_descendants). Części mają korzeń, w którym liczą też wątki
+// w bramkach agregatów (inside, zob. gate_enter), i foldery tworzone
+// bezpośrednio w korzeniu, bo przez nie przechodzi większość poprawek.
+#define SHARDS 8
+#define GATES 8
+
+typedef struct {
+    _Alignas(64) atomic_uint inside[GATES];
+    atomic_size_t descendants;
+} Shard;
+
 struct Tree {
+    // Synowie folderu. Gdy żyje migawka, która może ich czytać, pisarz nie
+    // zmienia mapy, tylko ją kopiuje (zob. change_children). NULL w folderze
+    // wczytanym z obrazu, którego zawartość nie była jeszcze potrzebna
+    // (zob. materialize), i w zwolnionym.
+    _Atomic(HashMap *) children;
+    // Obraz, z którego folder został wczytany (zob. tree_load), i numer
+    // folderu w nim, albo NULL.
+    Image *image;
+    uint32_t index;
+
+    // Blokada czytelników i pisarzy, zob. rwlock.h, i tryb uprzywilejowania
+    // czytelników, zob. rbias.h i tree_set_reader_bias.
+    RWLock lock;
+    ReaderBias bias;
+
+    // Licznik zmian dla czytelników optymistycznych (jak w seqlocku):
+    // nieparzysty, gdy w folderze jest pisarz.
+    atomic_uint seq;
+    // Ustawiane przez tree_remove; folder czeka wtedy tylko na zwolnienie
+    // przez EBR (zob. ebr.h).
+    atomic_bool removed;
+
+    // Rodzic (NULL w korzeniu). Zmieniany tylko przez tree_move, a przy
+    // zwalnianiu drzewa służy jako wskaźnik stosu (zob. tree_destroy).
+    _Atomic(Tree *) parent;
+    // Wartość rename_seq drzewa po ostatnim przeniesieniu tego folderu
+    // (0, jeśli nie był przenoszony), zob. lookup_cached.
+    atomic_ullong gen;
+    // Jedna referencja od drzewa i po jednej od każdego wpisu w dcache
+    // i każdego kursora (TreeListCursor), który wskazuje na ten folder.
+    // Ostatnia zwalnia pamięć folderu.
+    atomic_uint refs;
+    // Ostatnio zbudowana lista synów (lub NULL). Jest aktualna, jeśli jej
+    // seq jest równe seq folderu, bo każdy pisarz zmienia seq.
+    _Atomic(Listing *) listing;
+
+    // Wersje dla migawek (zob. tree_snapshot): stempel, od którego
+    // obowiązuje obecna zawartość children, stempel utworzenia folderu
+    // i starsze zawartości potrzebne żywym migawkom, od najnowszej.
+    atomic_ullong stamp;
+    unsigned long long born;
+    _Atomic(Version *) versions;
+
+    // Dziennik zmian drzewa (zob. tree_journal_open) albo NULL. Tylko
+    // w korzeniu.
+    Journal *journal;
+    // Foldery na głębokościach mniejszych od tej mogą uprzywilejować
+    // czytelników (zob. tree_set_reader_bias). Tylko w korzeniu.
+    atomic_int bias_depth;
+    // Numer drzewa, niepowtarzalny w całym programie (w przeciwieństwie do
+    // adresu korzenia, który po tree_free może dostać nowe drzewo): klucz
+    // wpisów drzewa w dcache. Tylko w korzeniu.
+    unsigned long long id;
+    // Licznik przeniesień w drzewie (jak rename_lock w Linuksie):
+    // nieparzysty, gdy jakiś folder jest właśnie przepinany. Operacje
+    // optymistyczne sprawdzają po wejściu do folderu, że licznik się nie
+    // zmienił, czyli że w trakcie przechodzenia nic nie zostało przeniesione.
+    // Zmieniany tylko pod rename_lock, który tree_move bierze dopiero
+    // w folderach, które przepina (zob. move_at), więc przodkowie folderów
+    // zmieniają się tylko pod nim. Tylko w korzeniu.
+    atomic_ullong rename_seq;
+    pthread_mutex_t rename_lock;
+    // Bramki agregatów zamknięte przez trwające przeniesienie (bit na
+    // bramkę, zob. gate_enter). Tylko w korzeniu.
+    atomic_uint closed_gates;
+
+    // Agregaty poddrzewa (zob. tree_stat): liczba potomków (w descendants
+    // i w shards, jeśli nie są NULL-em) i wysokości synów, z których wynika
+    // wysokość folderu (NULL, jeśli nie ma synów, i IMAGE_HEIGHTS w folderze
+    // z obrazu, dopóki synowie nie zmienili wysokości). Zmieniane tylko
+    // w bramce agregatów (zob. gate_enter) albo pod rename_lock przy
+    // zamkniętych bramkach przenoszonego folderu.
+    atomic_size_t descendants;
+    Shard *shards;
+    _Atomic(Heights *) heights;
+
+#ifdef TREE_CONTENTION_STATS
+    // Liczniki wejść i czekania (zob. tree_contention_report).
+    ContentionCounters contention;
+#endif
+};
+
+// Zawartość folderu owner widziana przez migawki o wersjach z [from, until)
+// albo, jeśli children jest NULL-em, usunięty folder owner, który migawki
+// z [from, until) jeszcze widzą. Trzyma referencję do owner.
+struct Version {
     HashMap *children;
+    unsigned long long from, until;
+    Tree *owner;
+    _Atomic(Version *) older; // następna w owner->versions
+    Version *next; // na liście retained
+};
 
-    pthread_mutex_t lock;
-    pthread_cond_t reader_type;
-    pthread_cond_t writer_type;
+struct TreeSnapshot {
+    Tree *root; // z referencją, zob. Tree.refs
+    unsigned long long version;
+    TreeSnapshot *prev, *next; // na liście żywych migawek
+};
 
-    int reader_type_count, writer_type_count;
-    int reader_type_waiting, writer_type_waiting;
-    int change;
+static SlabCache tree_cache = SLAB_CACHE_ALIGNED_INITIALIZER(sizeof(Tree), _Alignof(Tree));
+#define HEIGHTS_SIZE(capacity) (sizeof(Heights) + (capacity) * sizeof(HeightCount))
+static SlabCache heights_caches[HEIGHT_CLASSES] = {
+    SLAB_CACHE_INITIALIZER(HEIGHTS_SIZE(SLAB_HEIGHTS)),
+    SLAB_CACHE_INITIALIZER(HEIGHTS_SIZE(SLAB_HEIGHTS << 1)),
+    SLAB_CACHE_INITIALIZER(HEIGHTS_SIZE(SLAB_HEIGHTS << 2)),
+    SLAB_CACHE_INITIALIZER(HEIGHTS_SIZE(SLAB_HEIGHTS << 3)),
+    SLAB_CACHE_INITIALIZER(HEIGHTS_SIZE(SLAB_HEIGHTS << 4)),
 };
 
-void tree_reader_type_entry_protocol(Tree *tree_node) {
-    if (pthread_mutex_lock(&tree_node->lock) != 0)
-        syserr("lock failed");
+// Wysokości synów folderu z obrazu, którego synowie nie zmienili jeszcze
+// wysokości: są w obrazie (zob. height_of).
+static Heights image_heights;
+#define IMAGE_HEIGHTS (&image_heights)
+
+// Zegar migawek: wersja najnowszej utworzonej migawki. Zmiana wykonana, gdy
+// zegar wskazywał c, dostaje stempel c + 1, więc widzą ją migawki o wersjach
+// od c + 1. newest_snapshot to wersja najnowszej żywej migawki (0, jeśli
+// żadnej nie ma). Oba zmieniane pod snapshots_lock, który chroni też listę
+// żywych migawek (rosnąco według wersji).
+static atomic_ullong snapshot_clock = 0;
+static atomic_ullong newest_snapshot = 0;
+static pthread_mutex_t snapshots_lock = PTHREAD_MUTEX_INITIALIZER;
+static TreeSnapshot *oldest_snapshot = NULL, *latest_snapshot = NULL;
+// Wszystkie wersje (Version), do wybrania przez prune_versions.
+static _Atomic(Version *) retained = NULL;
 
-    while (tree_node->writer_type_count + tree_node->writer_type_waiting > 0 &&
-           tree_node->change <= 0) {
-        tree_node->reader_type_waiting++;
-        if (pthread_cond_wait(&tree_node->reader_type, &tree_node->lock) != 0)
-            syserr("condition wait failed");
-        tree_node->reader_type_waiting--;
+static void tree_put(void *arg);
+
+// Protokół wstępny czytelnika. Jeśli folder uprzywilejowuje czytelników,
+// czytelnik wchodzi bez dotykania blokady (zob. rbias.h), a protokoły
+// blokady są drogą wolną. Czytelnik, który wszedł drogą wolną do folderu,
+// który może uprzywilejować czytelników (biasable), włącza tryb z powrotem
+// po jego cofnięciu przez pisarza.
+static void reader_enter(Tree *tree_node, bool biasable) {
+    if (rbias_read_lock(&tree_node->bias, tree_node)) {
+#ifdef TREE_CONTENTION_STATS
+        contention_record(&tree_node->contention, false, 0);
+#endif
+        return;
     }
-    tree_node->change--;
-    tree_node->reader_type_count++;
-    if (tree_node->change > 0) {
-        if (pthread_cond_signal(&tree_node->reader_type) != 0)
-            syserr("condition signal failed");
+#ifdef TREE_CONTENTION_STATS
+    if (!rwlock_try_read_lock(&tree_node->lock)) {
+        uint64_t start = contention_clock();
+        rwlock_read_lock(&tree_node->lock);
+        contention_record(&tree_node->contention, true,
+                          contention_clock() - start);
+    } else {
+        contention_record(&tree_node->contention, false, 0);
     }
-    if (tree_node->change < 0)
-        tree_node->change = 0;
+#else
+    rwlock_read_lock(&tree_node->lock);
+#endif
+    if (biasable)
+        rbias_enable(&tree_node->bias);
+}
 
-    if (pthread_mutex_unlock(&tree_node->lock) != 0)
-        syserr("mutex unlock failed");
+void tree_reader_type_entry_protocol(Tree *tree_node) {
+    reader_enter(tree_node, false);
 }
 
 void tree_reader_type_final_protocol(Tree *tree_node) {
-    if (pthread_mutex_lock(&tree_node->lock) != 0)
-        syserr("lock failed");
-    tree_node->reader_type_count--;
-    if (tree_node->reader_type_count == 0 &&
-        tree_node->writer_type_waiting > 0) {
-        tree_node->change = -1;
-        if (pthread_cond_signal(&tree_node->writer_type) != 0)
-            syserr("condition signal failed");
-    }
-    if (pthread_mutex_unlock(&tree_node->lock) != 0)
-        syserr("mutex unlock failed");
+    if (!rbias_read_unlock(tree_node))
+        rwlock_read_unlock(&tree_node->lock);
 }
 
-void tree_writer_type_entry_protocol(Tree *tree_node) {
-    if (pthread_mutex_lock(&tree_node->lock) != 0)
-        syserr("lock failed");
-    while (tree_node->writer_type_count + tree_node->reader_type_count > 0 &&
-           tree_node->change != -1) {
-        tree_node->writer_type_waiting++;
+// Pisarz, który zajął już blokadę, zaznacza w seq, że jest w folderze.
+static void writer_begin(Tree *tree_node) {
+    unsigned int seq = atomic_load_explicit(&tree_node->seq, memory_order_relaxed);
+    atomic_store_explicit(&tree_node->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // przed zmianami pisarza
+}
 
-        if (pthread_cond_wait(&tree_node->writer_type, &tree_node->lock) != 0)
-            syserr("condition wait failed");
+void tree_writer_type_entry_protocol(Tree *tree_node) {
+#ifdef TREE_CONTENTION_STATS
+    if (!rwlock_try_write_lock(&tree_node->lock)) {
+        uint64_t start = contention_clock();
+        rwlock_write_lock(&tree_node->lock);
+        contention_record(&tree_node->contention, true,
+                          contention_clock() - start);
+    } else {
+        contention_record(&tree_node->contention, false, 0);
+    }
+#else
+    rwlock_write_lock(&tree_node->lock);
+#endif
+    rbias_revoke(&tree_node->bias, tree_node);
+    writer_begin(tree_node);
+}
 
-        tree_node->writer_type_waiting--;
+// Jak protokół wstępny pisarza, ale bez czekania: zwraca false (nie
+// wchodząc), jeśli w folderze jest ktoś inny.
+static bool writer_try_enter(Tree *tree_node) {
+    if (!rwlock_try_write_lock(&tree_node->lock))
+        return false;
+    if (!rbias_try_revoke(&tree_node->bias, tree_node)) {
+        rwlock_write_unlock(&tree_node->lock);
+        return false;
     }
-    tree_node->writer_type_count++;
-    tree_node->change = 0;
-    if (pthread_mutex_unlock(&tree_node->lock) != 0)
-        syserr("mutex unlock failed");
+#ifdef TREE_CONTENTION_STATS
+    contention_record(&tree_node->contention, false, 0);
+#endif
+    writer_begin(tree_node);
+    return true;
 }
 
 void tree_writer_type_final_protocol(Tree *tree_node) {
-    if (pthread_mutex_lock(&tree_node->lock) != 0)
-        syserr("lock failed");
-    tree_node->writer_type_count--;
-
-    if (tree_node->reader_type_waiting > 0) {
-        tree_node->change = tree_node->reader_type_waiting;
-        if (pthread_cond_signal(&tree_node->reader_type) != 0)
-            syserr("condition signal failed");
-    } else if (tree_node->writer_type_waiting > 0) {
-        tree_node->change = -1;
-        if (pthread_cond_signal(&tree_node->writer_type) != 0)
-            syserr("condition signal failed");
-    } else {
-        tree_node->change = 0;
+    unsigned int seq = atomic_load_explicit(&tree_node->seq, memory_order_relaxed);
+    atomic_store_explicit(&tree_node->seq, seq + 1, memory_order_release);
+    rwlock_write_unlock(&tree_node->lock);
+}
+
+// Tworzy folder bez mapy synów.
+static Tree *tree_alloc(void) {
+    Tree *tree = slab_alloc(&tree_cache);
+    atomic_init(&tree->children, NULL);
+    tree->image = NULL;
+    tree->index = 0;
+    rwlock_init(&tree->lock);
+    rbias_init(&tree->bias);
+    atomic_init(&tree->seq, 0);
+    atomic_init(&tree->removed, false);
+    atomic_init(&tree->parent, NULL);
+    atomic_init(&tree->gen, 0);
+    atomic_init(&tree->refs, 1);
+    atomic_init(&tree->listing, NULL);
+    atomic_init(&tree->stamp, 0);
+    tree->born = 0;
+    atomic_init(&tree->versions, NULL);
+    tree->journal = NULL;
+    atomic_init(&tree->bias_depth, 0);
+    tree->id = 0;
+    atomic_init(&tree->rename_seq, 0);
+    atomic_init(&tree->closed_gates, 0);
+    atomic_init(&tree->descendants, 0);
+    tree->shards = NULL;
+    atomic_init(&tree->heights, NULL);
+#ifdef TREE_CONTENTION_STATS
+    contention_init(&tree->contention);
+#endif
+    return tree;
+}
+
+// Tworzy pusty folder.
+static Tree *folder_new(void) {
+    Tree *tree = tree_alloc();
+    atomic_store_explicit(&tree->children, hmap_new(), memory_order_relaxed);
+    return tree;
+}
+
+// Daje folderowi części liczników (zob. Shard).
+static void shards_init(Tree *tree) {
+    Shard *shards = aligned_alloc(_Alignof(Shard), SHARDS * sizeof(Shard));
+    if (!shards)
+        fatal("Malloc failure.");
+    for (int i = 0; i < SHARDS; ++i) {
+        for (int gate = 0; gate < GATES; ++gate)
+            atomic_init(&shards[i].inside[gate], 0);
+        atomic_init(&shards[i].descendants, 0);
     }
-    if (pthread_mutex_unlock(&tree_node->lock) != 0)
-        syserr("mutex unlock failed");
+    tree->shards = shards;
+}
+
+// Przygotowuje pola korzenia: nowy numer drzewa (zob. Tree.id),
+// rename_lock i części liczników.
+static void root_init(Tree *tree) {
+    static atomic_ullong next_id = 0;
+    tree->id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed) + 1;
+    if (pthread_mutex_init(&tree->rename_lock, NULL) != 0)
+        syserr("pthread_mutex_init failed");
+    shards_init(tree);
 }
 
 Tree *tree_new() {
-    Tree *tree = malloc(sizeof(Tree));
-    if (!tree)
-        fatal("Malloc failure.");
-    tree->children = hmap_new();
-    tree->change = 0;
-    tree->reader_type_count = 0;
-    tree->reader_type_waiting = 0;
-    tree->writer_type_count = 0;
-    tree->writer_type_waiting = 0;
-    if (pthread_mutex_init(&tree->lock, 0) != 0)
-        syserr("mutex init failed");
-    if (pthread_cond_init(&tree->reader_type, 0) != 0)
-        syserr("cond init 1 failed");
-    if (pthread_cond_init(&tree->writer_type, 0) != 0)
-        syserr("cond init 2 failed");
+    Tree *tree = folder_new();
+    root_init(tree);
     return tree;
 }
 
-void tree_free(Tree *tree) {
-    if (!tree)
-        return;
+// Agregaty folderu wczytanego z obrazu (zob. IMAGE_HEIGHTS).
+static void image_aggregates(Tree *tree) {
+    const ImageNode *node = &tree->image->nodes[tree->index];
+    atomic_init(&tree->descendants, node->descendants);
+    atomic_init(&tree->heights, IMAGE_HEIGHTS);
+}
 
-    if (hmap_size(tree->children) == 0) {
-        hmap_free(tree->children);
-        if (pthread_cond_destroy(&tree->reader_type) != 0)
-            syserr("cond destroy 1 failed");
-        if (pthread_cond_destroy(&tree->writer_type) != 0)
-            syserr("cond destroy 2 failed");
-        if (pthread_mutex_destroy(&tree->lock) != 0)
-            syserr("mutex destroy failed");
-        free(tree);
-        return;
+// Buduje mapę synów folderu wczytanego z obrazu: jego synowie to nowe
+// foldery, jeszcze bez map. Może to robić kilka wątków naraz (także
+// czytelnicy bez protokołów); wygrywa pierwsza opublikowana mapa.
+static HashMap *materialize(Tree *tree) {
+    const Image *image = tree->image;
+    if (!image)
+        return NULL;
+    const ImageNode *node = &image->nodes[tree->index];
+    HashMap *children = hmap_new();
+    for (uint32_t i = node->first_child;
+         i < node->first_child + node->child_count; ++i) {
+        const ImageNode *child_node = &image->nodes[i];
+        const char *name = image->names + child_node->name_offset;
+        Tree *child = tree_alloc();
+        child->image = tree->image;
+        child->index = i;
+        atomic_init(&child->parent, tree);
+        image_aggregates(child);
+        if (!atomic_load_explicit(&tree->parent, memory_order_relaxed))
+            shards_init(child); // syn korzenia
+        if (!hmap_insert_hashed(children, name, child_node->name_length,
+                                hmap_hash(name, child_node->name_length), child))
+            fatal("Malloc failure.");
     }
-
-    Tree *curr_tree = tree;
+    HashMap *expected = NULL;
+    if (atomic_compare_exchange_strong_explicit(&tree->children, &expected,
+                                                children, memory_order_acq_rel,
+                                                memory_order_acquire))
+        return children;
+    // Nikt poza nami nie widział tych folderów.
     const char *key;
     void *value;
-    HashMapIterator it = hmap_iterator(tree->children);
-    while (hmap_next(tree->children, &it, &key, &value)) {
-        curr_tree = hmap_get(curr_tree->children, key);
-        tree_free(curr_tree);
-        curr_tree = tree;
-    }
-    hmap_free(tree->children);
-    if (pthread_cond_destroy(&tree->reader_type) != 0)
-        syserr("cond destroy 1 failed");
-    if (pthread_cond_destroy(&tree->writer_type) != 0)
-        syserr("cond destroy 2 failed");
-    if (pthread_mutex_destroy(&tree->lock) != 0)
-        syserr("mutex destroy failed");
-    free(tree);
+    HashMapIterator it = hmap_iterator(children);
+    while (hmap_next(children, &it, &key, &value))
+        tree_put(value);
+    hmap_free(children);
+    return expected;
 }
 
-// Jako czytelnicy przechodzimy po kolejnych folderach na drodze do rodzica
-// powstającego foldera. Rodzic w path jest pisarzem. W pętli, po przejściu
-// do syna wywoływany jest protokół końcowy rodzica.
-// Jeśli po drodze okaże się, że folder nie istnieje, zwracany jest
-// stosowny błąd.
-int tree_create(Tree *tree, const char *path) {
-    if (strcmp(path, "") == 0 || !is_path_valid(path))
-        return EINVAL;
-    if (strcmp(path, "/") == 0)
-        return EEXIST;
+// Synowie folderu. Czytelnicy optymistyczni i migawki mogą czytać tę mapę
+// bez blokady, dlatego wskaźnik jest atomowy.
+static HashMap *children_of(Tree *tree) {
+    HashMap *children = atomic_load_explicit(&tree->children,
+                                             memory_order_acquire);
+    if (!children)
+        children = materialize(tree);
+    return children;
+}
 
-    char *n_path = malloc(MAX_FOLDER_NAME_LENGTH + 1);
-    if (!n_path)
-        fatal("Malloc failure");
+static void listing_put(void *arg) {
+    Listing *listing = arg;
+    if (atomic_fetch_sub_explicit(&listing->refs, 1, memory_order_acq_rel) == 1)
+        free(listing);
+}
 
-    char *path_to_parent = make_path_to_parent(path, n_path);
-    free(path_to_parent);
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    Tree *curr_tree = tree; // zaczynamy w korzeniu
-    Tree *prev_tree = NULL; // najpierw nic nie ma wczesniej
-    char *subpath_mall = make_path_to_parent(path, component);
-    const char *subpath = subpath_mall;
+// Klasa multizbioru na capacity par albo HEIGHT_CLASSES, jeśli jest za duży.
+static int heights_class(int capacity) {
+    int size_class = 0;
+    while (size_class < HEIGHT_CLASSES && SLAB_HEIGHTS << size_class < capacity)
+        ++size_class;
+    return size_class;
+}
 
-    if (!curr_tree) {
-        free(subpath_mall);
-        return ENOENT;
-    }
-    if (strcmp(subpath, "/")) { // działamy nie tylko w korzeniu
-        tree_reader_type_entry_protocol(curr_tree);
+// Multizbiór wysokości na co najmniej capacity par.
+static Heights *heights_alloc(int capacity) {
+    Heights *heights;
+    int size_class = heights_class(capacity);
+    if (size_class < HEIGHT_CLASSES) {
+        heights = slab_alloc(&heights_caches[size_class]);
+        capacity = SLAB_HEIGHTS << size_class;
     } else {
-        tree_writer_type_entry_protocol(curr_tree);
+        heights = malloc(HEIGHTS_SIZE(capacity));
+        if (!heights)
+            fatal("Malloc failure.");
     }
-    while ((subpath = split_path(subpath, component))) {
-        prev_tree = curr_tree;
-        curr_tree = hmap_get(curr_tree->children, component);
-        if (!curr_tree) {
-            // nie znalezlismy folderu, konczymy protokoly
-            tree_reader_type_final_protocol(prev_tree);
-            free(subpath_mall);
-            free(n_path);
-            return ENOENT;
+    heights->size = 0;
+    heights->capacity = capacity;
+    return heights;
+}
+
+static void heights_free(void *arg) {
+    Heights *heights = arg;
+    if (!heights)
+        return;
+    int size_class = heights_class(heights->capacity);
+    if (size_class < HEIGHT_CLASSES)
+        slab_free(&heights_caches[size_class], heights);
+    else
+        free(heights);
+}
+
+// Oddaje referencję do folderu; ostatnia zwalnia jego pamięć.
+static void tree_put(void *arg) {
+    Tree *tree = arg;
+    if (atomic_fetch_sub_explicit(&tree->refs, 1, memory_order_acq_rel) != 1)
+        return;
+    HashMap *children = atomic_load_explicit(&tree->children,
+                                             memory_order_relaxed);
+    if (children)
+        hmap_free(children);
+    Listing *listing = atomic_load_explicit(&tree->listing, memory_order_relaxed);
+    if (listing)
+        listing_put(listing);
+    Heights *heights = atomic_load_explicit(&tree->heights,
+                                            memory_order_relaxed);
+    if (heights != IMAGE_HEIGHTS)
+        heights_free(heights);
+    free(tree->shards);
+    if (tree->id)
+        pthread_mutex_destroy(&tree->rename_lock);
+    slab_free(&tree_cache, tree);
+}
+
+static void version_free(void *arg) {
+    Version *version = arg;
+    if (version->children)
+        hmap_free(version->children);
+    tree_put(version->owner);
+    free(version);
+}
+
+// Czy version widzi któraś żywa migawka.
+static bool version_needed(const Version *version) {
+    for (TreeSnapshot *snapshot = oldest_snapshot;
+         snapshot && snapshot->version < version->until;
+         snapshot = snapshot->next) {
+        if (snapshot->version >= version->from)
+            return true;
+    }
+    return false;
+}
+
+// Wybiera wersje, których nie widzi już żadna żywa migawka, i zwraca je
+// jako listę do free_versions. Wołana pod snapshots_lock.
+// Wersje dodane przez pisarzy, którzy nie zauważyli właśnie zwolnionej
+// migawki, zostaną wybrane przy kolejnym wywołaniu. Migawki utworzone
+// później też ich nie zobaczą: ich wersje są nie mniejsze od until.
+static Version *prune_versions(void) {
+    Version *version = atomic_exchange_explicit(&retained, NULL,
+                                                memory_order_acquire);
+    Version *kept = NULL, *kept_last = NULL, *unneeded = NULL;
+    while (version) {
+        Version *next = version->next;
+        if (version_needed(version)) {
+            version->next = kept;
+            kept = version;
+            if (!kept_last)
+                kept_last = version;
+        } else {
+            version->next = unneeded;
+            unneeded = version;
         }
-        if (strcmp(subpath, "/")) { // jeszcze nie ostatni folder
-            tree_reader_type_entry_protocol(curr_tree);
-        } else { // doszliśmy do końca, jesteśmy pisarzem
-            tree_writer_type_entry_protocol(curr_tree);
+        version = next;
+    }
+    if (kept) {
+        kept_last->next = atomic_load_explicit(&retained, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(
+            &retained, &kept_last->next, kept, memory_order_release,
+            memory_order_relaxed))
+            ;
+    }
+    return unneeded;
+}
+
+// Odpina wersje z list ich folderów i zwalnia je (przez EBR, bo migawki
+// mogą je jeszcze przechodzić). Wołana już bez snapshots_lock, bo czeka na
+// blokady folderów, a pisarze trzymający je mogą czekać na dziennik, który
+// tree_save trzyma, tworząc migawkę.
+static void free_versions(Version *version) {
+    while (version) {
+        Version *next = version->next;
+        if (version->children) {
+            // Pisarze dodają wersje pod blokadą folderu; zawartość się
+            // nie zmienia, więc seq zostaje.
+            Tree *owner = version->owner;
+            rwlock_write_lock(&owner->lock);
+            rbias_revoke(&owner->bias, owner);
+            _Atomic(Version *) *link = &owner->versions;
+            while (atomic_load_explicit(link, memory_order_relaxed) != version)
+                link = &atomic_load_explicit(link, memory_order_relaxed)->older;
+            atomic_store_explicit(
+                link, atomic_load_explicit(&version->older, memory_order_relaxed),
+                memory_order_release);
+            rwlock_write_unlock(&owner->lock);
         }
-        tree_reader_type_final_protocol(prev_tree);
+        ebr_retire(version, version_free);
+        version = next;
     }
-    Tree *n_tree = tree_new();
-    bool insert_success = hmap_insert(curr_tree->children, n_path, n_tree);
+}
 
-    if (!insert_success) { // nie udało się wstawić, taki syn już istnieje
-        tree_free(n_tree);
-        tree_writer_type_final_protocol(curr_tree);
-        free(subpath_mall);
-        free(n_path);
-        return EEXIST;
+// Zwalnia drzewo bez rekurencji: foldery czekające na zwolnienie tworzą
+// stos połączony przez pole parent, więc głębokość drzewa nie ma
+// znaczenia, a zwalnianie nie potrzebuje dodatkowej pamięci. Obraz drzewa
+// wczytanego przez tree_load jest zamykany na końcu.
+static void tree_destroy(void *arg) {
+    Tree *stack = arg;
+    Image *image = stack->image;
+    atomic_store_explicit(&stack->parent, NULL, memory_order_relaxed);
+    while (stack) {
+        Tree *tree = stack;
+        stack = atomic_load_explicit(&tree->parent, memory_order_relaxed);
+        // Folder z obrazu bez mapy nie ma jeszcze synów w pamięci.
+        HashMap *children = atomic_load_explicit(&tree->children,
+                                                 memory_order_relaxed);
+        if (children) {
+            const char *key;
+            void *value;
+            HashMapIterator it = hmap_iterator(children);
+            while (hmap_next(children, &it, &key, &value)) {
+                Tree *child = value;
+                atomic_store_explicit(&child->parent, stack, memory_order_relaxed);
+                stack = child;
+            }
+            hmap_free(children);
+            atomic_store_explicit(&tree->children, NULL, memory_order_relaxed);
+        }
+        tree->image = NULL;
+        // Wpisy w dcache mogą jeszcze wskazywać na folder, ale go odrzucą.
+        atomic_store(&tree->removed, true);
+        tree_put(tree);
     }
-    tree_writer_type_final_protocol(curr_tree);
-    free(subpath_mall);
-    free(n_path);
-    return 0;
+    if (image)
+        image_close(image);
 }
 
-// Przechodzimy po kolejnych folderach w scieżce path jako czytelnicy.
-// W docelowym folderze jest wykonywana czynność czytelnika.
-// Jeśli po drodze okaże się, że folderu nie ma, po wywołaniu protokołu
-// końcowego rodzica, zwracany jest NULL.
-char *tree_list(Tree *tree, const char *path) {
-    if (!is_path_valid(path))
-        return NULL;
+void tree_free(Tree *tree) {
+    if (!tree)
+        return;
+    if (tree->journal) {
+        journal_close(tree->journal);
+        tree->journal = NULL;
+    }
+    // Wersje trzymają referencje do folderów, a żadna migawka tego drzewa
+    // już nie żyje.
+    if (pthread_mutex_lock(&snapshots_lock) != 0)
+        syserr("lock failed");
+    Version *unneeded = prune_versions();
+    if (pthread_mutex_unlock(&snapshots_lock) != 0)
+        syserr("mutex unlock failed");
+    free_versions(unneeded);
+    if (!ebr_defer(tree, tree_destroy))
+        tree_destroy(tree);
+}
+
+void tree_reclaimer_start(void) {
+    ebr_reclaimer_start();
+}
+
+void tree_reclaimer_stop(void) {
+    ebr_reclaimer_stop();
+}
+
+// Foldery, które uprzywilejowują już czytelników, a przestały się
+// kwalifikować, wyłączą tryb przy najbliższym pisarzu.
+void tree_set_reader_bias(Tree *tree, int depth) {
+    atomic_store_explicit(&tree->bias_depth, depth > 0 ? depth : 0,
+                          memory_order_relaxed);
+}
+
+// Zwraca syna folderu tree o nazwie component lub NULL, jeśli go nie ma.
+static Tree *get_child(Tree *tree, const PathComponent *component) {
+    return hmap_get_hashed(children_of(tree), component->name, component->length,
+                           component->hash);
+}
+
+// Szuka syna bez wykonywania protokołu czytelnika, jedynie czytając
+// pamięć (wewnątrz sekcji EBR). Zwraca false, jeśli w folderze był pisarz
+// i wynik może być niespójny; wpp. *child to syn lub NULL.
+static bool get_child_optimistic(Tree *tree, const PathComponent *component,
+                                 Tree **child) {
+    unsigned int seq = atomic_load_explicit(&tree->seq, memory_order_acquire);
+    if (seq & 1)
+        return false;
+    *child = get_child(tree, component);
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&tree->seq, memory_order_relaxed) == seq;
+}
 
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
+// Przechodzi optymistycznie od korzenia po n pierwszych components.
+// Zwraca false, jeśli trzeba spróbować ponownie; wpp. *found to
+// znaleziony folder lub NULL, jeśli któryś folder nie istnieje.
+static bool find_optimistic(Tree *tree, const PathComponent *components,
+                            int n, Tree **found) {
     Tree *curr_tree = tree;
-    Tree *prev_tree = NULL;
+    for (int i = 0; i < n && curr_tree; ++i) {
+        if (!get_child_optimistic(curr_tree, &components[i], &curr_tree))
+            return false;
+    }
+    *found = curr_tree;
+    return true;
+}
 
-    const char *subpath = path;
-    if (!curr_tree)
-        return NULL;
+// Liczba najwyższych poziomów drzewa tree, których foldery mogą
+// uprzywilejować czytelników (zob. tree_set_reader_bias).
+static int bias_depth(Tree *tree) {
+    return atomic_load_explicit(&tree->bias_depth, memory_order_relaxed);
+}
 
-    tree_reader_type_entry_protocol(curr_tree); // zaczynamy czytać w korzeniu
-    while ((subpath = split_path(subpath, component))) {
-        prev_tree = curr_tree;
-        curr_tree = hmap_get(curr_tree->children, component);
+// Schodzi z folderu start (w którym wykonany jest już protokół wstępny)
+// po kolejnych n folderach z components, metodą "z ręki do ręki":
+// protokół końcowy rodzica jest wołany dopiero po wejściu do syna.
+// W ostatnim folderze wykonywany jest protokół wstępny pisarza, jeśli
+// as_writer, a czytelnika w przeciwnym przypadku. Jeśli release_start,
+// start jest zwalniany jak każdy inny folder na drodze (musi być wtedy
+// czytelnikiem), inaczej pozostaje zajęty w każdym przypadku.
+// Foldery mniej niż bias_levels poziomów pod start mogą uprzywilejować
+// czytelników (zob. reader_enter).
+// Zwraca ostatni folder lub NULL, jeśli któryś folder nie istnieje
+// (wtedy zwolnione są wszystkie protokoły poza ewentualnie startem).
+static Tree *descend(Tree *start, const PathComponent *components, int n,
+                     bool as_writer, bool release_start, int bias_levels) {
+    Tree *curr_tree = start;
+    for (int i = 0; i < n; ++i) {
+        Tree *prev_tree = curr_tree;
+        curr_tree = get_child(prev_tree, &components[i]);
         if (!curr_tree) {
-            tree_reader_type_final_protocol(prev_tree);
+            if (i > 0 || release_start)
+                tree_reader_type_final_protocol(prev_tree);
             return NULL;
         }
-        tree_reader_type_entry_protocol(curr_tree);
-        tree_reader_type_final_protocol(prev_tree);
+        if (i == n - 1 && as_writer) // doszliśmy do końca, jesteśmy pisarzem
+            tree_writer_type_entry_protocol(curr_tree);
+        else
+            reader_enter(curr_tree, i + 1 < bias_levels);
+        if (i > 0 || release_start)
+            tree_reader_type_final_protocol(prev_tree);
     }
-    // doszliśmy do folderu, pobieramy jego zawartość
-    char *list = make_map_contents_string(curr_tree->children);
-    tree_reader_type_final_protocol(curr_tree);
-    return list;
+    return curr_tree;
 }
 
-// Przechodzimy do rodzica docelowo usuwanego folderu jako czytelnicy.
-// Rodzic ostatniego folderu na scieżce path działa jako pisarz
-// i usuwa z listy swoich dzieci podany folder.
-// Jeśli gdzieś po drodze okaże się, że jakiś folder nie istnieje,
-// zwalniane jest "miejsce w bibliotece" i zwracany stosowny błąd.
-int tree_remove(Tree *tree, const char *path) {
-    if (!is_path_valid(path))
-        return EINVAL;
-    if (strcmp(path, "/") == 0)
-        return EBUSY;
+// Wchodzi do folderu found drzewa tree, znalezionego bez protokołów po
+// drodze, gdy rename_seq drzewa było równe seq. Jeśli od tego czasu coś
+// zostało przeniesione albo found został usunięty, wychodzi z niego
+// i zwraca false.
+static bool enter_validated(Tree *tree, Tree *found, unsigned long long seq,
+                            bool as_writer, bool biasable) {
+    if (as_writer)
+        tree_writer_type_entry_protocol(found);
+    else
+        reader_enter(found, biasable);
+    if (!atomic_load(&found->removed) && atomic_load(&tree->rename_seq) == seq)
+        return true;
+    if (as_writer)
+        tree_writer_type_final_protocol(found);
+    else
+        tree_reader_type_final_protocol(found);
+    return false;
+}
 
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    char componentToRemove[MAX_FOLDER_NAME_LENGTH + 1];
-    Tree *curr_tree = tree; // zaczynamy w korzeniu
-    Tree *prev_tree = NULL; // najpierw nic nie ma wcześniej
-    char *subpath_mall = make_path_to_parent(path, componentToRemove);
-    const char *subpath = subpath_mall;
-    if (!curr_tree) {
-        free(subpath_mall);
-        return ENOENT;
+// Skrót ścieżki w drzewie tree, liczony komponent po komponencie:
+// path_hash_finish(path_hash_step(...path_hash_step(path_hash_start(tree),
+// c1)..., cn)).
+static unsigned long long path_hash_start(Tree *tree) {
+    return tree->id * 0x9e3779b97f4a7c15ULL;
+}
+
+static unsigned long long path_hash_step(unsigned long long hash,
+                                         const PathComponent *component) {
+    return (hash ^ component->hash) * 0x100000001b3ULL;
+}
+
+static unsigned long long path_hash_finish(unsigned long long hash) {
+    return hash ^ hash >> 29;
+}
+
+// Skrót ścieżki z n pierwszych components w drzewie tree, dla dcache.
+static unsigned long long path_hash(Tree *tree,
+                                    const PathComponent *components, int n) {
+    unsigned long long hash = path_hash_start(tree);
+    for (int i = 0; i < n; ++i)
+        hash = path_hash_step(hash, &components[i]);
+    return path_hash_finish(hash);
+}
+
+// Sprawdza, czy folder found leży na głębokości n drzewa tree i żaden
+// folder na drodze od niego do korzenia nie był usunięty ani przenoszony
+// po chwili, w której rename_seq było równe stamp (ma gen nie większy niż
+// stamp). Wtedy found leży na tej samej ścieżce co w tamtej chwili.
+static bool unmoved_since(Tree *tree, Tree *found, int n,
+                          unsigned long long stamp) {
+    // Rodzic folderu, który nie był usunięty, gdy to sprawdziliśmy,
+    // nie zostanie zwolniony przed końcem naszej sekcji EBR.
+    Tree *curr_tree = found;
+    for (int i = 0; i < n && curr_tree; ++i) {
+        if (atomic_load(&curr_tree->removed) ||
+            atomic_load_explicit(&curr_tree->gen, memory_order_relaxed) > stamp)
+            return false;
+        curr_tree = atomic_load_explicit(&curr_tree->parent,
+                                         memory_order_relaxed);
     }
-    if (strcmp(subpath, "/")) { // nie tylko w korzeniu działamy
-        // zaczynamy czytać w korzeniu
-        tree_reader_type_entry_protocol(curr_tree);
-    } else { // od razu piszemy w korzeniu, nie wchodzimy do pętli
-        tree_writer_type_entry_protocol(curr_tree);
+    return curr_tree == tree;
+}
+
+// Szuka folderu na głębokości n w dcache i wchodzi do niego.
+// Wpis ze stemplem równym rename_seq jest aktualny, bo od jego powstania nic
+// nie zostało przeniesione. W przeciwnym przypadku idziemy od znalezionego
+// folderu do korzenia: wpis jest aktualny, jeśli żaden folder na drodze nie
+// był przenoszony po jego stemplu (ma gen nie większy niż stempel).
+// Wtedy stempel jest odświeżany. Zwraca NULL, jeśli wpisu nie ma lub jest
+// nieaktualny.
+static Tree *lookup_cached(Tree *tree, const char *key, size_t length,
+                           unsigned long long hash, int n, bool as_writer) {
+    unsigned long long seq = atomic_load(&tree->rename_seq);
+    if (seq & 1)
+        return NULL;
+    DCacheEntry *entry = dcache_lookup(tree->id, key, length, hash);
+    if (!entry)
+        return NULL;
+    Tree *found = entry->value;
+    unsigned long long stamp =
+        atomic_load_explicit(&entry->stamp, memory_order_relaxed);
+    if (stamp != seq && !unmoved_since(tree, found, n, stamp))
+        return NULL;
+    if (!enter_validated(tree, found, seq, as_writer, n < bias_depth(tree)))
+        return NULL;
+    if (stamp != seq)
+        atomic_store_explicit(&entry->stamp, seq, memory_order_relaxed);
+    return found;
+}
+
+// Przechodzi od korzenia do folderu opisanego przez n pierwszych
+// components i wykonuje w nim protokół wstępny czytelnika albo pisarza.
+// Głębokie ścieżki najpierw szukamy w dcache. Potem próbujemy bez protokołów
+// po drodze (find_optimistic), sprawdzając po wejściu do folderu, że nie
+// został w międzyczasie usunięty ani nic nie zostało przeniesione; udane
+// przejście zapamiętujemy w dcache. Jeśli w folderach na drodze są pisarze,
+// przechodzimy jak descend.
+// Musi być wołana wewnątrz sekcji EBR.
+static Tree *walk_path(Tree *tree, const PathComponent *components, int n,
+                       bool as_writer) {
+    // Kluczem w dcache jest ścieżka od '/' przed pierwszym komponentem
+    // do '/' po ostatnim.
+    bool cacheable = n >= DCACHE_MIN_COMPONENTS;
+    const char *key = NULL;
+    size_t length = 0;
+    unsigned long long hash = 0;
+    if (cacheable) {
+        key = components[0].name - 1;
+        length = components[n - 1].name + components[n - 1].length + 1 - key;
+        hash = path_hash(tree, components, n);
+        Tree *found = lookup_cached(tree, key, length, hash, n, as_writer);
+        dcache_record(found != NULL);
+        if (found)
+            return found;
     }
-    // chodzenie po drzewie aż do podanego folderu
-    while ((subpath = split_path(subpath, component))) {
-        prev_tree = curr_tree;
-        curr_tree = hmap_get(curr_tree->children, component);
-        if (!curr_tree) {
-            tree_reader_type_final_protocol(prev_tree);
-            free(subpath_mall);
-            return ENOENT;
+
+    for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; ++attempt) {
+        unsigned long long seq = atomic_load(&tree->rename_seq);
+        if (seq & 1)
+            continue;
+        Tree *found;
+        if (!find_optimistic(tree, components, n, &found))
+            continue;
+        if (!found) {
+            if (atomic_load(&tree->rename_seq) == seq)
+                return NULL;
+            continue;
         }
-        if (strcmp(subpath, "/")) { // jeszcze nie ostatni folder
-            tree_reader_type_entry_protocol(curr_tree);
-        } else { // doszliśmy do końca, jesteśmy pisarzem
-            tree_writer_type_entry_protocol(curr_tree);
+        if (!enter_validated(tree, found, seq, as_writer, n < bias_depth(tree)))
+            continue;
+        if (cacheable) {
+            atomic_fetch_add_explicit(&found->refs, 1, memory_order_relaxed);
+            dcache_insert(tree->id, key, length, hash, found, tree_put, seq);
         }
-        tree_reader_type_final_protocol(prev_tree);
+        return found;
     }
 
-    free(subpath_mall);
-    // węzeł drzewa do usunięcia
-    Tree *final_tree = hmap_get(curr_tree->children, componentToRemove);
-    if (!final_tree) {
-        tree_writer_type_final_protocol(curr_tree);
-        return ENOENT;
-    }
-    tree_reader_type_final_protocol(final_tree);
-    if (hmap_size(final_tree->children) != 0) {
-        tree_writer_type_final_protocol(curr_tree);
-        tree_reader_type_final_protocol(final_tree);
-        return ENOTEMPTY;
-    }
-    hmap_remove(curr_tree->children, componentToRemove);
-    tree_free(final_tree);
-    tree_writer_type_final_protocol(curr_tree);
-    return 0;
+    if (n == 0 && as_writer)
+        tree_writer_type_entry_protocol(tree);
+    else
+        reader_enter(tree, bias_depth(tree) > 0);
+    return descend(tree, components, n, as_writer, true, bias_depth(tree));
 }
 
-// Sprawdza, czy target jest podfolderem source.
-bool moving_to_own_subtree(const char *source, const char *target) {
-    size_t len_shorter;
-    if (strlen(source) < strlen(target))
-        len_shorter = strlen(source);
-    else
-        return false; // jak target jest krótszy, nie może być podfolderem
-    for (size_t i = 0; i < len_shorter; ++i) {
-        if (source[i] != target[i])
-            return false;
-    }
-    // target jest dłuższy lub równy, i na całej długości source są takie same
-    return true;
+// Stempel zmiany (zob. snapshot_clock) i wersja najnowszej żywej migawki
+// w chwili jej wykonania.
+typedef struct {
+    unsigned long long stamp;
+    unsigned long long newest;
+} Stamp;
+
+// Daje stempel zmianie, którą pisarz zaraz wykona w folderach, w których
+// już jest. Zmiana kilku folderów (przeniesienie) dostaje jeden stempel,
+// więc migawka widzi ją w całości albo wcale.
+// Bariera łączy się z barierą w tree_snapshot (jak w algorytmie Dekkera):
+// albo widzimy nową migawkę, albo ona widzi nieparzyste seq folderu
+// i czeka, aż z niego wyjdziemy.
+static Stamp stamp_change(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    Stamp stamp;
+    // Najpierw zegar: jeśli widzimy nową wersję, widzimy też newest_snapshot
+    // ustawione przed nią.
+    stamp.stamp = atomic_load(&snapshot_clock) + 1;
+    stamp.newest = atomic_load(&newest_snapshot);
+    return stamp;
 }
 
-// Zwraca wspólną ścieżkę podanych dwóch scieżek.
-char *shared_path(const char *to_source, const char *to_target) {
-    char *subpath = strchr(to_source + 1, '/'); // + 1 by uniknąć pierwszego '/'
+// Dodaje version do listy wersji do zwolnienia.
+static void retain(Version *version) {
+    version->next = atomic_load_explicit(&retained, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&retained, &version->next,
+                                                  version, memory_order_release,
+                                                  memory_order_relaxed))
+        ;
+}
 
-    size_t total_length = 1;
-    while (subpath) {
-        size_t curr_length = subpath - (to_source + total_length) + 1;
-        if (strncmp(to_source + total_length, to_target + total_length,
-                    curr_length) != 0) {
-            subpath = NULL;
-        } else {
-            total_length += curr_length;
-            subpath = strchr(subpath + 1, '/');
-        }
+// Zwraca mapę synów folderu tree, w którym jesteśmy pisarzem, do wykonania
+// w niej zmiany ze stemplem stamp. Jeśli obecną zawartość może czytać żywa
+// migawka, zostaje ona zamrożona jako wersja, a folder dostaje kopię (to
+// jedyny koszt migawek dla pisarzy, i to tylko w zmienianych folderach).
+static HashMap *change_children(Tree *tree, Stamp stamp) {
+    HashMap *children = children_of(tree);
+    unsigned long long current =
+        atomic_load_explicit(&tree->stamp, memory_order_relaxed);
+    if (stamp.newest && current <= stamp.newest) {
+        Version *version = malloc(sizeof(Version));
+        HashMap *copy = hmap_copy(children);
+        if (!version || !copy)
+            fatal("Malloc failure.");
+        version->children = children;
+        version->from = current;
+        version->until = stamp.stamp;
+        version->owner = tree;
+        atomic_fetch_add_explicit(&tree->refs, 1, memory_order_relaxed);
+        atomic_init(&version->older,
+                    atomic_load_explicit(&tree->versions, memory_order_relaxed));
+        atomic_store_explicit(&tree->versions, version, memory_order_release);
+        retain(version);
+        atomic_store_explicit(&tree->children, copy, memory_order_release);
+        children = copy;
     }
-    total_length++; // na końcowe \0
+    atomic_store_explicit(&tree->stamp, stamp.stamp, memory_order_relaxed);
+    return children;
+}
 
-    char *shared = malloc(total_length);
-    if (!shared)
-        fatal("Malloc failure.");
+// W drzewie z dziennikiem (zob. tree_journal_open) każda zmiana jest
+// wykonywana i dopisywana do dziennika w jednej sekcji krytycznej dziennika
+// (journal_lock), więc wpisy są w kolejności zmian. Dopisanie tylko kopiuje
+// wpis do pamięci; na zapis na dysk operacja czeka (journal_wait) dopiero
+// po wyjściu z folderów, więc nikt nie trzyma blokad folderów podczas
+// wejścia-wyjścia, a jeden fsync obsługuje wiele operacji.
+// Wpisy są odtwarzane po kolei według ścieżek, więc ścieżka we wpisie musi
+// wskazywać zmieniany folder w chwili dopisania. Ścieżki innych folderów
+// zmienia tylko przeniesienie, które nie blokuje poddrzewa przenoszonego
+// folderu. Dlatego tree_create i tree_remove zapamiętują rename_seq drzewa
+// przed przejściem ścieżki i w sekcji krytycznej sprawdzają, że w tym
+// czasie nic nie zostało przeniesione (tree_move zmienia rename_seq tylko
+// w swojej sekcji krytycznej), a jeśli zostało, przechodzą ścieżkę od nowa.
 
-    strncpy(shared, to_source, total_length - 1);
-    shared[total_length - 1] = '\0';
-    return shared;
+// Zwraca rename_seq drzewa tree, gdy żaden folder nie jest przepinany.
+static unsigned long long stable_rename_seq(Tree *tree) {
+    unsigned long long seq;
+    while ((seq = atomic_load(&tree->rename_seq)) & 1)
+        sched_yield();
+    return seq;
 }
 
-// Przechodzimy jako czytelnicy do LCA rodziców source i target.
-// Blokujemy poddrzewo wywołując protokół wstępny pisarza na LCA.
-// Następnie jako czytelnicy dochodzimy do rodzica source, gdzie
-// wykonywane są operacje pisarza. Potem analogicznie dla rodzica target.
-// Folder LCA zwalniamy jest po zakończeniu całej operacji.
-// Jeśli po drodze okaże się, że jakiś folder nie istnieje,
-// wywoływane są protokoły końcowe i zwracany jest stosowny błąd.
-int tree_move(Tree *tree, const char *source, const char *target) {
-    if (!is_path_valid(source) || !is_path_valid(target))
-        return EINVAL;
-    if (strcmp(source, "/") == 0)
-        return EBUSY;
-    if (strcmp(target, "/") == 0)
-        return EEXIST;
-    if (moving_to_own_subtree(source, target))
-        return EILLEGALMOVE;
+// Wchodzi do sekcji krytycznej dziennika drzewa tree, jeśli od odczytania
+// seq przez stable_rename_seq nic w nim nie zostało przeniesione.
+static bool journal_enter(Tree *tree, unsigned long long seq) {
+    journal_lock(tree->journal);
+    if (atomic_load(&tree->rename_seq) == seq)
+        return true;
+    journal_unlock(tree->journal);
+    return false;
+}
 
-    char comp_target[MAX_FOLDER_NAME_LENGTH + 1];
-    char *help = make_path_to_parent(target, comp_target);
-    char comp_source[MAX_FOLDER_NAME_LENGTH + 1];
-    char *help2 = make_path_to_parent(source, comp_source);
-    free(help);
-    free(help2);
+// Bramki agregatów. Zmiana w folderze poprawia agregaty (zob. tree_stat)
+// u wszystkich jego przodków, bez ich blokad, a przodkowie nie mogą się
+// przy tym zmienić: poprawka zaczęta przed przeniesieniem i skończona po
+// nim zostawiłaby na zawsze złe liczby u starych albo nowych przodków.
+// Przeniesienie zmienia jednak przodków tylko w poddrzewie przenoszonego
+// folderu, a to leży w jednym folderze najwyższego poziomu (synu korzenia)
+// przed przepięciem i w jednym po nim. Dlatego poprawki wykonuje się
+// w bramce folderu najwyższego poziomu, przez który przechodzą (bramek jest
+// GATES, foldery trafiają do nich według adresu), a tree_move zamyka na
+// czas przepinania tylko bramki starego i nowego folderu najwyższego
+// poziomu i przed przepięciem czeka, aż wszyscy z nich wyjdą. Poprawki
+// w innych poddrzewach się nie wstrzymują. Wątki w bramkach są liczone
+// w częściach korzenia (Shard.inside), więc tworzenie w różnych folderach
+// nie walczy o jedną linię pamięci.
 
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    char *path_to_parent = make_path_to_parent(target, component);
-    char *shared = shared_path(source, path_to_parent);
-    char comp_src_help[MAX_FOLDER_NAME_LENGTH + 1];
-    char comp_tgt_help[MAX_FOLDER_NAME_LENGTH + 1];
+// Część liczników, którą zmienia bieżący wątek.
+static int shard_index(void) {
+    static atomic_uint threads = 0;
+    static _Thread_local int index = -1;
+    if (index < 0)
+        index = atomic_fetch_add_explicit(&threads, 1, memory_order_relaxed) %
+                SHARDS;
+    return index;
+}
 
-    Tree *curr_tree = tree;
-    Tree *prev_tree = NULL;
-    if (strcmp(shared, "/") == 0) { // działamy nie tylko w korzeniu
-        tree_writer_type_entry_protocol(curr_tree);
-    } else {
-        tree_reader_type_entry_protocol(curr_tree);
-        const char *subpath_source = source;
-        const char *subpath_target_parent = path_to_parent;
-        subpath_source = split_path(subpath_source, comp_src_help);
-        subpath_target_parent = split_path(subpath_target_parent,
-                                           comp_tgt_help);
-        // chodzenie po drzewie aż do LCA włącznie, który zostaje pisarzem
-        while (strcmp(comp_src_help, comp_tgt_help) == 0) {
-            prev_tree = curr_tree;
-            curr_tree = hmap_get(curr_tree->children, comp_src_help);
-            if (!curr_tree) {
-                tree_reader_type_final_protocol(prev_tree);
-                free(path_to_parent);
-                free(shared);
-                return ENOENT;
-            }
-            subpath_source = split_path(subpath_source, comp_src_help);
-            subpath_target_parent = split_path(subpath_target_parent,
-                                               comp_tgt_help);
+// Bramka folderu najwyższego poziomu top.
+static int top_gate(const Tree *top) {
+    return (int)((((uint64_t)(uintptr_t)top * 0x9e3779b97f4a7c15u) >> 32) %
+                 GATES);
+}
 
-            if (strcmp(comp_src_help, comp_tgt_help) ||
-                !subpath_target_parent) {
-                tree_writer_type_entry_protocol(curr_tree);
-                tree_reader_type_final_protocol(prev_tree);
-                break;
-            }
-            tree_reader_type_entry_protocol(curr_tree);
-            tree_reader_type_final_protocol(prev_tree);
-        }
+// Bramka folderu najwyższego poziomu drzewa tree, w którym leży folder
+// (różny od korzenia).
+static int gate_of(Tree *tree, Tree *folder) {
+    for (;;) {
+        Tree *parent = atomic_load_explicit(&folder->parent,
+                                            memory_order_acquire);
+        if (parent == tree)
+            return top_gate(folder);
+        folder = parent;
     }
+}
 
-    const char *path_target_parent_left = path_to_parent + strlen(shared) - 1;
-    char *path_to_parent_src = make_path_to_parent(source, component);
-    const char *path_source_parent_left =
-            path_to_parent_src + strlen(shared) - 1;
+// Wchodzi do bramki, w której poprawia się agregaty przodków folderu
+// drzewa tree, i zwraca ją (-1 w korzeniu, który nie ma przodków).
+static int gate_enter(Tree *tree, Tree *folder) {
+    if (folder == tree)
+        return -1;
+    for (;;) {
+        // Bramka wyznaczona przed przeniesieniem, które zaczęło się przed
+        // wejściem do niej, mogła się zdezaktualizować, więc wtedy
+        // wyznaczamy ją od nowa.
+        unsigned long long seq = atomic_load(&tree->rename_seq);
+        int gate = gate_of(tree, folder);
+        atomic_uint *inside = &tree->shards[shard_index()].inside[gate];
+        // Jak w algorytmie Dekkera z gate_close: albo przeniesienie widzi
+        // nas w bramce i czeka, albo my widzimy zamkniętą bramkę.
+        atomic_fetch_add(inside, 1);
+        if (!(atomic_load(&tree->closed_gates) & 1u << gate) &&
+            atomic_load(&tree->rename_seq) == seq)
+            return gate;
+        atomic_fetch_sub(inside, 1);
+        while (atomic_load(&tree->closed_gates) & 1u << gate)
+            sched_yield();
+    }
+}
 
-    Tree *source_tree = curr_tree;
-    Tree *target_tree = curr_tree;
+static void gate_exit(Tree *tree, int gate) {
+    if (gate >= 0)
+        atomic_fetch_sub_explicit(&tree->shards[shard_index()].inside[gate],
+                                  1, memory_order_release);
+}
 
-    if (!curr_tree) {
-        free(path_to_parent);
-        free(path_to_parent_src);
-        free(shared);
-        return ENOENT;
+// Wołane przez tree_move pod rename_lock, przed rename_begin: zamyka bramki
+// gates (maska bitów) drzewa tree i czeka, aż poprzednie poprawki agregatów
+// w nich się skończą.
+static void gate_close(Tree *tree, unsigned gates) {
+    atomic_fetch_or(&tree->closed_gates, gates);
+    for (int gate = 0; gate < GATES; ++gate) {
+        if (!(gates & 1u << gate))
+            continue;
+        for (int i = 0; i < SHARDS; ++i) {
+            while (atomic_load(&tree->shards[i].inside[gate]))
+                sched_yield();
+        }
     }
+}
 
-    bool first = true;
-    // chodzenie po drzewie do rodzica source
-    while ((path_source_parent_left = split_path(path_source_parent_left,
-                                                 component))) {
-        prev_tree = source_tree;
-        source_tree = hmap_get(source_tree->children, component);
-        if (!source_tree) {
-            if (prev_tree->writer_type_count > 0) {
-                tree_writer_type_final_protocol(prev_tree);
-            } else {
-                tree_reader_type_final_protocol(prev_tree);
+static void gate_open(Tree *tree, unsigned gates) {
+    atomic_fetch_and_explicit(&tree->closed_gates, ~gates,
+                              memory_order_release);
+}
+
+// Dodaje do prywatnego (jeszcze nie opublikowanego) multizbioru *heights
+// count synów (ujemne count usuwa) o wysokości height.
+static void heights_add(Heights **heights, int height, long count) {
+    Heights *set = *heights;
+    int size = set ? set->size : 0;
+    int i = 0;
+    while (i < size && set->entries[i].height < height)
+        ++i;
+    if (i < size && set->entries[i].height == height) {
+        set->entries[i].count += count;
+        if (set->entries[i].count == 0) {
+            memmove(&set->entries[i], &set->entries[i + 1],
+                    (size - i - 1) * sizeof(HeightCount));
+            if (--set->size == 0) {
+                heights_free(set);
+                *heights = NULL;
             }
-            if (prev_tree != curr_tree)
-                tree_writer_type_final_protocol(curr_tree); // pisanie w LCA
-            free(path_to_parent);
-            free(path_to_parent_src);
-            free(shared);
-            return ENOENT;
         }
-        if (strcmp(path_source_parent_left, "/") != 0) { // jeszcze nie ostatni
-            tree_reader_type_entry_protocol(source_tree);
-        } else { // doszliśmy do końca, jesteśmy pisarzem
-            tree_writer_type_entry_protocol(source_tree);
+        return;
+    }
+    if (!set || size == set->capacity) {
+        Heights *grown = heights_alloc(set ? 2 * set->capacity : 1);
+        if (set) {
+            memcpy(grown->entries, set->entries, size * sizeof(HeightCount));
+            heights_free(set);
         }
-        if (!first)
-            tree_reader_type_final_protocol(prev_tree);
-        first = false;
+        grown->size = size;
+        *heights = set = grown;
     }
-    Tree *source_to_remove = hmap_get(source_tree->children, comp_source);
-    if (!source_to_remove) {
-        if (!first)
-            tree_writer_type_final_protocol(source_tree);
-        tree_writer_type_final_protocol(curr_tree);
-        free(path_to_parent);
-        free(path_to_parent_src);
-        free(shared);
-        return ENOENT;
+    memmove(&set->entries[i + 1], &set->entries[i],
+            (size - i) * sizeof(HeightCount));
+    set->entries[i] = (HeightCount){height, count};
+    set->size++;
+}
+
+// Wysokość folderu z wysokościami synów heights: o jeden większa od
+// największej wysokości, której liczba synów jest dodatnia.
+static int heights_max(const Heights *heights) {
+    for (int i = heights ? heights->size - 1 : -1; i >= 0; --i) {
+        if (heights->entries[i].count > 0)
+            return heights->entries[i].height + 1;
     }
-    // dzieci source, potem potrzebne do wstawienia do folderu target
-    HashMap *copy_of_source = source_to_remove->children;
-    bool first_target = true;
-    // chodzenie po drzewie aż do rodzica targetu
-    while ((path_target_parent_left = split_path(path_target_parent_left,
-                                                component))) {
-        prev_tree = target_tree;
-        target_tree = hmap_get(target_tree->children, component);
-        if (!target_tree) {
-            // nie znalezlismy folderu, konczymy protokoly
-            if (prev_tree != curr_tree)
-                tree_reader_type_final_protocol(prev_tree);
-            if (source_tree != curr_tree)
-                tree_writer_type_final_protocol(source_tree);
-            tree_writer_type_final_protocol(curr_tree);
-            free(path_to_parent);
-            free(path_to_parent_src);
-            free(shared);
-            return ENOENT;
-        }
-        if (strcmp(path_target_parent_left, "/")) { // jeszcze nie ostatni
-            tree_reader_type_entry_protocol(target_tree);
-        } else { // doszliśmy do końca, jesteśmy pisarzem
-            tree_writer_type_entry_protocol(target_tree);
+    return 0;
+}
+
+// Wysokość folderu tree z wysokościami synów heights.
+static int heights_height(const Tree *tree, const Heights *heights) {
+    if (heights == IMAGE_HEIGHTS)
+        return (int)tree->image->nodes[tree->index].height;
+    return heights_max(heights);
+}
+
+// Wewnątrz sekcji EBR.
+static int height_of(Tree *tree) {
+    return heights_height(tree, atomic_load_explicit(&tree->heights,
+                                                     memory_order_acquire));
+}
+
+// Prywatna kopia multizbioru heights folderu tree.
+static Heights *heights_copy(Tree *tree, const Heights *heights) {
+    Heights *copy = NULL;
+    if (heights == IMAGE_HEIGHTS) {
+        const ImageNode *nodes = tree->image->nodes;
+        const ImageNode *node = &nodes[tree->index];
+        for (uint32_t i = node->first_child;
+             i < node->first_child + node->child_count; ++i)
+            heights_add(&copy, (int)nodes[i].height, 1);
+    } else if (heights) {
+        copy = heights_alloc(heights->size);
+        memcpy(copy->entries, heights->entries,
+               heights->size * sizeof(HeightCount));
+        copy->size = heights->size;
+    }
+    return copy;
+}
+
+// W bramce agregatów albo przy zamkniętych bramkach, wewnątrz sekcji EBR:
+// wysokość jednego syna folderu tree zmienia się z removed na added (-1
+// oznacza brak syna, czyli dołączenie albo odłączenie). Nowy multizbiór
+// wysokości podmieniamy w folderze CAS-em, bez blokad, więc zmiany
+// przychodzące od różnych synów się nie wstrzymują. Jeśli zmienia to
+// wysokość folderu (z wynikającej z poprzedniego multizbioru na wynikającą
+// z nowego), tak samo poprawiamy ją u kolejnych przodków, aż wysokość się
+// nie zmieni, więc zwykle zaraz u rodzica.
+// Zmiany wysokości jednego syna mogą dotrzeć do rodzica w innej kolejności,
+// niż zaszły (liczba przy wysokości bywa wtedy chwilowo ujemna), ale
+// poprawki się dodają, więc po dotarciu wszystkich multizbiór jest dokładny.
+// Tak samo sumują się przekazywane dalej zmiany wysokości: kolejne
+// podmiany multizbioru folderu dają u rodzica łącznie zmianę z wysokości
+// pierwszego na wysokość ostatniego.
+static void change_heights(Tree *tree, int removed, int added) {
+    while (tree) {
+        Heights *old = atomic_load_explicit(&tree->heights,
+                                            memory_order_acquire);
+        Heights *heights;
+        int old_height;
+        for (;;) {
+            old_height = heights_height(tree, old);
+            heights = heights_copy(tree, old);
+            if (removed >= 0)
+                heights_add(&heights, removed, -1);
+            if (added >= 0)
+                heights_add(&heights, added, 1);
+            if (atomic_compare_exchange_weak_explicit(
+                    &tree->heights, &old, heights, memory_order_acq_rel,
+                    memory_order_acquire))
+                break;
+            heights_free(heights);
         }
+        if (old && old != IMAGE_HEIGHTS)
+            ebr_retire(old, heights_free);
+        int height = heights_max(heights);
+        if (height == old_height)
+            return;
+        tree = atomic_load_explicit(&tree->parent, memory_order_relaxed);
+        removed = old_height;
+        added = height;
+    }
+}
 
-        if (!first_target && prev_tree != curr_tree) {
-            if (prev_tree->writer_type_count == 0)
-                tree_reader_type_final_protocol(prev_tree);
-            else
-                tree_writer_type_final_protocol(prev_tree);
-        }
-        first_target = false;
-    }
-    Tree *n_tree = tree_new();
-    hmap_free(n_tree->children);
-    n_tree->children = copy_of_source;
-    bool insert_success = hmap_insert(target_tree->children, comp_target,
-                                      n_tree);
-    if (!insert_success) { // nie udało się wstawić, taki syn już istnieje
-        free(path_to_parent_src);
-        free(path_to_parent);
-        free(shared);
-        free(n_tree);
-        if (!first)
-            tree_writer_type_final_protocol(source_tree);
-        if (!first_target)
-            tree_writer_type_final_protocol(target_tree);
-        tree_writer_type_final_protocol(curr_tree);
-        return EEXIST;
+// Liczba potomków folderu tree. Części czytamy po kolei, więc ze zmian
+// współbieżnych z czytaniem suma może uwzględniać tylko niektóre, ale
+// uwzględnia wszystkie zakończone przed nim.
+static size_t count_descendants(const Tree *tree) {
+    size_t count = atomic_load_explicit(&tree->descendants,
+                                        memory_order_relaxed);
+    if (tree->shards) {
+        for (int i = 0; i < SHARDS; ++i)
+            count += atomic_load_explicit(&tree->shards[i].descendants,
+                                          memory_order_relaxed);
     }
+    return count;
+}
 
-    free(source_to_remove);
-    hmap_remove(source_tree->children, comp_source);
-    if (!first)
-        tree_writer_type_final_protocol(source_tree);
-    if (!first_target)
-        tree_writer_type_final_protocol(target_tree);
-    tree_writer_type_final_protocol(curr_tree);
+// Dodaje delta do liczby potomków folderu tree i wszystkich jego przodków,
+// w folderach z częściami liczników do części bieżącego wątku.
+static void add_descendants(Tree *tree, ptrdiff_t delta) {
+    for (; tree; tree = atomic_load_explicit(&tree->parent,
+                                             memory_order_relaxed)) {
+        atomic_size_t *counter = tree->shards
+                                     ? &tree->shards[shard_index()].descendants
+                                     : &tree->descendants;
+        atomic_fetch_add_explicit(counter, (size_t)delta, memory_order_relaxed);
+    }
+}
 
-    free(path_to_parent_src);
-    free(path_to_parent);
-    free(shared);
+// W folderze parent drzewa tree, w którym jesteśmy pisarzem, dołączamy
+// syna (attached) albo go odłączamy; jego poddrzewo ma size folderów
+// i wysokość height.
+static void aggregate_child(Tree *tree, Tree *parent, bool attached,
+                            size_t size, int height) {
+    int gate = gate_enter(tree, parent);
+    add_descendants(parent, attached ? (ptrdiff_t)size : -(ptrdiff_t)size);
+    change_heights(parent, attached ? -1 : height, attached ? height : -1);
+    gate_exit(tree, gate);
+}
 
+// Przy zamkniętych bramkach folderu moved (zob. gate_close): przenosi
+// agregaty folderu moved z przodków source_parent (na głębokości
+// source_depth) do przodków target_parent. Przodkowie wspólni obu folderom
+// się nie zmieniają.
+static void move_aggregates(Tree *moved, Tree *source_parent,
+                            int source_depth, Tree *target_parent,
+                            int target_depth) {
+    if (source_parent == target_parent)
+        return;
+    ptrdiff_t size = 1 + (ptrdiff_t)count_descendants(moved);
+    Tree *source = source_parent, *target = target_parent;
+    for (; source_depth > target_depth; --source_depth) {
+        atomic_fetch_sub_explicit(&source->descendants, size,
+                                  memory_order_relaxed);
+        source = atomic_load_explicit(&source->parent, memory_order_relaxed);
+    }
+    for (; target_depth > source_depth; --target_depth) {
+        atomic_fetch_add_explicit(&target->descendants, size,
+                                  memory_order_relaxed);
+        target = atomic_load_explicit(&target->parent, memory_order_relaxed);
+    }
+    for (; source != target;
+         source = atomic_load_explicit(&source->parent, memory_order_relaxed),
+         target = atomic_load_explicit(&target->parent, memory_order_relaxed)) {
+        atomic_fetch_sub_explicit(&source->descendants, size,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&target->descendants, size,
+                                  memory_order_relaxed);
+    }
+    int height = height_of(moved);
+    change_heights(source_parent, height, -1);
+    change_heights(target_parent, -1, height);
+}
+
+// Tworzy syna last w folderze parent drzewa tree, w którym jesteśmy
+// pisarzem.
+static int create_child(Tree *tree, Tree *parent, const PathComponent *last) {
+    if (get_child(parent, last)) // taki syn już istnieje
+        return EEXIST;
+    Stamp stamp = stamp_change();
+    Tree *child = folder_new();
+    atomic_init(&child->parent, parent);
+    atomic_init(&child->stamp, stamp.stamp);
+    child->born = stamp.stamp;
+    if (parent == tree)
+        shards_init(child);
+    aggregate_child(tree, parent, true, 1, 0);
+    if (!hmap_insert_hashed(change_children(parent, stamp), last->name,
+                            last->length, last->hash, child))
+        fatal("Malloc failure.");
+    return 0;
+}
+
+// Jako czytelnicy przechodzimy po kolejnych folderach na drodze do rodzica
+// powstającego foldera. Rodzic w path jest pisarzem. W pętli, po przejściu
+// do syna wywoływany jest protokół końcowy rodzica.
+// Jeśli po drodze okaże się, że folder nie istnieje, zwracany jest
+// stosowny błąd. W drzewie z dziennikiem udana zmiana dostaje w nim wpis
+// o numerze *lsn.
+static int create_at(Tree *tree, const PathComponent *components, int n,
+                     const char *path, uint64_t *lsn) {
+    Journal *journal = tree->journal;
+    for (;;) {
+        unsigned long long seq = journal ? stable_rename_seq(tree) : 0;
+        Tree *parent = walk_path(tree, components, n - 1, true);
+        if (!parent)
+            return ENOENT;
+        if (journal && !journal_enter(tree, seq)) {
+            tree_writer_type_final_protocol(parent);
+            continue;
+        }
+        int result = create_child(tree, parent, &components[n - 1]);
+        if (journal) {
+            if (!result)
+                *lsn = journal_append(journal, TREE_OP_CREATE, path, NULL);
+            journal_unlock(journal);
+        }
+        tree_writer_type_final_protocol(parent);
+        return result;
+    }
+}
+
+// Czasy operacji trafiają do histogramów (zob. tree_stats_snapshot),
+// w slocie op * TREE_STATS_RESULTS + rodzaj wyniku.
+static TreeStatsResult stats_result(int result) {
+    switch (result) {
+    case 0:
+        return TREE_STATS_OK;
+    case EINVAL:
+        return TREE_STATS_EINVAL;
+    case ENOENT:
+        return TREE_STATS_ENOENT;
+    case EEXIST:
+        return TREE_STATS_EEXIST;
+    case ENOTEMPTY:
+        return TREE_STATS_ENOTEMPTY;
+    case EBUSY:
+        return TREE_STATS_EBUSY;
+    default:
+        return TREE_STATS_OTHER;
+    }
+}
+
+// Zwraca chwilę zakończenia operacji, od której można liczyć następną.
+static uint64_t record_op(TreeStatsOp op, int result, uint64_t start) {
+    uint64_t end = latency_now();
+    latency_record(op * TREE_STATS_RESULTS + stats_result(result), end - start);
+    return end;
+}
+
+// Lista jest NULL-em dla niepoprawnej ścieżki albo brakującego folderu.
+static void record_list(const void *list, const char *path, uint64_t start) {
+    record_op(TREE_STATS_LIST,
+              list ? 0 : is_path_valid(path) ? ENOENT : EINVAL, start);
+}
+
+static int create_folder(Tree *tree, const char *path) {
+    PathComponent components[MAX_PATH_COMPONENTS];
+    int n = tokenize_path(path, components);
+    if (n < 0)
+        return EINVAL;
+    if (n == 0)
+        return EEXIST;
+    if (!tree)
+        return ENOENT;
+
+    uint64_t lsn = 0;
+    ebr_enter();
+    int result = create_at(tree, components, n, path, &lsn);
+    ebr_exit();
+    if (lsn)
+        journal_wait(tree->journal, lsn);
+    return result;
+}
+
+int tree_create(Tree *tree, const char *path) {
+    uint64_t start = latency_now();
+    int result = create_folder(tree, path);
+    record_op(TREE_STATS_CREATE, result, start);
+    return result;
+}
+
+// Szuka optymistycznie najgłębszego istniejącego folderu na drodze
+// components. Zwraca false, jeśli trzeba spróbować ponownie; wpp. *found to
+// ten folder, a *depth jego głębokość (n, jeśli cała ścieżka istnieje).
+static bool find_deepest_optimistic(Tree *tree, const PathComponent *components,
+                                    int n, Tree **found, int *depth) {
+    Tree *curr_tree = tree;
+    int i = 0;
+    for (; i < n; ++i) {
+        Tree *child;
+        if (!get_child_optimistic(curr_tree, &components[i], &child))
+            return false;
+        if (!child)
+            break;
+        curr_tree = child;
+    }
+    *found = curr_tree;
+    *depth = i;
+    return true;
+}
+
+// Przechodzi od korzenia po components do najgłębszego istniejącego folderu
+// i, jeśli nie jest nim ostatni folder ścieżki, wykonuje w nim protokół
+// wstępny pisarza i go zwraca; *depth to jego głębokość, a syna
+// components[*depth] w nim nie ma. Zwraca NULL (bez protokołów), jeśli cała
+// ścieżka istnieje.
+// Najpierw próbujemy optymistycznie, jak w walk_path. Potem schodzimy
+// z protokołami czytelnika, ale w folderze bez szukanego syna zamieniamy
+// protokół czytelnika na protokół pisarza, wciąż będąc czytelnikiem w jego
+// rodzicu, który nie pozwala w tym czasie folderu usunąć ani przenieść.
+// Musi być wołana wewnątrz sekcji EBR.
+static Tree *walk_to_missing(Tree *tree, const PathComponent *components,
+                             int n, int *depth) {
+    for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; ++attempt) {
+        unsigned long long seq = atomic_load(&tree->rename_seq);
+        if (seq & 1)
+            continue;
+        Tree *found;
+        if (!find_deepest_optimistic(tree, components, n, &found, depth))
+            continue;
+        if (*depth == n) {
+            if (!atomic_load(&found->removed) &&
+                atomic_load(&tree->rename_seq) == seq)
+                return NULL;
+            continue;
+        }
+        if (!enter_validated(tree, found, seq, true, false))
+            continue;
+        if (!get_child(found, &components[*depth]))
+            return found;
+        tree_writer_type_final_protocol(found); // syn właśnie powstał
+    }
+
+    for (;;) {
+        Tree *grandparent = NULL, *curr_tree = tree;
+        reader_enter(tree, bias_depth(tree) > 0);
+        int i = 0;
+        for (; i < n; ++i) {
+            Tree *child = get_child(curr_tree, &components[i]);
+            if (!child)
+                break;
+            reader_enter(child, i + 1 < bias_depth(tree));
+            if (grandparent)
+                tree_reader_type_final_protocol(grandparent);
+            grandparent = curr_tree;
+            curr_tree = child;
+        }
+        if (i < n) {
+            tree_reader_type_final_protocol(curr_tree);
+            tree_writer_type_entry_protocol(curr_tree);
+        }
+        if (grandparent)
+            tree_reader_type_final_protocol(grandparent);
+        if (i == n) {
+            tree_reader_type_final_protocol(curr_tree);
+            return NULL;
+        }
+        if (!get_child(curr_tree, &components[i])) {
+            *depth = i;
+            return curr_tree;
+        }
+        // Syn powstał, gdy nie byliśmy w folderze.
+        tree_writer_type_final_protocol(curr_tree);
+    }
+}
+
+// Tworzy w folderze parent drzewa tree, w którym jesteśmy pisarzem, łańcuch
+// n folderów z components (każdy w poprzednim). Łańcuch jest budowany prywatnie i
+// dołączany do parent jedną zmianą, więc migawki widzą go w całości albo
+// wcale.
+static void create_chain(Tree *tree, Tree *parent,
+                         const PathComponent *components, int n) {
+    Stamp stamp = stamp_change();
+    Tree *chain = NULL;
+    for (int i = n - 1; i >= 0; --i) {
+        Tree *folder = folder_new();
+        atomic_init(&folder->stamp, stamp.stamp);
+        folder->born = stamp.stamp;
+        if (chain) {
+            atomic_init(&chain->parent, folder);
+            if (!hmap_insert_hashed(atomic_load_explicit(&folder->children,
+                                                         memory_order_relaxed),
+                                    components[i + 1].name,
+                                    components[i + 1].length,
+                                    components[i + 1].hash, chain))
+                fatal("Malloc failure.");
+            atomic_init(&folder->descendants, n - 1 - i);
+            Heights *heights = NULL;
+            heights_add(&heights, n - 2 - i, 1);
+            atomic_init(&folder->heights, heights);
+        }
+        chain = folder;
+    }
+    atomic_init(&chain->parent, parent);
+    if (parent == tree)
+        shards_init(chain);
+    aggregate_child(tree, parent, true, n, n - 1);
+    if (!hmap_insert_hashed(change_children(parent, stamp), components[0].name,
+                            components[0].length, components[0].hash, chain))
+        fatal("Malloc failure.");
+}
+
+// Schodzimy raz do najgłębszego istniejącego folderu na drodze path i tylko
+// w nim jesteśmy pisarzem, tworząc wszystkie brakujące foldery naraz.
+// W drzewie z dziennikiem każdy utworzony folder dostaje w nim wpis
+// tree_create (ostatni o numerze *lsn), więc odtwarzanie nie potrzebuje
+// osobnego rodzaju wpisu.
+static int create_path_at(Tree *tree, const PathComponent *components, int n,
+                          const char *path, uint64_t *lsn) {
+    Journal *journal = tree->journal;
+    for (;;) {
+        unsigned long long seq = journal ? stable_rename_seq(tree) : 0;
+        int depth;
+        Tree *parent = walk_to_missing(tree, components, n, &depth);
+        if (!parent)
+            return EEXIST;
+        if (journal && !journal_enter(tree, seq)) {
+            tree_writer_type_final_protocol(parent);
+            continue;
+        }
+        create_chain(tree, parent, components + depth, n - depth);
+        if (journal) {
+            char prefix[MAX_PATH_LENGTH + 1];
+            for (int i = depth; i < n; ++i) {
+                size_t length =
+                    components[i].name + components[i].length + 1 - path;
+                memcpy(prefix, path, length);
+                prefix[length] = '\0';
+                *lsn = journal_append(journal, TREE_OP_CREATE, prefix, NULL);
+            }
+            journal_unlock(journal);
+        }
+        tree_writer_type_final_protocol(parent);
+        return 0;
+    }
+}
+
+int tree_create_path(Tree *tree, const char *path) {
+    PathComponent components[MAX_PATH_COMPONENTS];
+    int n = tokenize_path(path, components);
+    if (n < 0)
+        return EINVAL;
+    if (n == 0)
+        return EEXIST;
+    if (!tree)
+        return ENOENT;
+
+    uint64_t lsn = 0;
+    ebr_enter();
+    int result = create_path_at(tree, components, n, path, &lsn);
+    ebr_exit();
+    if (lsn)
+        journal_wait(tree->journal, lsn);
+    return result;
+}
+
+// Przechodzimy po kolejnych folderach w scieżce path jako czytelnicy.
+// W docelowym folderze jest wykonywana czynność czytelnika: wypisanie
+// synów o nazwach z przedziału [from, to) albo, jeśli prefix nie jest
+// NULL-em, zaczynających się od prefix.
+// Jeśli po drodze okaże się, że folderu nie ma, po wywołaniu protokołu
+// końcowego rodzica, zwracany jest NULL.
+static char *list_at(Tree *tree, const PathComponent *components, int n,
+                     const char *from, const char *to, const char *prefix) {
+    Tree *curr_tree = walk_path(tree, components, n, false);
+    if (!curr_tree)
+        return NULL;
+    // doszliśmy do folderu, pobieramy jego zawartość
+    HashMap *children = children_of(curr_tree);
+    char *list = prefix ? make_map_prefix_string(children, prefix)
+                        : make_map_range_string(children, from, to);
+    tree_reader_type_final_protocol(curr_tree);
+    return list;
+}
+
+static char *list_path(Tree *tree, const char *path, const char *from,
+                       const char *to, const char *prefix) {
+    PathComponent components[MAX_PATH_COMPONENTS];
+    int n = tokenize_path(path, components);
+    if (n < 0 || !tree)
+        return NULL;
+
+    ebr_enter();
+    char *list = list_at(tree, components, n, from, to, prefix);
+    ebr_exit();
+    return list;
+}
+
+// Zwraca listę synów folderu tree, w którym jesteśmy czytelnikiem.
+// Pisarzy w folderze nie ma, więc zapamiętana lista z aktualnym seq jest
+// poprawna. Czytelnicy mogą jednocześnie podmieniać zapamiętaną listę,
+// dlatego starą zwalniamy przez EBR: dopóki trwa sekcja EBR, w której ktoś
+// ją odczytał, ma ona referencję od folderu.
+static Listing *get_listing(Tree *tree) {
+    unsigned int seq = atomic_load_explicit(&tree->seq, memory_order_relaxed);
+    Listing *listing = atomic_load_explicit(&tree->listing, memory_order_acquire);
+    if (listing && listing->seq == seq) {
+        atomic_fetch_add_explicit(&listing->refs, 1, memory_order_relaxed);
+        return listing;
+    }
+    HashMap *children = children_of(tree);
+    listing = (Listing *)make_map_contents_buffer(children,
+                                                  offsetof(Listing, text));
+    listing->seq = seq;
+    if (hmap_size(children) < LISTING_CACHE_MIN_CHILDREN) {
+        atomic_init(&listing->refs, 1);
+        return listing;
+    }
+    atomic_init(&listing->refs, 2);
+    Listing *old = atomic_exchange_explicit(&tree->listing, listing,
+                                            memory_order_acq_rel);
+    if (old)
+        ebr_retire(old, listing_put);
+    return listing;
+}
+
+static const char *list_shared(Tree *tree, const char *path) {
+    PathComponent components[MAX_PATH_COMPONENTS];
+    int n = tokenize_path(path, components);
+    if (n < 0 || !tree)
+        return NULL;
+
+    ebr_enter();
+    Listing *listing = NULL;
+    Tree *curr_tree = walk_path(tree, components, n, false);
+    if (curr_tree) {
+        listing = get_listing(curr_tree);
+        tree_reader_type_final_protocol(curr_tree);
+    }
+    ebr_exit();
+    return listing ? listing->text : NULL;
+}
+
+void tree_list_release(const char *list) {
+    if (list)
+        listing_put((char *)list - offsetof(Listing, text));
+}
+
+// Listę małego folderu, który nie zapamiętuje listy, budujemy od razu jako
+// wynik. Listę dużego bierzemy z get_listing i kopiujemy już poza folderem.
+static char *list_copy(Tree *tree, const char *path) {
+    PathComponent components[MAX_PATH_COMPONENTS];
+    int n = tokenize_path(path, components);
+    if (n < 0 || !tree)
+        return NULL;
+
+    ebr_enter();
+    char *list = NULL;
+    Listing *listing = NULL;
+    Tree *curr_tree = walk_path(tree, components, n, false);
+    if (curr_tree) {
+        HashMap *children = children_of(curr_tree);
+        if (hmap_size(children) < LISTING_CACHE_MIN_CHILDREN)
+            list = make_map_contents_string(children);
+        else
+            listing = get_listing(curr_tree);
+        tree_reader_type_final_protocol(curr_tree);
+    }
+    ebr_exit();
+    if (listing) {
+        size_t size = strlen(listing->text) + 1;
+        list = malloc(size);
+        if (!list)
+            fatal("Malloc failure.");
+        memcpy(list, listing->text, size);
+        listing_put(listing);
+    }
+    return list;
+}
+
+char *tree_list(Tree *tree, const char *path) {
+    uint64_t start = latency_now();
+    char *list = list_copy(tree, path);
+    record_list(list, path, start);
+    return list;
+}
+
+const char *tree_list_shared(Tree *tree, const char *path) {
+    uint64_t start = latency_now();
+    const char *list = list_shared(tree, path);
+    record_list(list, path, start);
+    return list;
+}
+
+char *tree_list_range(Tree *tree, const char *path, const char *from,
+                      const char *to) {
+    uint64_t start = latency_now();
+    char *list = list_path(tree, path, from, to, NULL);
+    record_list(list, path, start);
+    return list;
+}
+
+char *tree_list_prefix(Tree *tree, const char *path, const char *prefix) {
+    if (!prefix)
+        return NULL;
+    uint64_t start = latency_now();
+    char *list = list_path(tree, path, NULL, NULL, prefix);
+    record_list(list, path, start);
+    return list;
+}
+
+_Static_assert(TREE_LIST_MIN_CHUNK >= MAX_FOLDER_NAME_LENGTH + 1,
+               "TREE_LIST_MIN_CHUNK must fit a folder name");
+
+struct TreeListCursor {
+    Tree *folder; // z referencją, zob. Tree.refs
+    bool started; // czy last zawiera już nazwę
+    char last[MAX_FOLDER_NAME_LENGTH + 1]; // ostatnia zwrócona nazwa
+};
+
+TreeListCursor *tree_list_open(Tree *tree, const char *path) {
+    PathComponent components[MAX_PATH_COMPONENTS];
+    int n = tokenize_path(path, components);
+    if (n < 0 || !tree)
+        return NULL;
+
+    ebr_enter();
+    Tree *folder = walk_path(tree, components, n, false);
+    if (folder) {
+        atomic_fetch_add_explicit(&folder->refs, 1, memory_order_relaxed);
+        tree_reader_type_final_protocol(folder);
+    }
+    ebr_exit();
+    if (!folder)
+        return NULL;
+
+    TreeListCursor *cursor = malloc(sizeof(TreeListCursor));
+    if (!cursor)
+        fatal("Malloc failure.");
+    cursor->folder = folder;
+    cursor->started = false;
+    return cursor;
+}
+
+// Każda porcja to jedna czynność czytelnika w folderze. Nazwy są
+// posortowane, więc kolejną porcję zaczynamy od pierwszej nazwy większej
+// od ostatnio zwróconej. Usunięty folder jest pusty, więc dla niego
+// wypisywanie się kończy.
+int tree_list_next(TreeListCursor *cursor, char *buf, size_t cap) {
+    Tree *folder = cursor->folder;
+    if (cap == 0)
+        return -1;
+    buf[0] = '\0';
+    tree_reader_type_entry_protocol(folder);
+    if (atomic_load_explicit(&folder->removed, memory_order_relaxed)) {
+        tree_reader_type_final_protocol(folder);
+        return 0;
+    }
+    HashMap *children = children_of(folder);
+    HashMapIterator it = cursor->started
+                             ? hmap_lower_bound(children, cursor->last)
+                             : hmap_iterator(children);
+    int count = 0;
+    bool too_small = false; // nie zmieściła się nawet jedna nazwa
+    size_t position = 0;
+    const char *key;
+    void *value;
+    while (hmap_next(children, &it, &key, &value)) {
+        if (cursor->started && strcmp(key, cursor->last) == 0)
+            continue;
+        size_t length = strlen(key);
+        size_t needed = length + 1 + (count > 0); // przecinek i znak zerowy
+        if (position + needed > cap) {
+            too_small = count == 0;
+            break;
+        }
+        if (count > 0)
+            buf[position++] = ',';
+        memcpy(buf + position, key, length + 1);
+        position += length;
+        memcpy(cursor->last, key, length + 1);
+        cursor->started = true;
+        count++;
+    }
+    tree_reader_type_final_protocol(folder);
+    return too_small ? -1 : count;
+}
+
+void tree_list_close(TreeListCursor *cursor) {
+    if (!cursor)
+        return;
+    tree_put(cursor->folder);
+    free(cursor);
+}
+
+// Agregaty czytamy bez bramki: zmiany w poddrzewie mogą dotrzeć do nich
+// w trakcie, ale każda zakończona już tam dotarła.
+int tree_stat(Tree *tree, const char *path, TreeStat *stat) {
+    PathComponent components[MAX_PATH_COMPONENTS];
+    int n = tokenize_path(path, components);
+    if (n < 0)
+        return EINVAL;
+    if (!tree)
+        return ENOENT;
+
+    ebr_enter();
+    Tree *folder = walk_path(tree, components, n, false);
+    if (folder) {
+        stat->descendants = count_descendants(folder);
+        stat->height = height_of(folder);
+        tree_reader_type_final_protocol(folder);
+    }
+    ebr_exit();
+    return folder ? 0 : ENOENT;
+}
+
+// Usuwa syna last folderu parent drzewa tree, w którym jesteśmy pisarzem.
+// Wcześniej jako pisarze wchodzimy do usuwanego folderu, żeby poczekać,
+// aż wyjdą z niego wszystkie operacje, które weszły do niego przed nami.
+// Operacje optymistyczne mogą jeszcze trzymać wskaźnik na usunięty
+// folder, więc jest on zwalniany przez EBR, a one po wejściu do niego
+// widzą flagę removed. Folder, który widzi żywa migawka, czeka na
+// zwolnienie na liście wersji.
+// Jeśli journal nie jest NULL-em, wchodzimy do sekcji krytycznej dziennika
+// (journal_enter z seq) dopiero w usuwanym folderze, żeby nie czekać na
+// jego blokadę, trzymając dziennik. Jeśli to się nie uda, zwracamy EAGAIN,
+// a po udanym usunięciu z sekcji krytycznej wychodzi wołający.
+static int remove_child(Tree *tree, Tree *parent, const PathComponent *last,
+                        Journal *journal, unsigned long long seq) {
+    // węzeł drzewa do usunięcia
+    Tree *final_tree = get_child(parent, last);
+    if (!final_tree)
+        return ENOENT;
+    tree_writer_type_entry_protocol(final_tree);
+    if (hmap_size(children_of(final_tree)) != 0) {
+        tree_writer_type_final_protocol(final_tree);
+        return ENOTEMPTY;
+    }
+    if (journal && !journal_enter(tree, seq)) {
+        tree_writer_type_final_protocol(final_tree);
+        return EAGAIN;
+    }
+    Stamp stamp = stamp_change();
+    hmap_remove_hashed(change_children(parent, stamp), last->name, last->length,
+                       last->hash);
+    aggregate_child(tree, parent, false, 1, 0);
+    atomic_store(&final_tree->removed, true);
+    tree_writer_type_final_protocol(final_tree);
+    if (stamp.newest && final_tree->born <= stamp.newest) {
+        Version *version = malloc(sizeof(Version));
+        if (!version)
+            fatal("Malloc failure.");
+        version->children = NULL;
+        version->from = final_tree->born;
+        version->until = stamp.stamp;
+        version->owner = final_tree; // przejmuje referencję od drzewa
+        atomic_init(&version->older, NULL);
+        retain(version);
+    } else {
+        ebr_retire(final_tree, tree_put);
+    }
+    return 0;
+}
+
+// Przechodzimy do rodzica docelowo usuwanego folderu jako czytelnicy.
+// Rodzic ostatniego folderu na scieżce path działa jako pisarz
+// i usuwa z listy swoich dzieci podany folder.
+// Jeśli gdzieś po drodze okaże się, że jakiś folder nie istnieje,
+// zwalniane jest "miejsce w bibliotece" i zwracany stosowny błąd.
+// Dziennik jak w create_at, ale zob. remove_child.
+static int remove_at(Tree *tree, const PathComponent *components, int n,
+                     const char *path, uint64_t *lsn) {
+    Journal *journal = tree->journal;
+    for (;;) {
+        unsigned long long seq = journal ? stable_rename_seq(tree) : 0;
+        Tree *parent = walk_path(tree, components, n - 1, true);
+        if (!parent)
+            return ENOENT;
+        int result = remove_child(tree, parent, &components[n - 1], journal,
+                                  seq);
+        if (journal && !result) {
+            *lsn = journal_append(journal, TREE_OP_REMOVE, path, NULL);
+            journal_unlock(journal);
+        }
+        tree_writer_type_final_protocol(parent);
+        if (result != EAGAIN)
+            return result;
+    }
+}
+
+static int remove_folder(Tree *tree, const char *path) {
+    PathComponent components[MAX_PATH_COMPONENTS];
+    int n = tokenize_path(path, components);
+    if (n < 0)
+        return EINVAL;
+    if (n == 0)
+        return EBUSY;
+    if (!tree)
+        return ENOENT;
+
+    uint64_t lsn = 0;
+    ebr_enter();
+    int result = remove_at(tree, components, n, path, &lsn);
+    ebr_exit();
+    if (lsn)
+        journal_wait(tree->journal, lsn);
+    return result;
+}
+
+int tree_remove(Tree *tree, const char *path) {
+    uint64_t start = latency_now();
+    int result = remove_folder(tree, path);
+    record_op(TREE_STATS_REMOVE, result, start);
+    return result;
+}
+
+// Sprawdza, czy ścieżka target leży w poddrzewie ścieżki source
+// (podanych jako n_source i n_target komponentów). Takie przeniesienie
+// tree_move odrzuca, zanim zacznie szukać folderów; same foldery sprawdza
+// potem move_at (zob. is_ancestor).
+static bool moving_to_own_subtree(const PathComponent *source, int n_source,
+                                  const PathComponent *target, int n_target) {
+    if (n_source >= n_target)
+        return false; // jak target nie jest dłuższy, nie może być podfolderem
+    for (int i = 0; i < n_source; ++i) {
+        if (source[i].hash != target[i].hash ||
+            source[i].length != target[i].length ||
+            memcmp(source[i].name, target[i].name, source[i].length) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Początek przepinania folderu (pod rename_lock drzewa tree): zwraca
+// wartość, którą rename_end ustawi w rename_seq.
+static unsigned long long rename_begin(Tree *tree) {
+    unsigned long long seq =
+        atomic_load_explicit(&tree->rename_seq, memory_order_relaxed) + 1;
+    atomic_store_explicit(&tree->rename_seq, seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // przed przepinaniem
+    return seq + 1;
+}
+
+static void rename_end(Tree *tree, unsigned long long seq) {
+    atomic_store_explicit(&tree->rename_seq, seq, memory_order_release);
+}
+
+// Znajduje folder na głębokości n i od razu z niego wychodzi. Folder może
+// potem zostać przeniesiony albo usunięty; EBR chroni jego pamięć do końca
+// operacji.
+static Tree *find_folder(Tree *tree, const PathComponent *components, int n) {
+    Tree *found = walk_path(tree, components, n, false);
+    if (found)
+        tree_reader_type_final_protocol(found);
+    return found;
+}
+
+// Znajduje syna component folderu tree, nie zostając w tym folderze.
+static Tree *find_child(Tree *tree, const PathComponent *component) {
+    Tree *child;
+    if (get_child_optimistic(tree, component, &child))
+        return child;
+    tree_reader_type_entry_protocol(tree);
+    child = get_child(tree, component);
+    tree_reader_type_final_protocol(tree);
+    return child;
+}
+
+// Pod rename_lock: czy ancestor leży na drodze od folderu tree do korzenia
+// (także gdy to tree).
+static bool is_ancestor(const Tree *ancestor, Tree *tree) {
+    for (; tree; tree = atomic_load_explicit(&tree->parent,
+                                             memory_order_relaxed)) {
+        if (tree == ancestor)
+            return true;
+    }
+    return false;
+}
+
+// Folder, do którego tree_move wchodzi jako pisarz, i jego głębokość
+// w chwili znalezienia.
+typedef struct {
+    Tree *folder;
+    int depth;
+} MoveLock;
+
+// Porządek kanoniczny blokad przeniesienia: płytsze przed głębszymi, przy
+// równej głębokości według adresu.
+static bool move_lock_before(const MoveLock *a, const MoveLock *b) {
+    return a->depth < b->depth ||
+           (a->depth == b->depth && (uintptr_t)a->folder < (uintptr_t)b->folder);
+}
+
+// Sortuje n blokad w porządku kanonicznym, pomijając powtórzone foldery.
+// Zwraca liczbę pozostałych.
+static int sort_move_locks(MoveLock *locks, int n) {
+    int size = 0;
+    for (int i = 0; i < n; ++i) {
+        bool repeated = false;
+        for (int j = 0; j < size; ++j)
+            repeated |= locks[j].folder == locks[i].folder;
+        if (repeated)
+            continue;
+        int j = size++;
+        MoveLock lock = locks[i];
+        for (; j > 0 && move_lock_before(&lock, &locks[j - 1]); --j)
+            locks[j] = locks[j - 1];
+        locks[j] = lock;
+    }
+    return size;
+}
+
+// Wchodzi jako pisarz do n folderów z locks. Czeka tylko na locks[*first],
+// zanim wejdzie do pozostałych; do nich, w porządku kanonicznym, tylko
+// próbuje wejść. Jeśli któryś jest zajęty, wychodzi ze wszystkich, ustawia
+// *first na niego (następna próba czeka najpierw na niego) i zwraca false.
+static bool move_lock(const MoveLock *locks, int n, int *first) {
+    tree_writer_type_entry_protocol(locks[*first].folder);
+    for (int i = 0; i < n; ++i) {
+        if (i == *first || writer_try_enter(locks[i].folder))
+            continue;
+        for (int j = i - 1; j >= 0; --j) {
+            if (j != *first)
+                tree_writer_type_final_protocol(locks[j].folder);
+        }
+        tree_writer_type_final_protocol(locks[*first].folder);
+        *first = i;
+        return false;
+    }
+    return true;
+}
+
+static void move_unlock(const MoveLock *locks, int n) {
+    for (int i = n - 1; i >= 0; --i)
+        tree_writer_type_final_protocol(locks[i].folder);
+}
+
+// Przeniesienie blokuje tylko rodzica source, rodzica target i przenoszony
+// folder. Najpierw bez blokad znajdujemy te foldery, a potem wchodzimy do
+// nich jako pisarze w porządku kanonicznym (zob. move_lock_before). Inne
+// operacje blokują kilka folderów tylko schodząc w głąb drzewa (przodka
+// przed potomkiem), z czym ten porządek jest zgodny. Głębokości mogły się
+// jednak zmienić przez współbieżne przeniesienie, więc na blokadę czekamy
+// tylko, nie będąc w żadnym innym folderze (zob. move_lock), i przez to
+// nie możemy się zakleszczyć.
+// Dopiero w tych folderach bierzemy rename_lock drzewa, który chroni tylko
+// przepinanie: nikt, kto go trzyma, nie czeka na blokady folderów. Pod nim
+// przodkowie folderów się nie zmieniają, więc sprawdzamy, że znalezione
+// foldery wciąż leżą na swoich ścieżkach (zob. unmoved_since), a jeśli nie,
+// szukamy ich od nowa. Wtedy też, idąc od rodzica target do korzenia,
+// sprawdzamy, że przenoszony folder nie jest jego przodkiem, więc nie
+// potrzebujemy blokad wspólnego przodka obu ścieżek.
+// Przenoszony folder jest przepinany do nowego rodzica, więc operacje,
+// które są już w jego poddrzewie, mogą spokojnie kontynuować.
+// W drzewie z dziennikiem przepinamy w sekcji krytycznej dziennika
+// (zob. create_at); udane przeniesienie dostaje w nim wpis o numerze *lsn.
+static int move_at(Tree *tree, const PathComponent *src, int n_src,
+                   const PathComponent *tgt, int n_tgt, const char *source,
+                   const char *target, uint64_t *lsn) {
+    const PathComponent *src_last = &src[n_src - 1];
+    const PathComponent *tgt_last = &tgt[n_tgt - 1];
+    for (;;) {
+        unsigned long long found_seq = stable_rename_seq(tree);
+        Tree *source_parent = find_folder(tree, src, n_src - 1);
+        if (!source_parent)
+            return ENOENT;
+        Tree *moved = find_child(source_parent, src_last);
+        if (!moved) {
+            // Jeśli nic nie zostało przeniesione, source_parent wciąż leży
+            // na swojej ścieżce.
+            if (atomic_load(&tree->rename_seq) == found_seq)
+                return ENOENT;
+            continue;
+        }
+        Tree *target_parent = find_folder(tree, tgt, n_tgt - 1);
+        if (!target_parent)
+            return ENOENT;
+        MoveLock locks[3] = {{source_parent, n_src - 1},
+                             {moved, n_src},
+                             {target_parent, n_tgt - 1}};
+        int n_locks = sort_move_locks(locks, 3);
+        int first = 0;
+        while (!move_lock(locks, n_locks, &first))
+            ;
+
+        if (pthread_mutex_lock(&tree->rename_lock) != 0)
+            syserr("lock failed");
+        if (atomic_load_explicit(&moved->parent, memory_order_relaxed) !=
+                source_parent ||
+            !unmoved_since(tree, moved, n_src, found_seq) ||
+            !unmoved_since(tree, target_parent, n_tgt - 1, found_seq)) {
+            if (pthread_mutex_unlock(&tree->rename_lock) != 0)
+                syserr("mutex unlock failed");
+            move_unlock(locks, n_locks);
+            continue;
+        }
+
+        int result = 0;
+        if (is_ancestor(moved, target_parent)) {
+            result = EILLEGALMOVE;
+        } else if (get_child(target_parent, tgt_last)) { // taki syn już istnieje
+            result = EEXIST;
+        } else {
+            if (tree->journal)
+                journal_lock(tree->journal);
+            // Bramki folderów najwyższego poziomu, w których moved leży
+            // przed przepięciem i po nim.
+            unsigned gates =
+                1u << gate_of(tree, moved) |
+                1u << (target_parent == tree ? top_gate(moved)
+                                              : gate_of(tree, target_parent));
+            gate_close(tree, gates);
+            unsigned long long seq = rename_begin(tree);
+            Stamp stamp = stamp_change();
+            if (hmap_insert_hashed(change_children(target_parent, stamp),
+                                   tgt_last->name, tgt_last->length,
+                                   tgt_last->hash, moved)) {
+                hmap_remove_hashed(change_children(source_parent, stamp),
+                                   src_last->name, src_last->length,
+                                   src_last->hash);
+                atomic_store_explicit(&moved->parent, target_parent,
+                                      memory_order_relaxed);
+                atomic_store_explicit(&moved->gen, seq, memory_order_relaxed);
+                move_aggregates(moved, source_parent, n_src - 1, target_parent,
+                                n_tgt - 1);
+                if (tree->journal)
+                    *lsn = journal_append(tree->journal, TREE_OP_MOVE, source,
+                                          target);
+            } else {
+                result = ENOMEM;
+            }
+            rename_end(tree, seq);
+            gate_open(tree, gates);
+            if (tree->journal)
+                journal_unlock(tree->journal);
+        }
+        if (pthread_mutex_unlock(&tree->rename_lock) != 0)
+            syserr("mutex unlock failed");
+        move_unlock(locks, n_locks);
+        return result;
+    }
+}
+
+static int move_folder(Tree *tree, const char *source, const char *target) {
+    PathComponent src[MAX_PATH_COMPONENTS];
+    PathComponent tgt[MAX_PATH_COMPONENTS];
+    int n_src = tokenize_path(source, src);
+    int n_tgt = tokenize_path(target, tgt);
+    if (n_src < 0 || n_tgt < 0)
+        return EINVAL;
+    if (n_src == 0)
+        return EBUSY;
+    if (n_tgt == 0)
+        return EEXIST;
+    if (moving_to_own_subtree(src, n_src, tgt, n_tgt))
+        return EILLEGALMOVE;
+    if (!tree)
+        return ENOENT;
+
+    uint64_t lsn = 0;
+    ebr_enter();
+    int result = move_at(tree, src, n_src, tgt, n_tgt, source, target, &lsn);
+    ebr_exit();
+    if (lsn)
+        journal_wait(tree->journal, lsn);
+    return result;
+}
+
+int tree_move(Tree *tree, const char *source, const char *target) {
+    uint64_t start = latency_now();
+    int result = move_folder(tree, source, target);
+    record_op(TREE_STATS_MOVE, result, start);
+    return result;
+}
+
+// Migawka to wersja zegara snapshot_clock: widzi zmiany ze stemplami nie
+// większymi od niej. Nowa wersja jest widoczna dla pisarzy, zanim
+// zaczniemy czytać foldery, zob. stamp_change.
+TreeSnapshot *tree_snapshot(Tree *tree) {
+    if (!tree)
+        return NULL;
+    TreeSnapshot *snapshot = malloc(sizeof(TreeSnapshot));
+    if (!snapshot)
+        fatal("Malloc failure.");
+    atomic_fetch_add_explicit(&tree->refs, 1, memory_order_relaxed);
+    snapshot->root = tree;
+    if (pthread_mutex_lock(&snapshots_lock) != 0)
+        syserr("lock failed");
+    snapshot->version = atomic_load_explicit(&snapshot_clock,
+                                             memory_order_relaxed) + 1;
+    atomic_store(&newest_snapshot, snapshot->version);
+    atomic_store(&snapshot_clock, snapshot->version);
+    snapshot->prev = latest_snapshot;
+    snapshot->next = NULL;
+    if (latest_snapshot)
+        latest_snapshot->next = snapshot;
+    else
+        oldest_snapshot = snapshot;
+    latest_snapshot = snapshot;
+    if (pthread_mutex_unlock(&snapshots_lock) != 0)
+        syserr("mutex unlock failed");
+    atomic_thread_fence(memory_order_seq_cst);
+    return snapshot;
+}
+
+void tree_snapshot_release(TreeSnapshot *snapshot) {
+    if (!snapshot)
+        return;
+    if (pthread_mutex_lock(&snapshots_lock) != 0)
+        syserr("lock failed");
+    if (snapshot->prev)
+        snapshot->prev->next = snapshot->next;
+    else
+        oldest_snapshot = snapshot->next;
+    if (snapshot->next)
+        snapshot->next->prev = snapshot->prev;
+    else
+        latest_snapshot = snapshot->prev;
+    atomic_store(&newest_snapshot, latest_snapshot ? latest_snapshot->version : 0);
+    Version *unneeded = prune_versions();
+    if (pthread_mutex_unlock(&snapshots_lock) != 0)
+        syserr("mutex unlock failed");
+    free_versions(unneeded);
+    tree_put(snapshot->root);
+    free(snapshot);
+}
+
+// Zwraca synów folderu tree w migawce o wersji version, bez blokad.
+// Obecnej zawartości (ze stemplem nie większym niż version) pisarze już nie
+// zmienią, tylko ją skopiują, a starsze są w tree->versions. Jeśli w folderze
+// jest pisarz, czekamy, aż wyjdzie, bo może właśnie zmieniać mapę, którą
+// migawka powinna widzieć. Musi być wołana wewnątrz sekcji EBR.
+static HashMap *children_at(Tree *tree, unsigned long long version) {
+    for (;;) {
+        unsigned int seq = atomic_load_explicit(&tree->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        HashMap *children = children_of(tree);
+        unsigned long long stamp =
+            atomic_load_explicit(&tree->stamp, memory_order_relaxed);
+        Version *older = atomic_load_explicit(&tree->versions,
+                                              memory_order_acquire);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&tree->seq, memory_order_relaxed) != seq)
+            continue;
+        if (stamp <= version)
+            return children;
+        while (older->from > version)
+            older = atomic_load_explicit(&older->older, memory_order_acquire);
+        return older->children;
+    }
+}
+
+char *tree_snapshot_list(TreeSnapshot *snapshot, const char *path) {
+    PathComponent components[MAX_PATH_COMPONENTS];
+    int n = tokenize_path(path, components);
+    if (n < 0 || !snapshot)
+        return NULL;
+
+    ebr_enter();
+    Tree *curr_tree = snapshot->root;
+    for (int i = 0; i < n && curr_tree; ++i) {
+        curr_tree = hmap_get_hashed(children_at(curr_tree, snapshot->version),
+                                    components[i].name, components[i].length,
+                                    components[i].hash);
+    }
+    char *list = curr_tree ? make_map_contents_string(
+                                 children_at(curr_tree, snapshot->version))
+                           : NULL;
+    ebr_exit();
+    return list;
+}
+
+// Operacja z tree_apply_batch czekająca na wykonanie.
+typedef struct {
+    size_t index; // w ops i results
+    TreeOpType type;
+    PathComponent last; // tworzony lub usuwany folder
+    size_t group; // indeks w Batch.groups
+} BatchOp;
+
+// Operacje partii o wspólnym rodzicu.
+typedef struct {
+    const char *parent_key; // ścieżka rodzica (bez znaku zerowego)
+    size_t parent_length;
+    unsigned long long hash; // path_hash ścieżki rodzica
+    size_t first; // indeks pierwszego komponentu rodzica w Batch.components
+    int depth; // liczba komponentów rodzica
+    size_t count; // liczba operacji
+    size_t start; // początek operacji grupy w kolejności wykonania
+} BatchGroup;
+
+// Fragment partii, w którym operacje można wykonać w dowolnej kolejności,
+// byle operacje na tej samej ścieżce zachowały swoją kolejność.
+// Zbiory skrótów są z adresowaniem otwartym.
+typedef struct {
+    BatchOp *ops;
+    size_t count, capacity;
+    PathComponent *components; // ścieżki rodziców grup
+    size_t n_components, components_capacity;
+    BatchGroup *groups;
+    size_t n_groups, groups_capacity;
+    // Indeksy grup powiększone o 1 (0 to wolne miejsce), według skrótu.
+    size_t *group_table;
+    size_t group_table_capacity;
+    // Skróty (path_hash) właściwych przodków ścieżek operacji z ops;
+    // 0 oznacza wolne miejsce. Kolizja skrótów najwyżej niepotrzebnie
+    // dzieli partię.
+    unsigned long long *ancestors;
+    size_t n_ancestors, ancestors_capacity;
+} Batch;
+
+// Powiększa tablicę *array o elementach rozmiaru size tak, żeby mieściła
+// needed elementów.
+static void reserve(void *array, size_t *capacity, size_t needed,
+                    size_t size) {
+    if (needed <= *capacity)
+        return;
+    size_t new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    void *resized = realloc(*(void **)array, new_capacity * size);
+    if (!resized)
+        fatal("Malloc failure.");
+    *(void **)array = resized;
+    *capacity = new_capacity;
+}
+
+static size_t ancestor_slot(const Batch *batch, unsigned long long hash) {
+    size_t mask = batch->ancestors_capacity - 1;
+    size_t i = hash & mask;
+    while (batch->ancestors[i] && batch->ancestors[i] != hash)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static void add_ancestor(Batch *batch, unsigned long long hash) {
+    hash |= !hash; // 0 oznacza wolne miejsce
+    if (2 * (batch->n_ancestors + 1) > batch->ancestors_capacity) {
+        unsigned long long *old = batch->ancestors;
+        size_t old_capacity = batch->ancestors_capacity;
+        batch->ancestors_capacity = old_capacity ? 2 * old_capacity : 256;
+        batch->ancestors = calloc(batch->ancestors_capacity,
+                                  sizeof(unsigned long long));
+        if (!batch->ancestors)
+            fatal("Malloc failure.");
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old[i])
+                batch->ancestors[ancestor_slot(batch, old[i])] = old[i];
+        }
+        free(old);
+    }
+    size_t i = ancestor_slot(batch, hash);
+    if (!batch->ancestors[i]) {
+        batch->ancestors[i] = hash;
+        batch->n_ancestors++;
+    }
+}
+
+// Czy ścieżka o skrócie hash jest przodkiem ścieżki którejś operacji
+// w batch. Taką operację trzeba wykonać po nich, a kolejność grup
+// wykonałaby ją wcześniej (np. usunięcie /a/ po usunięciu /a/b/).
+static bool is_batch_ancestor(const Batch *batch, unsigned long long hash) {
+    hash |= !hash;
+    return batch->n_ancestors &&
+           batch->ancestors[ancestor_slot(batch, hash)] == hash;
+}
+
+// Miejsce w group_table grupy rodzica o podanej ścieżce i skrócie
+// (wolne, jeśli takiej grupy nie ma).
+static size_t group_slot(const Batch *batch, const char *parent_key,
+                         size_t parent_length, unsigned long long hash) {
+    size_t mask = batch->group_table_capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        size_t entry = batch->group_table[i];
+        if (!entry)
+            return i;
+        const BatchGroup *group = &batch->groups[entry - 1];
+        if (group->hash == hash && group->parent_length == parent_length &&
+            memcmp(group->parent_key, parent_key, parent_length) == 0)
+            return i;
+    }
+}
+
+// Zwraca indeks grupy rodzica ścieżki o podanych komponentach, tworząc ją
+// w razie potrzeby.
+static size_t find_group(Batch *batch, const char *path,
+                         const PathComponent *components, int n,
+                         unsigned long long hash) {
+    const char *parent_key = path;
+    size_t parent_length = components[n - 1].name - path;
+    if (2 * (batch->n_groups + 1) > batch->group_table_capacity) {
+        free(batch->group_table);
+        batch->group_table_capacity = batch->group_table_capacity
+                                          ? 2 * batch->group_table_capacity
+                                          : 256;
+        batch->group_table = calloc(batch->group_table_capacity,
+                                    sizeof(size_t));
+        if (!batch->group_table)
+            fatal("Malloc failure.");
+        for (size_t g = 0; g < batch->n_groups; ++g) {
+            const BatchGroup *group = &batch->groups[g];
+            batch->group_table[group_slot(batch, group->parent_key,
+                                          group->parent_length,
+                                          group->hash)] = g + 1;
+        }
+    }
+    size_t slot = group_slot(batch, parent_key, parent_length, hash);
+    if (batch->group_table[slot])
+        return batch->group_table[slot] - 1;
+    reserve(&batch->groups, &batch->groups_capacity, batch->n_groups + 1,
+            sizeof(BatchGroup));
+    reserve(&batch->components, &batch->components_capacity,
+            batch->n_components + n - 1, sizeof(PathComponent));
+    BatchGroup *group = &batch->groups[batch->n_groups];
+    group->parent_key = parent_key;
+    group->parent_length = parent_length;
+    group->hash = hash;
+    group->first = batch->n_components;
+    group->depth = n - 1;
+    group->count = 0;
+    if (n > 1)
+        memcpy(batch->components + batch->n_components, components,
+               (n - 1) * sizeof(PathComponent));
+    batch->n_components += n - 1;
+    batch->group_table[slot] = batch->n_groups + 1;
+    return batch->n_groups++;
+}
+
+static void run_batch(Tree *tree, Batch *batch, int *results);
+
+// Dodaje operację do batch. Jeśli jej ścieżka jest przodkiem ścieżki którejś
+// operacji w batch, najpierw wykonuje batch.
+static void batch_add(Tree *tree, Batch *batch, int *results, size_t index,
+                      TreeOpType type, const char *path,
+                      const PathComponent *components, int n) {
+    unsigned long long hash = path_hash_start(tree);
+    for (int i = 0; i < n - 1; ++i)
+        hash = path_hash_step(hash, &components[i]);
+    if (is_batch_ancestor(batch, path_hash_finish(
+                                     path_hash_step(hash, &components[n - 1]))))
+        run_batch(tree, batch, results);
+
+    size_t group = find_group(batch, path, components, n,
+                              path_hash_finish(hash));
+    if (batch->groups[group].count++ == 0) {
+        // Przodkowie ścieżek operacji grupy to rodzic i jego przodkowie.
+        hash = path_hash_start(tree);
+        for (int i = 0; i < n - 1; ++i) {
+            hash = path_hash_step(hash, &components[i]);
+            add_ancestor(batch, path_hash_finish(hash));
+        }
+    }
+
+    reserve(&batch->ops, &batch->capacity, batch->count + 1, sizeof(BatchOp));
+    BatchOp *op = &batch->ops[batch->count++];
+    op->index = index;
+    op->type = type;
+    op->last = components[n - 1];
+    op->group = group;
+}
+
+// Porządek grup po ścieżce rodzica. Ścieżka przodka jest prefiksem ścieżki
+// potomka, więc grupa rodzica jest zawsze przed grupami jego potomków,
+// a grupy z jednego poddrzewa są obok siebie.
+static int compare_groups(const void *a, const void *b) {
+    const BatchGroup *x = *(BatchGroup *const *)a;
+    const BatchGroup *y = *(BatchGroup *const *)b;
+    size_t length = x->parent_length < y->parent_length ? x->parent_length
+                                                        : y->parent_length;
+    int cmp = memcmp(x->parent_key, y->parent_key, length);
+    if (cmp != 0)
+        return cmp;
+    return x->parent_length < y->parent_length ? -1
+                                               : x->parent_length > y->parent_length;
+}
+
+// Czy rodzic grupy y leży w poddrzewie rodzica grupy x (i jest od niego
+// różny).
+static bool group_below(const BatchGroup *x, const BatchGroup *y) {
+    return x->parent_length < y->parent_length &&
+           memcmp(x->parent_key, y->parent_key, x->parent_length) == 0;
+}
+
+// Wykonuje operacje z batch i opróżnia go. Sortujemy tylko grupy; operacje
+// kopiujemy do nich, zachowując ich kolejność, tak żeby operacje jednej
+// grupy leżały w pamięci obok siebie. Operacje grupy wykonujemy
+// pod jednym protokołem pisarza w rodzicu. Jeśli rodzic następnej grupy
+// leży w poddrzewie rodzica obecnej, schodzimy do niego z obecnego
+// (descend), nie przechodząc jeszcze raz wspólnego prefiksu ścieżki.
+static void run_batch(Tree *tree, Batch *batch, int *results) {
+    if (batch->count == 0)
+        return;
+    BatchGroup **sorted = malloc(batch->n_groups * sizeof(BatchGroup *));
+    BatchOp *ordered = malloc(batch->count * sizeof(BatchOp));
+    if (!sorted || !ordered)
+        fatal("Malloc failure.");
+    for (size_t g = 0; g < batch->n_groups; ++g)
+        sorted[g] = &batch->groups[g];
+    qsort(sorted, batch->n_groups, sizeof(BatchGroup *), compare_groups);
+    size_t start = 0;
+    for (size_t g = 0; g < batch->n_groups; ++g) {
+        sorted[g]->start = start;
+        start += sorted[g]->count;
+        sorted[g]->count = 0;
+    }
+    for (size_t i = 0; i < batch->count; ++i) {
+        BatchGroup *group = &batch->groups[batch->ops[i].group];
+        ordered[group->start + group->count++] = batch->ops[i];
+    }
+
+    // Czas przejścia do rodzica grupy liczymy jej pierwszej operacji.
+    uint64_t op_start = latency_now();
+    ebr_enter();
+    Tree *parent = NULL;
+    const BatchGroup *held = NULL; // grupa, której rodzicem jest parent
+    for (size_t g = 0; g < batch->n_groups; ++g) {
+        const BatchGroup *group = sorted[g];
+        const PathComponent *components = batch->components + group->first;
+        if (held && group_below(held, group)) {
+            Tree *next = descend(parent, components + held->depth,
+                                 group->depth - held->depth, true, false,
+                                 bias_depth(tree) - held->depth);
+            tree_writer_type_final_protocol(parent);
+            parent = next;
+        } else {
+            if (parent)
+                tree_writer_type_final_protocol(parent);
+            parent = walk_path(tree, components, group->depth, true);
+        }
+        held = parent ? group : NULL;
+
+        for (size_t k = group->start; k < group->start + group->count; ++k) {
+            const BatchOp *op = &ordered[k];
+            int result;
+            if (!parent)
+                result = ENOENT;
+            else if (op->type == TREE_OP_CREATE)
+                result = create_child(tree, parent, &op->last);
+            else
+                result = remove_child(tree, parent, &op->last, NULL, 0);
+            results[op->index] = result;
+            op_start = record_op(op->type == TREE_OP_CREATE
+                                     ? TREE_STATS_CREATE
+                                     : TREE_STATS_REMOVE,
+                                 result, op_start);
+        }
+    }
+    if (parent)
+        tree_writer_type_final_protocol(parent);
+    ebr_exit();
+
+    free(sorted);
+    free(ordered);
+    batch->count = 0;
+    batch->n_components = 0;
+    batch->n_groups = 0;
+    memset(batch->group_table, 0, batch->group_table_capacity * sizeof(size_t));
+    if (batch->n_ancestors) {
+        memset(batch->ancestors, 0,
+               batch->ancestors_capacity * sizeof(unsigned long long));
+        batch->n_ancestors = 0;
+    }
+}
+
+void tree_apply_batch(Tree *tree, const TreeOp *ops, size_t n, int *results) {
+    if (tree && tree->journal) {
+        // Wpisy w dzienniku wymagają sprawdzenia ścieżki każdej zmiany
+        // (zob. create_at), więc operacje idą po kolei; i tak czekają na
+        // wspólne fsynce.
+        for (size_t i = 0; i < n; ++i) {
+            switch (ops[i].type) {
+            case TREE_OP_CREATE:
+                results[i] = tree_create(tree, ops[i].path);
+                break;
+            case TREE_OP_REMOVE:
+                results[i] = tree_remove(tree, ops[i].path);
+                break;
+            case TREE_OP_MOVE:
+                results[i] = tree_move(tree, ops[i].path, ops[i].target);
+                break;
+            default:
+                results[i] = EINVAL;
+            }
+        }
+        return;
+    }
+    PathComponent components[MAX_PATH_COMPONENTS];
+    Batch batch = {0};
+    for (size_t i = 0; i < n; ++i) {
+        if (ops[i].type == TREE_OP_MOVE) {
+            // Przeniesienie zmienia wiele ścieżek naraz, więc dzieli partię.
+            run_batch(tree, &batch, results);
+            results[i] = tree_move(tree, ops[i].path, ops[i].target);
+            continue;
+        }
+        if (ops[i].type != TREE_OP_CREATE && ops[i].type != TREE_OP_REMOVE) {
+            results[i] = EINVAL;
+            continue;
+        }
+        uint64_t start = latency_now();
+        TreeStatsOp stats_op = ops[i].type == TREE_OP_CREATE ? TREE_STATS_CREATE
+                                                             : TREE_STATS_REMOVE;
+        int n_components = tokenize_path(ops[i].path, components);
+        if (n_components < 0) {
+            results[i] = EINVAL;
+            record_op(stats_op, EINVAL, start);
+            continue;
+        }
+        if (n_components == 0) {
+            results[i] = ops[i].type == TREE_OP_CREATE ? EEXIST : EBUSY;
+            record_op(stats_op, results[i], start);
+            continue;
+        }
+        if (!tree) {
+            results[i] = ENOENT;
+            record_op(stats_op, ENOENT, start);
+            continue;
+        }
+        batch_add(tree, &batch, results, i, ops[i].type, ops[i].path,
+                  components, n_components);
+    }
+    run_batch(tree, &batch, results);
+    free(batch.ops);
+    free(batch.components);
+    free(batch.groups);
+    free(batch.group_table);
+    free(batch.ancestors);
+}
+
+// Ścieżka z tree_bulk_load. Wpisy są posortowane według ścieżek (strcmp,
+// a przy równych według kolejności w wejściu). Ponieważ '/' jest mniejsze
+// od liter, za folderem leżą od razu jego kolejne wystąpienia, a potem jego
+// potomkowie, w przedziałach kolejnych synów.
+typedef struct {
+    unsigned long long prefix; // pierwsze 8 znaków path, do szybszego sortowania
+    const char *path;
+    size_t index; // w paths
+} BulkEntry;
+
+// Przedział wpisów z potomkami syna, którego jeszcze nie ma w drzewie,
+// do zbudowania i dołączenia do folderu parent (z referencją, zob.
+// Tree.refs). Syn powstanie, jeśli wystąpi we wpisach o indeksach
+// nie mniejszych niż after, czyli gdy już będzie miał rodzica.
+typedef struct {
+    Tree *parent;
+    size_t begin, end;
+    size_t length; // długość ścieżki rodzica (z końcowym '/')
+    size_t after;
+} BulkItem;
+
+typedef struct {
+    Tree *tree; // korzeń
+    const BulkEntry *entries;
+    BulkItem *items;
+    size_t n_items, items_capacity;
+    atomic_size_t next_item; // pierwszy wolny dla wątków budujących
+    atomic_size_t created;
+} Bulk;
+
+// Pierwsze 8 znaków napisu jako liczba (big-endian, dopełniona zerami):
+// porównanie takich liczb daje porządek strcmp, o ile są różne.
+static unsigned long long path_prefix(const char *path) {
+    unsigned long long prefix = 0;
+    int i = 0;
+    for (; i < 8 && path[i]; ++i)
+        prefix = prefix << 8 | (unsigned char)path[i];
+    return prefix << (8 * (8 - i));
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const BulkEntry *x = a, *y = b;
+    if (x->prefix != y->prefix)
+        return x->prefix < y->prefix ? -1 : 1;
+    int cmp = strcmp(x->path, y->path);
+    if (cmp != 0)
+        return cmp;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Koniec przedziału wpisów [begin, end) zaczynających się od tych samych
+// prefix_length znaków co entries[begin].
+static size_t prefix_end(const BulkEntry *entries, size_t begin, size_t end,
+                         size_t prefix_length) {
+    const char *first = entries[begin].path;
+    size_t i = begin + 1;
+    while (i < end && strncmp(entries[i].path, first, prefix_length) == 0)
+        ++i;
+    return i;
+}
+
+// Syn folderu o ścieżce długości length, od którego zaczyna się
+// entries[begin]. Ustawia *occurrences na koniec wystąpień samego syna
+// i zwraca koniec przedziału jego potomków.
+static size_t child_group(const BulkEntry *entries, size_t begin, size_t end,
+                          size_t length, PathComponent *child,
+                          size_t *occurrences) {
+    child->name = entries[begin].path + length;
+    child->length = strchr(child->name, '/') - child->name;
+    child->hash = hmap_hash(child->name, child->length);
+    size_t child_length = length + child->length + 1;
+    size_t group = prefix_end(entries, begin, end, child_length);
+    size_t i = begin;
+    while (i < group && entries[i].path[child_length] == '\0')
+        ++i;
+    *occurrences = i;
+    return group;
+}
+
+// Indeks wejścia, w którym syn powstaje (pierwsze wystąpienie o indeksie
+// nie mniejszym niż after), powiększony o 1, albo 0, jeśli nie powstaje
+// (tree_create zwróciłoby ENOENT).
+static size_t created_at(const BulkEntry *entries, size_t begin,
+                         size_t occurrences, size_t after) {
+    for (size_t i = begin; i < occurrences; ++i) {
+        if (entries[i].index >= after)
+            return entries[i].index + 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// Buduje prywatnie, bez protokołów, potomków folderu tree o ścieżce długości
+// length, utworzonego w kroku after - 1, z wpisów [begin, end), i ustawia
+// agregaty tree. Zwraca liczbę utworzonych folderów.
+static size_t bulk_build(Tree *tree, const BulkEntry *entries, size_t begin,
+                         size_t end, size_t length, size_t after,
+                         unsigned long long born) {
+    HashMap *children = atomic_load_explicit(&tree->children,
+                                             memory_order_relaxed);
+    size_t count = 0;
+    Heights *heights = NULL;
+    while (begin < end) {
+        PathComponent name;
+        size_t occurrences;
+        size_t group = child_group(entries, begin, end, length, &name,
+                                   &occurrences);
+        size_t child_after = created_at(entries, begin, occurrences, after);
+        if (child_after) {
+            Tree *child = folder_new();
+            atomic_init(&child->parent, tree);
+            atomic_init(&child->stamp, born);
+            child->born = born;
+            if (!hmap_insert_hashed(children, name.name, name.length,
+                                    name.hash, child))
+                fatal("Malloc failure.");
+            count += 1 + bulk_build(child, entries, occurrences, group,
+                                    length + name.length + 1, child_after,
+                                    born);
+            heights_add(&heights, height_of(child), 1);
+        }
+        begin = group;
+    }
+    atomic_init(&tree->descendants, count);
+    atomic_init(&tree->heights, heights);
+    return count;
+}
+
+static void bulk_attach(Bulk *bulk, Tree *folder, size_t begin, size_t end,
+                        size_t length, bool queue);
+
+// Buduje syna z item i dołącza go do rodzica w jednym protokole pisarza.
+// Jeśli syn w międzyczasie powstał, zbudowane poddrzewo jest zwalniane,
+// a wpisy trafiają do istniejącego syna.
+static void bulk_run(Bulk *bulk, const BulkItem *item) {
+    const BulkEntry *entries = bulk->entries;
+    PathComponent name;
+    size_t occurrences;
+    child_group(entries, item->begin, item->end, item->length, &name,
+                &occurrences);
+    size_t after = created_at(entries, item->begin, occurrences, item->after);
+    size_t child_length = item->length + name.length + 1;
+    if (!after)
+        return;
+    // Zmiany migawek sprzed budowania i tak nie zobaczą nowych folderów.
+    unsigned long long born = atomic_load(&snapshot_clock) + 1;
+    Tree *child = folder_new();
+    atomic_init(&child->stamp, born);
+    child->born = born;
+    if (item->parent == bulk->tree)
+        shards_init(child);
+    size_t count = 1 + bulk_build(child, entries, occurrences, item->end,
+                                  child_length, after, born);
+
+    Tree *parent = item->parent;
+    ebr_enter();
+    tree_writer_type_entry_protocol(parent);
+    Tree *existing = NULL;
+    bool attached = false;
+    if (!atomic_load(&parent->removed)) {
+        existing = get_child(parent, &name);
+        if (existing) {
+            atomic_fetch_add_explicit(&existing->refs, 1, memory_order_relaxed);
+        } else {
+            Stamp stamp = stamp_change();
+            atomic_store_explicit(&child->parent, parent, memory_order_relaxed);
+            aggregate_child(bulk->tree, parent, true, count,
+                            height_of(child));
+            if (!hmap_insert_hashed(change_children(parent, stamp), name.name,
+                                    name.length, name.hash, child))
+                fatal("Malloc failure.");
+            attached = true;
+        }
+    }
+    tree_writer_type_final_protocol(parent);
+    ebr_exit();
+    if (attached) {
+        atomic_fetch_add_explicit(&bulk->created, count, memory_order_relaxed);
+        return;
+    }
+    tree_destroy(child); // nikt inny go nie widział
+    if (existing) {
+        bulk_attach(bulk, existing, occurrences, item->end, child_length, false);
+        tree_put(existing);
+    }
+}
+
+// Dołącza wpisy [begin, end) do istniejącego folderu folder o ścieżce
+// długości length (z referencją). Wystąpienia istniejących synów są
+// pomijane (EEXIST), a w nich schodzimy dalej. Nowych synów budujemy od
+// razu albo, jeśli queue, dopisujemy do bulk->items dla wątków budujących.
+static void bulk_attach(Bulk *bulk, Tree *folder, size_t begin, size_t end,
+                        size_t length, bool queue) {
+    const BulkEntry *entries = bulk->entries;
+    while (begin < end) {
+        PathComponent name;
+        size_t occurrences;
+        size_t group = child_group(entries, begin, end, length, &name,
+                                   &occurrences);
+        ebr_enter();
+        tree_reader_type_entry_protocol(folder);
+        Tree *child = atomic_load(&folder->removed) ? NULL
+                                                    : get_child(folder, &name);
+        if (child)
+            atomic_fetch_add_explicit(&child->refs, 1, memory_order_relaxed);
+        tree_reader_type_final_protocol(folder);
+        ebr_exit();
+        if (child) {
+            bulk_attach(bulk, child, occurrences, group,
+                        length + name.length + 1, queue);
+            tree_put(child);
+        } else {
+            atomic_fetch_add_explicit(&folder->refs, 1, memory_order_relaxed);
+            BulkItem item = {folder, begin, group, length, 0};
+            if (queue) {
+                reserve(&bulk->items, &bulk->items_capacity, bulk->n_items + 1,
+                        sizeof(BulkItem));
+                bulk->items[bulk->n_items++] = item;
+            } else {
+                bulk_run(bulk, &item);
+                tree_put(folder);
+            }
+        }
+        begin = group;
+    }
+}
+
+static void *bulk_worker(void *arg) {
+    Bulk *bulk = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&bulk->next_item, 1)) < bulk->n_items) {
+        bulk_run(bulk, &bulk->items[i]);
+        tree_put(bulk->items[i].parent);
+    }
+    return NULL;
+}
+
+// Sortuje wpisy: najpierw pozycyjnie (stabilnie) według prefix, bajt po
+// bajcie, a potem qsort w przedziałach równych prefiksów. Porównania
+// napisów, rozrzuconych po pamięci, są więc potrzebne tylko dla ścieżek
+// o wspólnych pierwszych 8 znakach.
+static void sort_entries(BulkEntry *entries, size_t n) {
+    BulkEntry *temporary = malloc(n * sizeof(BulkEntry));
+    if (!temporary)
+        fatal("Malloc failure.");
+    BulkEntry *from = entries, *to = temporary;
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = {0};
+        for (size_t i = 0; i < n; ++i)
+            ++counts[from[i].prefix >> shift & 0xff];
+        if (counts[from[0].prefix >> shift & 0xff] == n)
+            continue; // wszystkie mają ten bajt równy
+        size_t position = 0;
+        for (int byte = 0; byte < 256; ++byte) {
+            size_t count = counts[byte];
+            counts[byte] = position;
+            position += count;
+        }
+        for (size_t i = 0; i < n; ++i)
+            to[counts[from[i].prefix >> shift & 0xff]++] = from[i];
+        BulkEntry *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != entries)
+        memcpy(entries, from, n * sizeof(BulkEntry));
+    free(temporary);
+    for (size_t begin = 0, end; begin < n; begin = end) {
+        end = begin + 1;
+        while (end < n && entries[end].prefix == entries[begin].prefix)
+            ++end;
+        if (end - begin > 1)
+            qsort(entries + begin, end - begin, sizeof(BulkEntry),
+                  compare_entries);
+    }
+}
+
+// Część wejścia do posortowania przez jeden wątek.
+typedef struct {
+    const char **paths;
+    size_t begin, end; // w paths
+    BulkEntry *entries; // od entries[begin]
+    size_t count; // liczba poprawnych ścieżek (poza "/")
+    bool sorted;
+} BulkChunk;
+
+static void *bulk_sort_chunk(void *arg) {
+    BulkChunk *chunk = arg;
+    BulkEntry *entries = chunk->entries + chunk->begin;
+    for (size_t i = chunk->begin; i < chunk->end; ++i) {
+        const char *path = chunk->paths[i];
+        if (is_path_valid(path) && path[1] != '\0')
+            entries[chunk->count++] = (BulkEntry){path_prefix(path), path, i};
+    }
+    chunk->sorted = true;
+    for (size_t i = 1; i < chunk->count && chunk->sorted; ++i)
+        chunk->sorted = compare_entries(&entries[i - 1], &entries[i]) < 0;
+    if (!chunk->sorted)
+        sort_entries(entries, chunk->count);
+    return NULL;
+}
+
+// Scala posortowane przedziały [0, middle) i [middle, n) z entries przez
+// bufor temporary.
+static void merge_entries(BulkEntry *entries, size_t middle, size_t n,
+                          BulkEntry *temporary) {
+    size_t i = 0, j = middle, k = 0;
+    while (i < middle && j < n)
+        temporary[k++] = compare_entries(&entries[j], &entries[i]) < 0
+                             ? entries[j++]
+                             : entries[i++];
+    while (i < middle)
+        temporary[k++] = entries[i++];
+    memcpy(entries, temporary, k * sizeof(BulkEntry));
+}
+
+// Uruchamia fn w n wątkach (w tym wołającym); i-ty dostaje args + i * size.
+static void run_threads(void *(*fn)(void *), void *args, size_t size,
+                        int n) {
+    pthread_t *threads = malloc(n * sizeof(pthread_t));
+    if (!threads)
+        fatal("Malloc failure.");
+    for (int i = 1; i < n; ++i) {
+        if (pthread_create(&threads[i], NULL, fn, (char *)args + i * size) != 0)
+            syserr("pthread_create failed");
+    }
+    fn(args);
+    for (int i = 1; i < n; ++i) {
+        if (pthread_join(threads[i], NULL) != 0)
+            syserr("pthread_join failed");
+    }
+    free(threads);
+}
+
+static size_t bulk_load(Tree *tree, const char **paths, size_t n,
+                        int nthreads) {
+    if (!tree || !n)
+        return 0;
+    if (tree->journal) {
+        // Każdy folder potrzebuje wpisu w dzienniku (zob. create_at).
+        size_t created = 0;
+        for (size_t i = 0; i < n; ++i)
+            created += tree_create(tree, paths[i]) == 0;
+        return created;
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if ((size_t)nthreads > n)
+        nthreads = n;
+
+    // Każdy wątek sprawdza i sortuje swoją część, a potem je scalamy.
+    BulkEntry *entries = malloc(n * sizeof(BulkEntry));
+    BulkChunk *chunks = malloc(nthreads * sizeof(BulkChunk));
+    if (!entries || !chunks)
+        fatal("Malloc failure.");
+    for (int i = 0; i < nthreads; ++i) {
+        chunks[i] = (BulkChunk){paths, n * i / nthreads, n * (i + 1) / nthreads,
+                                entries, 0, true};
+    }
+    run_threads(bulk_sort_chunk, chunks, sizeof(BulkChunk), nthreads);
+    size_t count = chunks[0].count;
+    bool sorted = true;
+    for (int i = 1; i < nthreads; ++i) {
+        memmove(entries + count, entries + chunks[i].begin,
+                chunks[i].count * sizeof(BulkEntry));
+        if (chunks[i].count && count &&
+            compare_entries(&entries[count - 1], &entries[count]) > 0)
+            sorted = false;
+        chunks[i].begin = count;
+        count += chunks[i].count;
+    }
+    if (!sorted) {
+        // Scalamy sąsiednie części parami, więc każdy wpis jest przenoszony
+        // log(nthreads) razy.
+        BulkEntry *temporary = malloc(count * sizeof(BulkEntry));
+        if (!temporary)
+            fatal("Malloc failure.");
+        for (int width = 1; width < nthreads; width *= 2) {
+            for (int i = 0; i + width < nthreads; i += 2 * width) {
+                size_t begin = chunks[i].begin;
+                size_t end = i + 2 * width < nthreads ? chunks[i + 2 * width].begin
+                                                      : count;
+                merge_entries(entries + begin, chunks[i + width].begin - begin,
+                              end - begin, temporary);
+            }
+        }
+        free(temporary);
+    }
+    free(chunks);
+
+    // Schodzimy po istniejących folderach, a poddrzewa nowych synów budują
+    // i dołączają wątki.
+    Bulk bulk = {.tree = tree, .entries = entries};
+    atomic_init(&bulk.next_item, 0);
+    atomic_init(&bulk.created, 0);
+    atomic_fetch_add_explicit(&tree->refs, 1, memory_order_relaxed);
+    bulk_attach(&bulk, tree, 0, count, 1, true);
+    tree_put(tree);
+    int workers = bulk.n_items < (size_t)nthreads ? (int)bulk.n_items : nthreads;
+    if (workers > 0)
+        run_threads(bulk_worker, &bulk, 0, workers);
+    free(bulk.items);
+    free(entries);
+    return atomic_load(&bulk.created);
+}
+
+size_t tree_bulk_load(Tree *tree, const char **paths, size_t n, int nthreads) {
+    uint64_t start = latency_now();
+    size_t created = bulk_load(tree, paths, n, nthreads);
+    record_op(TREE_STATS_BULK_LOAD, 0, start);
+    return created;
+}
+
+// Foldery trafiają do tablicy obrazu w kolejności BFS: dopisujemy synów
+// kolejnych folderów z tablicy, w porządku nazw, więc synowie każdego
+// folderu tworzą w niej przedział.
+// W drzewie z dziennikiem migawka powstaje w sekcji krytycznej dziennika,
+// więc obraz zawiera dokładnie zmiany z wpisów do journal_position.
+int tree_save(Tree *tree, const char *file) {
+    if (!tree)
+        return ENOENT;
+    TreeSnapshot *snapshot;
+    uint64_t lsn = 0;
+    if (tree->journal) {
+        journal_lock(tree->journal);
+        snapshot = tree_snapshot(tree);
+        lsn = journal_position(tree->journal);
+        journal_unlock(tree->journal);
+    } else {
+        snapshot = tree_snapshot(tree);
+    }
+    ImageNode *nodes = NULL;
+    Tree **folders = NULL; // folders[i] to folder opisany przez nodes[i]
+    size_t nodes_capacity = 0, folders_capacity = 0;
+    char *names = NULL;
+    size_t names_size = 0, names_capacity = 0;
+    reserve(&nodes, &nodes_capacity, 1, sizeof(ImageNode));
+    reserve(&folders, &folders_capacity, 1, sizeof(Tree *));
+    memset(&nodes[0], 0, sizeof(ImageNode));
+    folders[0] = tree;
+    size_t n = 1;
+    int result = 0;
+    for (size_t i = 0; i < n && !result; ++i) {
+        ebr_enter();
+        HashMap *children = children_at(folders[i], snapshot->version);
+        size_t count = hmap_size(children);
+        if (n + count > UINT32_MAX) {
+            ebr_exit();
+            result = EFBIG;
+            break;
+        }
+        nodes[i].first_child = n;
+        nodes[i].child_count = count;
+        reserve(&nodes, &nodes_capacity, n + count, sizeof(ImageNode));
+        reserve(&folders, &folders_capacity, n + count, sizeof(Tree *));
+        const char *key;
+        void *value;
+        HashMapIterator it = hmap_iterator(children);
+        while (hmap_next(children, &it, &key, &value)) {
+            size_t length = strlen(key);
+            if (names_size + length > UINT32_MAX) {
+                result = EFBIG;
+                break;
+            }
+            reserve(&names, &names_capacity, names_size + length, 1);
+            memcpy(names + names_size, key, length);
+            nodes[n].name_offset = names_size;
+            nodes[n].name_length = length;
+            folders[n++] = value;
+            names_size += length;
+        }
+        ebr_exit();
+    }
+    if (!result)
+        result = image_write(file, nodes, n, names, names_size, lsn);
+    free(nodes);
+    free(folders);
+    free(names);
+    tree_snapshot_release(snapshot);
+    return result;
+}
+
+Tree *tree_load(const char *file) {
+    Image *image = image_open(file);
+    if (!image)
+        return NULL;
+    Tree *tree = tree_alloc();
+    tree->image = image;
+    image_aggregates(tree);
+    root_init(tree);
+    return tree;
+}
+
+int tree_journal_open(Tree *tree, const char *file, unsigned max_delay_us,
+                      size_t max_batch_bytes) {
+    if (!tree)
+        return ENOENT;
+    if (tree->journal)
+        return EBUSY;
+    // Wpisy sprzed obrazu, z którego wczytano drzewo, już w nim są.
+    uint64_t after = tree->image ? tree->image->journal_lsn : 0;
+    tree->journal = journal_open(file, after, max_delay_us, max_batch_bytes);
+    return tree->journal ? 0 : errno;
+}
+
+static void replay(void *arg, int type, const char *path, const char *target) {
+    Tree *tree = arg;
+    switch (type) {
+    case TREE_OP_CREATE:
+        tree_create(tree, path);
+        break;
+    case TREE_OP_REMOVE:
+        tree_remove(tree, path);
+        break;
+    case TREE_OP_MOVE:
+        if (target)
+            tree_move(tree, path, target);
+        break;
+    }
+}
+
+Tree *tree_recover(const char *image_file, const char *journal_file,
+                   unsigned max_delay_us, size_t max_batch_bytes) {
+    Tree *tree = image_file ? tree_load(image_file) : tree_new();
+    if (!tree)
+        return NULL;
+    uint64_t after = tree->image ? tree->image->journal_lsn : 0;
+    int error = journal_replay(journal_file, after, replay, tree);
+    if (error == ENOENT) // jeszcze nie było żadnej zmiany
+        error = 0;
+    if (!error)
+        error = tree_journal_open(tree, journal_file, max_delay_us,
+                                  max_batch_bytes);
+    if (error) {
+        tree_free(tree);
+        errno = error;
+        return NULL;
+    }
+    return tree;
+}
+
+void tree_cache_stats(unsigned long *hits, unsigned long *misses) {
+    dcache_stats(hits, misses);
+}
+
+#ifdef TREE_CONTENTION_STATS
+// Najpierw foldery, w których najdłużej czekano, potem najczęściej.
+static int compare_contention(const TreeContention *x, const TreeContention *y) {
+    if (x->wait_ns != y->wait_ns)
+        return x->wait_ns < y->wait_ns ? 1 : -1;
+    if (x->waits != y->waits)
+        return x->waits < y->waits ? 1 : -1;
+    if (x->acquisitions != y->acquisitions)
+        return x->acquisitions < y->acquisitions ? 1 : -1;
+    return 0;
+}
+
+// Najbardziej oblegane foldery, posortowane jak w compare_contention.
+typedef struct {
+    TreeContention *entries;
+    size_t count, top_k;
+} ContentionTop;
+
+// Dopisuje folder path (o długości length w path) do top, jeśli się
+// w nim mieści.
+static void contention_offer(ContentionTop *top, const ContentionStats *stats,
+                             const char *path, size_t length) {
+    TreeContention entry = {NULL, stats->acquisitions, stats->waits,
+                            stats->wait_ns, stats->max_wait_ns};
+    size_t i = top->count;
+    while (i > 0 && compare_contention(&entry, &top->entries[i - 1]) < 0)
+        --i;
+    if (i == top->top_k)
+        return;
+    if (top->count == top->top_k)
+        free(top->entries[--top->count].path);
+    memmove(&top->entries[i + 1], &top->entries[i],
+            (top->count - i) * sizeof(TreeContention));
+    entry.path = strndup(path, length);
+    if (!entry.path)
+        fatal("Malloc failure.");
+    top->entries[i] = entry;
+    top->count++;
+}
+
+// Folder na stosie contention_walk: jego synowie, pozycja w nich i długość
+// jego ścieżki.
+typedef struct {
+    Tree *folder;
+    HashMap *children;
+    HashMapIterator it;
+    size_t length;
+} ContentionFrame;
+
+// Przechodzi drzewo tree w głąb, trzymając blokady przodków jako czytelnik,
+// więc foldery nie znikają w trakcie. Blokad nie liczymy (rwlock zamiast
+// protokołów). Foldery z obrazu, do których nikt nie wszedł, nie mają map
+// synów ani liczników, więc je pomijamy.
+// Stos i bufor ścieżki są na stercie i rosną w miarę potrzeby: przeniesienie
+// może dać folder głębszy i o dłuższej ścieżce niż MAX_PATH_LENGTH.
+static void contention_walk(ContentionTop *top, Tree *tree) {
+    ContentionFrame *stack = NULL;
+    size_t depth = 0, stack_capacity = 0;
+    char *path = NULL;
+    size_t path_capacity = 0;
+    reserve(&path, &path_capacity, 1, 1);
+    path[0] = '/';
+    size_t length = 1;
+    for (;;) {
+        // Wchodzimy do tree o ścieżce path długości length.
+        ContentionStats stats = contention_read(&tree->contention);
+        if (stats.acquisitions)
+            contention_offer(top, &stats, path, length);
+        rwlock_read_lock(&tree->lock);
+        reserve(&stack, &stack_capacity, depth + 1, sizeof(ContentionFrame));
+        ContentionFrame *frame = &stack[depth++];
+        frame->folder = tree;
+        frame->children = atomic_load_explicit(&tree->children,
+                                               memory_order_acquire);
+        if (frame->children)
+            frame->it = hmap_iterator(frame->children);
+        frame->length = length;
+
+        // Szukamy następnego syna, wychodząc z folderów bez kolejnych synów.
+        tree = NULL;
+        while (depth > 0 && !tree) {
+            frame = &stack[depth - 1];
+            const char *key;
+            void *value;
+            if (frame->children &&
+                hmap_next(frame->children, &frame->it, &key, &value)) {
+                size_t key_length = strlen(key);
+                length = frame->length + key_length + 1;
+                reserve(&path, &path_capacity, length, 1);
+                memcpy(path + frame->length, key, key_length);
+                path[length - 1] = '/';
+                tree = value;
+            } else {
+                rwlock_read_unlock(&frame->folder->lock);
+                --depth;
+            }
+        }
+        if (!tree)
+            break;
+    }
+    free(stack);
+    free(path);
+}
+#endif
+
+TreeContention *tree_contention_report(Tree *tree, size_t top_k) {
+#ifdef TREE_CONTENTION_STATS
+    if (!tree)
+        return NULL;
+    ContentionTop top = {malloc((top_k + 1) * sizeof(TreeContention)), 0,
+                         top_k};
+    if (!top.entries)
+        fatal("Malloc failure.");
+    contention_walk(&top, tree);
+    top.entries[top.count].path = NULL;
+    return top.entries;
+#else
+    (void)tree;
+    (void)top_k;
+    return NULL;
+#endif
+}
+
+void tree_contention_free(TreeContention *report) {
+    if (!report)
+        return;
+    for (TreeContention *entry = report; entry->path; ++entry)
+        free(entry->path);
+    free(report);
+}
+
+void tree_contention_reset(void) {
+#ifdef TREE_CONTENTION_STATS
+    contention_reset();
+#endif
+}
+
+struct TreeStats {
+    LatencyHistogram histograms[TREE_STATS_OPS * TREE_STATS_RESULTS];
+};
+
+// Histogramy w chwili ostatniego tree_stats_reset, odejmowane od bieżących
+// (histogramy wątków zmieniają tylko ich właściciele, więc nie da się ich
+// wyzerować z zewnątrz).
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static TreeStats *stats_baseline = NULL;
+
+TreeStats *tree_stats_snapshot(void) {
+    TreeStats *stats = malloc(sizeof(TreeStats));
+    if (!stats)
+        fatal("Malloc failure.");
+    if (pthread_mutex_lock(&stats_lock) != 0)
+        syserr("lock failed");
+    latency_collect(stats->histograms, TREE_STATS_OPS * TREE_STATS_RESULTS);
+    if (stats_baseline) {
+        for (int i = 0; i < TREE_STATS_OPS * TREE_STATS_RESULTS; ++i)
+            latency_subtract(&stats->histograms[i], &stats_baseline->histograms[i]);
+    }
+    if (pthread_mutex_unlock(&stats_lock) != 0)
+        syserr("mutex unlock failed");
+    return stats;
+}
+
+void tree_stats_free(TreeStats *stats) {
+    free(stats);
+}
+
+unsigned long long tree_stats_count(const TreeStats *stats, TreeStatsOp op,
+                                    TreeStatsResult result) {
+    return stats->histograms[op * TREE_STATS_RESULTS + result].count;
+}
+
+unsigned long long tree_stats_total_ns(const TreeStats *stats, TreeStatsOp op,
+                                       TreeStatsResult result) {
+    return stats->histograms[op * TREE_STATS_RESULTS + result].sum_ns;
+}
+
+unsigned long long tree_stats_quantile(const TreeStats *stats, TreeStatsOp op,
+                                       TreeStatsResult result, double quantile) {
+    return latency_quantile(&stats->histograms[op * TREE_STATS_RESULTS + result],
+                            quantile);
+}
+
+void tree_stats_reset(void) {
+    TreeStats *baseline = malloc(sizeof(TreeStats));
+    if (!baseline)
+        fatal("Malloc failure.");
+    if (pthread_mutex_lock(&stats_lock) != 0)
+        syserr("lock failed");
+    latency_collect(baseline->histograms, TREE_STATS_OPS * TREE_STATS_RESULTS);
+    free(stats_baseline);
+    stats_baseline = baseline;
+    if (pthread_mutex_unlock(&stats_lock) != 0)
+        syserr("mutex unlock failed");
+}
@@ -7,23 +7,283 @@ typedef struct Tree Tree; // Let "Tree" mean the same as "struct Tree".
 // Tworzy nowe drzewo folderów z jednym, pustym folderem "/".
 Tree *tree_new();
 
-// Zwalnia całą pamięć związaną z podanym drzewem.
+// Zwalnia całą pamięć związaną z podanym drzewem. Jeśli działa wątek
+// zwalniający (tree_reclaimer_start), tylko przekazuje mu drzewo.
 void tree_free(Tree *);
 
-// Wymienia zawartość danego folderu, zwracając nowy napis postaci "foo,bar,baz"
+// Zapisuje drzewo w pliku file jako obraz binarny (zob. image.h): tablicę
+// folderów, napisy z nazwami i posortowane przedziały synów. Zapisywana jest
+// migawka drzewa (tree_snapshot), więc obraz jest spójny, a zapis nie
+// blokuje innych operacji. Zwraca 0 lub kod błędu (jak errno).
+int tree_save(Tree *tree, const char *file);
+
+// Wczytuje drzewo zapisane przez tree_save. Plik jest mapowany do pamięci,
+// a foldery są budowane leniwie: zawartość folderu powstaje dopiero przy
+// pierwszym wejściu do niego. Zwraca NULL (i ustawia errno), jeśli pliku
+// nie da się wczytać.
+Tree *tree_load(const char *file);
+
+// Włącza dziennik zmian (zob. journal.h) w pliku file: każde udane
+// tree_create, tree_remove i tree_move jest w nim zapisywane, a operacja
+// kończy się dopiero, gdy wpis jest na dysku. Zapisy na dysk są grupowane:
+// fsync obejmuje wszystkie wpisy, które zebrały się w ciągu max_delay_us
+// mikrosekund od pierwszego z nich (albo do max_batch_bytes bajtów, jeśli
+// to nie 0), więc współbieżni pisarze dzielą koszt jednego fsync. Operacje
+// nie trzymają blokad folderów, czekając na dysk.
+// Plik powinien być nowy albo pochodzić z tree_recover tego drzewa. Obrazy
+// z tree_save zapamiętują, ile wpisów dziennika zawierają.
+// Nie może działać współbieżnie z innymi operacjami na drzewie. Dziennik
+// zamyka tree_free. Zwraca 0 lub kod błędu (jak errno).
+int tree_journal_open(Tree *tree, const char *file, unsigned max_delay_us,
+                      size_t max_batch_bytes);
+
+// Odtwarza drzewo po awarii: wczytuje obraz image_file (albo, jeśli to
+// NULL, zaczyna od pustego drzewa), wykonuje zmiany z dziennika
+// journal_file, których obraz nie zawiera, i dalej zapisuje zmiany w tym
+// dzienniku (jak tree_journal_open). Wpis przerwany przez awarię jest
+// pomijany. Zwraca NULL (i ustawia errno), jeśli się nie uda.
+Tree *tree_recover(const char *image_file, const char *journal_file,
+                   unsigned max_delay_us, size_t max_batch_bytes);
+
+// Uruchamia wątek, który w tle zwalnia drzewa z tree_free oraz foldery
+// usunięte przez tree_remove (partiami), żeby nie robiły tego wątki
+// wykonujące operacje.
+void tree_reclaimer_start(void);
+
+// Zatrzymuje wątek zwalniający, gdy zwolni wszystko, co mu przekazano.
+void tree_reclaimer_stop(void);
+
+// Włącza uprzywilejowanie czytelników (zob. rbias.h) w folderach na
+// głębokościach mniejszych od depth (korzeń ma głębokość 0; 0 wyłącza).
+// Czytelnik wchodzi wtedy do takiego folderu, pisząc tylko we własnej linii
+// pamięci, zamiast w blokadzie folderu, którą dzielą wszystkie operacje.
+// Pisarz płaci za to oczekiwaniem, aż wyjdą czytelnicy, i wyłącza tryb w
+// folderze na czas proporcjonalny do tego oczekiwania, więc foldery często
+// zmieniane pozostają w zwykłym trybie. Opłaca się dla najwyższych
+// poziomów drzewa, przez które przechodzi większość operacji, a które
+// rzadko się zmieniają.
+void tree_set_reader_bias(Tree *tree, int depth);
+
+// Wymienia zawartość danego folderu, zwracając nowy napis postaci "bar,baz,foo"
 // (wszystkie nazwy podfolderów; tylko bezpośrednich podfolderów,
-// czyli bez wchodzenia wgłąb; w dowolnej kolejności, oddzielone przecinkami,
+// czyli bez wchodzenia wgłąb; posortowane rosnąco, oddzielone przecinkami,
 // zakończone znakiem zerowym).
 // (Zwolnienie pamięci napisu jest odpowiedzialnością wołającego tree_list).
 char *tree_list(Tree *tree, const char *path);
 
+// Jak tree_list, ale zwraca napis współdzielony z innymi wywołaniami, który
+// trzeba oddać przez tree_list_release (a nie free). Lista dużego folderu
+// jest zapamiętywana w nim do najbliższej zmiany, więc kolejne wywołania
+// nie budują jej od nowa.
+const char *tree_list_shared(Tree *tree, const char *path);
+
+// Oddaje napis zwrócony przez tree_list_shared (NULL jest ignorowany).
+void tree_list_release(const char *list);
+
+// Jak tree_list, ale tylko nazwy name takie, że from <= name < to
+// (w porządku strcmp). NULL zamiast from lub to oznacza brak ograniczenia
+// z tej strony. Czas jest proporcjonalny do długości wyniku.
+char *tree_list_range(Tree *tree, const char *path, const char *from,
+                      const char *to);
+
+// Jak tree_list, ale tylko nazwy zaczynające się od prefix.
+char *tree_list_prefix(Tree *tree, const char *path, const char *prefix);
+
+// Rozmiar i wysokość poddrzewa folderu.
+typedef struct {
+    size_t descendants; // liczba folderów w poddrzewie, bez samego folderu
+    int height; // najdłuższa droga w dół od folderu (0 dla pustego)
+} TreeStat;
+
+// Podaje w *stat rozmiar i wysokość poddrzewa folderu path w czasie
+// proporcjonalnym do głębokości folderu, bez przechodzenia poddrzewa: każdy
+// folder przechowuje je na bieżąco, a tree_create, tree_remove i tree_move
+// poprawiają je u przodków zmienianego folderu atomowymi dodawaniami
+// i podmianami (CAS), bez żadnych blokad. Wynik uwzględnia wszystkie
+// zakończone operacje; współbieżne mogą być widoczne tylko u części
+// przodków. Zwraca 0, EINVAL lub ENOENT.
+int tree_stat(Tree *tree, const char *path, TreeStat *stat);
+
+// Kursor do wypisywania zawartości folderu porcjami, dla folderów zbyt
+// dużych, żeby budować jeden napis. Między porcjami kursor nie blokuje
+// folderu, więc zmiany w nim mogą się przeplatać z wypisywaniem:
+// - nazwy są zwracane rosnąco i każda najwyżej raz,
+// - każdy syn obecny w folderze przez cały czas wypisywania zostanie
+//   zwrócony dokładnie raz,
+// - syn utworzony lub usunięty w trakcie może zostać zwrócony lub nie,
+// - każda porcja jest spójnym obrazem fragmentu folderu.
+// Kursor jest związany z folderem, a nie ze ścieżką: po przeniesieniu
+// folderu wypisuje dalej jego zawartość, a po usunięciu kończy wypisywanie.
+typedef struct TreeListCursor TreeListCursor;
+
+// Bufor tej wielkości zawsze mieści co najmniej jedną nazwę.
+#define TREE_LIST_MIN_CHUNK 256
+
+// Otwiera kursor na folderze path. Zwraca NULL, jeśli ścieżka jest
+// niepoprawna lub folderu nie ma.
+TreeListCursor *tree_list_open(Tree *tree, const char *path);
+
+// Zapisuje w buf (o pojemności cap) kolejne nazwy postaci "foo,bar",
+// zakończone znakiem zerowym, tyle, ile się zmieści. Zwraca liczbę
+// zapisanych nazw, 0 na końcu folderu lub -1, jeśli buf nie mieści
+// kolejnej nazwy (wtedy wywołanie można powtórzyć z większym buforem).
+int tree_list_next(TreeListCursor *cursor, char *buf, size_t cap);
+
+// Zamyka kursor (NULL jest ignorowany).
+void tree_list_close(TreeListCursor *cursor);
+
+// Migawka całego drzewa: niezmienny obraz z chwili jej utworzenia, np. do
+// kopii zapasowych. Czytanie migawki nie wykonuje protokołów w folderach
+// drzewa (najwyżej czeka, aż pisarz wyjdzie z folderu), a przeniesienie
+// widzi w całości albo wcale. Dopóki migawka żyje, pisarz przed zmianą
+// folderu, którego zawartość migawka mogłaby czytać, kopiuje tę zawartość,
+// więc płaci tylko za foldery, które zmienia. Zwolnienie migawki zwalnia
+// kopie, których nie potrzebuje już żadna inna migawka.
+// Migawki drzewa trzeba zwolnić przed tree_free.
+typedef struct TreeSnapshot TreeSnapshot;
+
+// Tworzy migawkę drzewa. Zwraca NULL, jeśli tree jest NULL-em.
+TreeSnapshot *tree_snapshot(Tree *tree);
+
+// Jak tree_list, ale wymienia zawartość folderu path w migawce.
+char *tree_snapshot_list(TreeSnapshot *snapshot, const char *path);
+
+// Zwalnia migawkę (NULL jest ignorowany).
+void tree_snapshot_release(TreeSnapshot *snapshot);
+
 // Tworzy nowy podfolder (np. dla path="/foo/bar/baz/",
 // tworzy pusty podfolder baz w folderze "/foo/bar/").
 int tree_create(Tree *tree, const char *path);
 
+// Jak mkdir -p: tworzy folder path razem ze wszystkimi brakującymi
+// folderami na drodze do niego. Ścieżka jest przechodzona raz, a protokół
+// pisarza jest wykonywany tylko w najgłębszym istniejącym folderze.
+// Zwraca 0, EEXIST (jeśli folder path już istniał) lub kod błędu
+// jak tree_create.
+int tree_create_path(Tree *tree, const char *path);
+
 // Usuwa folder, o ile jest pusty.
 int tree_remove(Tree *tree, const char *path);
 
 // Przenosi folder source wraz z zawartością na miejsce target
 // (przenoszone jest całe poddrzewo), o ile to możliwe.
 int tree_move(Tree *tree, const char *source, const char *target);
+
+// Podaje, ile razy od startu programu folder został znaleziony w pamięci
+// podręcznej ścieżek (dcache.h), a ile razy trzeba było przejść drzewo.
+void tree_cache_stats(unsigned long *hits, unsigned long *misses);
+
+// Liczniki rywalizacji o folder: ile razy wykonano w nim protokół wstępny
+// (czytelnika lub pisarza), ile razy trzeba było przy tym czekać, jak długo
+// łącznie i najdłużej.
+typedef struct {
+    char *path;
+    unsigned long long acquisitions;
+    unsigned long long waits;
+    unsigned long long wait_ns;
+    unsigned long long max_wait_ns;
+} TreeContention;
+
+// Zwraca top_k folderów drzewa, w których wątki czekały najdłużej, od
+// najbardziej obleganego, jako tablicę zakończoną elementem z path równym
+// NULL (do zwolnienia przez tree_contention_free). Liczniki są zbierane
+// tylko w programie skompilowanym z TREE_CONTENTION_STATS (opcja CMake),
+// w kilku częściach w każdym folderze (zob. contention.h); bez tego zwraca
+// NULL. Liczniki usuniętego folderu znikają razem z nim. Raport przechodzi
+// całe drzewo.
+TreeContention *tree_contention_report(Tree *tree, size_t top_k);
+
+// Zwalnia wynik tree_contention_report (NULL jest ignorowany).
+void tree_contention_free(TreeContention *report);
+
+// Zeruje liczniki rywalizacji wszystkich drzew, np. między pomiarami.
+void tree_contention_reset(void);
+
+// Histogramy czasów operacji, prowadzone zawsze: każdy wątek zapisuje
+// czasy swoich tree_list (razem z tree_list_shared, tree_list_range
+// i tree_list_prefix), tree_create, tree_remove i tree_move we własnych
+// histogramach (zob. latency.h), osobno dla każdego rodzaju wyniku.
+// Operacje z tree_apply_batch (także z wykonawcy, zob. executor.h) są
+// liczone pojedynczo, z przejściem do rodzica w pierwszej operacji w nim.
+// tree_bulk_load jest liczone jako jedna operacja TREE_STATS_BULK_LOAD
+// (z wynikiem TREE_STATS_OK), bo czasów i wyników pojedynczych ścieżek nie
+// zna; w drzewie z dziennikiem jego tree_create są liczone też osobno.
+// tree_stats_snapshot sumuje je dla wszystkich drzew i wątków.
+typedef enum {
+    TREE_STATS_LIST,
+    TREE_STATS_CREATE,
+    TREE_STATS_REMOVE,
+    TREE_STATS_MOVE,
+    TREE_STATS_BULK_LOAD,
+    TREE_STATS_OPS,
+} TreeStatsOp;
+
+typedef enum {
+    TREE_STATS_OK, // 0 albo lista
+    TREE_STATS_EINVAL,
+    TREE_STATS_ENOENT, // także NULL z tree_list dla poprawnej ścieżki
+    TREE_STATS_EEXIST,
+    TREE_STATS_ENOTEMPTY,
+    TREE_STATS_EBUSY,
+    TREE_STATS_OTHER, // np. przeniesienie do własnego poddrzewa
+    TREE_STATS_RESULTS,
+} TreeStatsResult;
+
+typedef struct TreeStats TreeStats;
+
+// Zwraca histogramy od ostatniego tree_stats_reset (albo od startu
+// programu). Wynik trzeba zwolnić przez tree_stats_free.
+TreeStats *tree_stats_snapshot(void);
+
+void tree_stats_free(TreeStats *stats);
+
+// Liczba operacji op z wynikiem result i ich łączny czas w nanosekundach.
+unsigned long long tree_stats_count(const TreeStats *stats, TreeStatsOp op,
+                                    TreeStatsResult result);
+unsigned long long tree_stats_total_ns(const TreeStats *stats, TreeStatsOp op,
+                                       TreeStatsResult result);
+
+// Czas (w nanosekundach, z dokładnością do 1/16), którego nie przekroczyła
+// część quantile operacji op z wynikiem result, np. 0.99; 0, jeśli takich
+// operacji nie było.
+unsigned long long tree_stats_quantile(const TreeStats *stats, TreeStatsOp op,
+                                       TreeStatsResult result, double quantile);
+
+// Zaczyna nowy okres pomiaru: kolejne tree_stats_snapshot liczą tylko
+// operacje od tej chwili.
+void tree_stats_reset(void);
+
+// Rodzaj operacji w tree_apply_batch.
+typedef enum {
+    TREE_OP_CREATE, // tree_create(tree, path)
+    TREE_OP_REMOVE, // tree_remove(tree, path)
+    TREE_OP_MOVE, // tree_move(tree, path, target)
+} TreeOpType;
+
+typedef struct {
+    TreeOpType type;
+    const char *path;
+    const char *target; // Tylko dla TREE_OP_MOVE.
+} TreeOp;
+
+// Wykonuje n operacji z ops i zapisuje w results[i] wynik ops[i], taki sam,
+// jaki dałyby kolejne wywołania tree_create, tree_remove i tree_move
+// (o ile w tym czasie nikt inny nie zmienia drzewa).
+// Operacje są grupowane według folderu rodzica: wspólny prefiks ścieżek
+// przechodzimy raz, a protokół pisarza w rodzicu wykonujemy raz dla całej
+// grupy. Przeniesienia dzielą partię i są wykonywane osobno.
+// Napisy z ops muszą być poprawne do końca wywołania.
+// W drzewie z dziennikiem (tree_journal_open) operacje są wykonywane
+// po kolei.
+void tree_apply_batch(Tree *tree, const TreeOp *ops, size_t n, int *results);
+
+// Tworzy foldery o ścieżkach z paths z takim samym skutkiem jak kolejne
+// wywołania tree_create(tree, paths[i]) (o ile w tym czasie nikt inny nie
+// zmienia tych folderów), więc ścieżki niepoprawne, istniejące i takie,
+// których rodzic nie istnieje w chwili ich kolejki, są pomijane. Do wstępnego
+// wypełniania drzewa: nthreads wątków sortuje ścieżki, a potem buduje
+// poddrzewa nowych folderów prywatnie, bez protokołów, i dołącza każde do
+// istniejącego rodzica w jednym protokole pisarza. W drzewie z dziennikiem
+// (tree_journal_open) foldery są tworzone po kolei. Zwraca liczbę
+// utworzonych folderów.
+size_t tree_bulk_load(Tree *tree, const char **paths, size_t n, int nthreads);
@@ -0,0 +1,84 @@
+#include <stdatomic.h>
+#include <time.h>
+
+#include "contention.h"
+#include "err.h"
+
+static atomic_ullong epoch = 0;
+
+// Shards are handed out to threads round-robin.
+static atomic_uint threads = 0;
+static _Thread_local int self = -1;
+
+static int shard_index(void)
+{
+    if (self < 0)
+        self = atomic_fetch_add_explicit(&threads, 1, memory_order_relaxed) % CONTENTION_SHARDS;
+    return self;
+}
+
+uint64_t contention_clock(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        syserr("clock_gettime failed");
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void contention_init(ContentionCounters* counters)
+{
+    for (int i = 0; i < CONTENTION_SHARDS; ++i) {
+        ContentionShard* s = &counters->shards[i];
+        atomic_init(&s->epoch, 0);
+        atomic_init(&s->acquisitions, 0);
+        atomic_init(&s->waits, 0);
+        atomic_init(&s->wait_ns, 0);
+        atomic_init(&s->max_wait_ns, 0);
+    }
+}
+
+void contention_record(ContentionCounters* counters, bool waited, uint64_t wait_ns)
+{
+    ContentionShard* s = &counters->shards[shard_index()];
+    uint64_t current = atomic_load_explicit(&epoch, memory_order_relaxed);
+    if (atomic_load_explicit(&s->epoch, memory_order_relaxed) != current) {
+        atomic_store_explicit(&s->acquisitions, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->waits, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->wait_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->max_wait_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->epoch, current, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&s->acquisitions, 1, memory_order_relaxed);
+    if (!waited)
+        return;
+    atomic_fetch_add_explicit(&s->waits, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->wait_ns, wait_ns, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&s->max_wait_ns, memory_order_relaxed);
+    while (wait_ns > max &&
+           !atomic_compare_exchange_weak_explicit(&s->max_wait_ns, &max, wait_ns,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+ContentionStats contention_read(const ContentionCounters* counters)
+{
+    ContentionStats stats = { 0, 0, 0, 0 };
+    uint64_t current = atomic_load_explicit(&epoch, memory_order_relaxed);
+    for (int i = 0; i < CONTENTION_SHARDS; ++i) {
+        const ContentionShard* s = &counters->shards[i];
+        if (atomic_load_explicit(&s->epoch, memory_order_relaxed) != current)
+            continue;
+        stats.acquisitions += atomic_load_explicit(&s->acquisitions, memory_order_relaxed);
+        stats.waits += atomic_load_explicit(&s->waits, memory_order_relaxed);
+        stats.wait_ns += atomic_load_explicit(&s->wait_ns, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&s->max_wait_ns, memory_order_relaxed);
+        if (max > stats.max_wait_ns)
+            stats.max_wait_ns = max;
+    }
+    return stats;
+}
+
+void contention_reset(void)
+{
+    atomic_fetch_add_explicit(&epoch, 1, memory_order_relaxed);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Per-object lock contention counters.
+//
+// The counters live in the counted object itself (ContentionCounters), so
+// they go away with it: nothing keeps removed objects alive and nothing
+// grows with the number of objects ever counted. They are split into
+// CONTENTION_SHARDS shards; every thread always counts in the same shard,
+// so threads entering one object mostly write different cache lines.
+//
+// contention_reset starts a new epoch instead of visiting all objects: a
+// shard last written in an older epoch counts as empty and is cleared by
+// its next writer. Counts recorded concurrently with a reset or with the
+// clearing of their shard may be lost.
+
+#define CONTENTION_SHARDS 4
+
+// One shard per cache line; objects embedding ContentionCounters must be
+// allocated with their full alignment.
+typedef struct {
+    _Alignas(64) atomic_ullong epoch; // contention epoch of the counts below
+    atomic_ullong acquisitions;
+    atomic_ullong waits; // Acquisitions that had to wait.
+    atomic_ullong wait_ns; // Total time spent waiting.
+    atomic_ullong max_wait_ns;
+} ContentionShard;
+
+typedef struct {
+    ContentionShard shards[CONTENTION_SHARDS];
+} ContentionCounters;
+
+typedef struct {
+    uint64_t acquisitions;
+    uint64_t waits;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+} ContentionStats;
+
+// Current time in nanoseconds, for measuring waits.
+uint64_t contention_clock(void);
+
+// Initialize the counters of a new object.
+void contention_init(ContentionCounters* counters);
+
+// Count an acquisition of the lock with `counters`; `wait_ns` is the time
+// it waited, if `waited`.
+void contention_record(ContentionCounters* counters, bool waited, uint64_t wait_ns);
+
+// Sum the shards of `counters` in the current epoch.
+ContentionStats contention_read(const ContentionCounters* counters);
+
+// Drop all counts of all objects.
+void contention_reset(void);
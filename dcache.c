@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "ebr.h"
+#include "err.h"
+
+// Hit and miss counters are striped over cache lines, so that counting does
+// not make all threads write the same line.
+#define STAT_STRIPES 16
+#define CACHE_LINE 64
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_ulong hits;
+    atomic_ulong misses;
+} StatStripe;
+
+typedef struct {
+    _Atomic(DCacheEntry*) ways[DCACHE_WAYS];
+    atomic_uint hand; // CLOCK hand.
+} Set;
+
+static Set sets[DCACHE_SETS];
+static StatStripe stats[STAT_STRIPES];
+
+static atomic_uint next_stripe = 0;
+static _Thread_local int stripe = -1;
+
+static bool matches(const DCacheEntry* entry, unsigned long long owner, const char* key,
+                    size_t length, unsigned long long hash)
+{
+    return entry->hash == hash && entry->owner == owner && entry->length == length &&
+           memcmp(entry->key, key, length) == 0;
+}
+
+static Set* set_of(unsigned long long hash)
+{
+    return &sets[(hash >> 32 ^ hash) & (DCACHE_SETS - 1)];
+}
+
+static void entry_free(void* arg)
+{
+    DCacheEntry* entry = arg;
+    entry->release(entry->value);
+    free(entry);
+}
+
+DCacheEntry* dcache_lookup(unsigned long long owner, const char* key, size_t length,
+                           unsigned long long hash)
+{
+    Set* set = set_of(hash);
+    for (int i = 0; i < DCACHE_WAYS; ++i) {
+        DCacheEntry* entry = atomic_load_explicit(&set->ways[i], memory_order_acquire);
+        if (entry && matches(entry, owner, key, length, hash)) {
+            // Only write when needed, hot entries are read by many threads.
+            if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed))
+                atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Pick the way to replace: the one holding `key`, a free one, or the first
+// one the CLOCK hand finds not referenced since its last sweep.
+static int choose_way(Set* set, unsigned long long owner, const char* key, size_t length,
+                      unsigned long long hash)
+{
+    for (int i = 0; i < DCACHE_WAYS; ++i) {
+        DCacheEntry* entry = atomic_load_explicit(&set->ways[i], memory_order_acquire);
+        if (!entry || matches(entry, owner, key, length, hash))
+            return i;
+    }
+    for (int sweep = 0; sweep < 2 * DCACHE_WAYS; ++sweep) {
+        int i = atomic_fetch_add_explicit(&set->hand, 1, memory_order_relaxed) % DCACHE_WAYS;
+        DCacheEntry* entry = atomic_load_explicit(&set->ways[i], memory_order_acquire);
+        if (!entry || !atomic_exchange_explicit(&entry->referenced, false, memory_order_relaxed))
+            return i;
+    }
+    return atomic_load_explicit(&set->hand, memory_order_relaxed) % DCACHE_WAYS;
+}
+
+void dcache_insert(unsigned long long owner, const char* key, size_t length,
+                   unsigned long long hash, void* value, void (*release)(void*),
+                   unsigned long long stamp)
+{
+    if (length > DCACHE_MAX_KEY) {
+        release(value);
+        return;
+    }
+    DCacheEntry* entry = malloc(sizeof(DCacheEntry) + length);
+    if (!entry)
+        fatal("Malloc failure.");
+    entry->owner = owner;
+    entry->value = value;
+    entry->release = release;
+    atomic_init(&entry->stamp, stamp);
+    atomic_init(&entry->referenced, false);
+    entry->hash = hash;
+    entry->length = length;
+    memcpy(entry->key, key, length);
+
+    Set* set = set_of(hash);
+    int way = choose_way(set, owner, key, length, hash);
+    DCacheEntry* old = atomic_exchange_explicit(&set->ways[way], entry, memory_order_acq_rel);
+    if (old)
+        ebr_retire(old, entry_free);
+}
+
+void dcache_record(bool hit)
+{
+    if (stripe < 0)
+        stripe = atomic_fetch_add(&next_stripe, 1) % STAT_STRIPES;
+    if (hit)
+        atomic_fetch_add_explicit(&stats[stripe].hits, 1, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&stats[stripe].misses, 1, memory_order_relaxed);
+}
+
+void dcache_stats(unsigned long* hits, unsigned long* misses)
+{
+    *hits = 0;
+    *misses = 0;
+    for (int i = 0; i < STAT_STRIPES; ++i) {
+        *hits += atomic_load_explicit(&stats[i].hits, memory_order_relaxed);
+        *misses += atomic_load_explicit(&stats[i].misses, memory_order_relaxed);
+    }
+}
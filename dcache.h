@@ -0,0 +1,58 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A concurrent, fixed-size cache from full paths to objects (folders), in the
+// spirit of the Linux dentry cache.
+//
+// The cache is set-associative: a key hashes to one set of DCACHE_WAYS
+// entries, and a full set evicts with the CLOCK algorithm. Entries are
+// immutable apart from their stamp and reference bit; replacing one swaps a
+// pointer and frees the old entry through ebr_retire, so lookups take no
+// locks but must run inside an EBR read section (see ebr.h).
+//
+// The cache does not know when an entry becomes stale. Every entry carries a
+// caller-defined stamp, and callers validate what they find (see Tree.c).
+//
+// Memory use is bounded by DCACHE_SETS * DCACHE_WAYS entries of at most
+// DCACHE_MAX_KEY bytes of key each; longer keys are never cached.
+
+#define DCACHE_SETS 1024 // Must be a power of two.
+#define DCACHE_WAYS 8
+#define DCACHE_MAX_KEY 512
+
+typedef struct DCacheEntry DCacheEntry;
+
+struct DCacheEntry {
+    unsigned long long owner; // Separates caches of different trees.
+    void* value;
+    void (*release)(void*); // Called on value when the entry is freed.
+    atomic_ullong stamp;
+    atomic_bool referenced; // For CLOCK eviction.
+    unsigned long long hash;
+    size_t length;
+    char key[]; // Not null-terminated.
+};
+
+// Return the entry for `key` in `owner`'s cache, or NULL. Owners are ids
+// that are never reused, unlike addresses: an entry of a freed owner must
+// never match a new one.
+// Must be called inside an EBR read section, and the entry may only be used
+// until the section ends.
+DCacheEntry* dcache_lookup(unsigned long long owner, const char* key, size_t length,
+                           unsigned long long hash);
+
+// Map `key` to `value`, replacing any entry for the same key. The cache calls
+// `release(value)` once the entry is evicted and no longer visible to
+// lookups. Does nothing if the key is longer than DCACHE_MAX_KEY.
+void dcache_insert(unsigned long long owner, const char* key, size_t length,
+                   unsigned long long hash, void* value, void (*release)(void*),
+                   unsigned long long stamp);
+
+// Count a lookup for dcache_stats. Callers decide what counts as a hit,
+// since an entry they find may turn out to be stale.
+void dcache_record(bool hit);
+
+// Sum of hits and misses recorded so far.
+void dcache_stats(unsigned long* hits, unsigned long* misses);
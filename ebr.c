@@ -0,0 +1,370 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ebr.h"
+#include "err.h"
+
+// A thread tries to advance the global epoch and free its old garbage after
+// this many retirements.
+#define EBR_COLLECT_INTERVAL 64
+
+#define CACHE_LINE 64
+
+typedef struct {
+    void* ptr;
+    void (*free_fn)(void*);
+} Retired;
+
+// Objects retired while the global epoch was `epoch`. They can be freed once
+// the global epoch is at least `epoch` + 2.
+typedef struct Limbo Limbo;
+
+struct Limbo {
+    Retired* items;
+    size_t count;
+    size_t capacity;
+    unsigned int epoch;
+    Limbo* next; // Used only on the list of orphaned limbos.
+};
+
+typedef struct EbrRecord EbrRecord;
+
+struct EbrRecord {
+    // Bit 0: the thread is in a read section; other bits: the global epoch it
+    // observed when it entered (modulo 2^31). Only written by the owner.
+    atomic_uint state;
+    atomic_bool in_use;
+    EbrRecord* next; // Registry of all records, never shrinks.
+    int nesting;
+    size_t since_collect;
+    Limbo limbo[3]; // Indexed by epoch % 3.
+};
+
+static atomic_uint global_epoch = 0;
+static _Atomic(EbrRecord*) records = NULL;
+
+// Garbage of threads that exited before it could be freed.
+static pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(Limbo*) orphans = NULL;
+
+// Batches of garbage handed to the reclaimer thread, see ebr_reclaimer_start.
+// Batches are Limbo structures whose epoch is already safe.
+static pthread_mutex_t reclaimer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaimer_wakeup = PTHREAD_COND_INITIALIZER;
+static atomic_bool reclaimer_running = false; // Written under reclaimer_lock.
+static Limbo* reclaimer_queue = NULL;
+static pthread_t reclaimer_thread;
+
+static _Thread_local EbrRecord* self = NULL;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+static void free_items(Retired* items, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        items[i].free_fn(items[i].ptr);
+}
+
+// Queue `count` items for the reclaimer thread, which takes ownership of the
+// `items` array. Returns false (and does nothing) if it is not running.
+static bool hand_over(Retired* items, size_t count)
+{
+    if (!atomic_load_explicit(&reclaimer_running, memory_order_relaxed))
+        return false;
+    Limbo* batch = malloc(sizeof(Limbo));
+    if (!batch)
+        fatal("Malloc failure.");
+    batch->items = items;
+    batch->count = count;
+    if (pthread_mutex_lock(&reclaimer_lock) != 0)
+        syserr("lock failed");
+    bool running = reclaimer_running;
+    if (running) {
+        batch->next = reclaimer_queue;
+        reclaimer_queue = batch;
+        if (pthread_cond_signal(&reclaimer_wakeup) != 0)
+            syserr("cond signal failed");
+    }
+    if (pthread_mutex_unlock(&reclaimer_lock) != 0)
+        syserr("mutex unlock failed");
+    if (!running)
+        free(batch);
+    return running;
+}
+
+// Free the contents of `limbo`, or hand them to the reclaimer thread. Free
+// functions may retire more objects, so the items are detached first; the
+// array is kept for reuse if nothing was retired into this limbo meanwhile.
+static void flush_limbo(Limbo* limbo)
+{
+    Retired* items = limbo->items;
+    size_t count = limbo->count;
+    size_t capacity = limbo->capacity;
+    limbo->items = NULL;
+    limbo->count = 0;
+    limbo->capacity = 0;
+    if (hand_over(items, count))
+        return;
+    free_items(items, count);
+    if (!limbo->items) {
+        limbo->items = items;
+        limbo->capacity = capacity;
+    } else {
+        free(items);
+    }
+}
+
+static void release_record(void* arg)
+{
+    EbrRecord* rec = arg;
+    for (int i = 0; i < 3; ++i) {
+        if (!rec->limbo[i].count)
+            continue;
+        Limbo* orphan = malloc(sizeof(Limbo));
+        if (!orphan)
+            fatal("Malloc failure.");
+        *orphan = rec->limbo[i];
+        memset(&rec->limbo[i], 0, sizeof(Limbo));
+        if (pthread_mutex_lock(&orphans_lock) != 0)
+            syserr("lock failed");
+        orphan->next = atomic_load_explicit(&orphans, memory_order_relaxed);
+        atomic_store_explicit(&orphans, orphan, memory_order_relaxed);
+        if (pthread_mutex_unlock(&orphans_lock) != 0)
+            syserr("mutex unlock failed");
+    }
+    atomic_store(&rec->state, 0);
+    atomic_store(&rec->in_use, false);
+    self = NULL;
+}
+
+static void make_key(void)
+{
+    if (pthread_key_create(&thread_key, release_record) != 0)
+        syserr("pthread_key_create failed");
+}
+
+static EbrRecord* get_record(void)
+{
+    if (self)
+        return self;
+    EbrRecord* rec;
+    for (rec = atomic_load(&records); rec; rec = rec->next) {
+        bool expected = false;
+        if (!atomic_load(&rec->in_use) &&
+            atomic_compare_exchange_strong(&rec->in_use, &expected, true))
+            break;
+    }
+    if (!rec) {
+        // Records are read by every thread, so each gets its own cache line.
+        size_t size = (sizeof(EbrRecord) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        rec = aligned_alloc(CACHE_LINE, size);
+        if (!rec)
+            fatal("Malloc failure.");
+        memset(rec, 0, sizeof(EbrRecord));
+        atomic_init(&rec->state, 0);
+        atomic_init(&rec->in_use, true);
+        rec->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &rec->next, rec))
+            ;
+    }
+    if (pthread_once(&key_once, make_key) != 0)
+        syserr("pthread_once failed");
+    if (pthread_setspecific(thread_key, rec) != 0)
+        syserr("pthread_setspecific failed");
+    self = rec;
+    return rec;
+}
+
+void ebr_enter(void)
+{
+    EbrRecord* rec = get_record();
+    if (rec->nesting++ > 0)
+        return;
+    unsigned int epoch = atomic_load(&global_epoch);
+    // Sequentially consistent, so the announcement is visible before any
+    // shared pointer is read.
+    atomic_store(&rec->state, epoch << 1 | 1);
+}
+
+void ebr_exit(void)
+{
+    EbrRecord* rec = self;
+    if (--rec->nesting > 0)
+        return;
+    atomic_store_explicit(&rec->state, 0, memory_order_release);
+}
+
+// Advance the global epoch if every thread in a read section has seen the
+// current one. Returns the (possibly new) global epoch.
+static unsigned int try_advance(void)
+{
+    unsigned int epoch = atomic_load(&global_epoch);
+    for (EbrRecord* rec = atomic_load(&records); rec; rec = rec->next) {
+        unsigned int state = atomic_load(&rec->state);
+        if ((state & 1) && (state >> 1) != (epoch & (UINT_MAX >> 1)))
+            return epoch;
+    }
+    if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1))
+        return epoch + 1;
+    return epoch; // Somebody else advanced it.
+}
+
+static void free_orphans(unsigned int epoch)
+{
+    if (!atomic_load_explicit(&orphans, memory_order_relaxed) ||
+        pthread_mutex_trylock(&orphans_lock) != 0)
+        return;
+    Limbo* ready = NULL;
+    Limbo* kept = NULL;
+    Limbo* limbo = atomic_load_explicit(&orphans, memory_order_relaxed);
+    while (limbo) {
+        Limbo* next = limbo->next;
+        if (epoch - limbo->epoch >= 2) {
+            limbo->next = ready;
+            ready = limbo;
+        } else {
+            limbo->next = kept;
+            kept = limbo;
+        }
+        limbo = next;
+    }
+    atomic_store_explicit(&orphans, kept, memory_order_relaxed);
+    if (pthread_mutex_unlock(&orphans_lock) != 0)
+        syserr("mutex unlock failed");
+    while (ready) {
+        Limbo* next = ready->next;
+        flush_limbo(ready);
+        free(ready->items);
+        free(ready);
+        ready = next;
+    }
+}
+
+static void collect(EbrRecord* rec)
+{
+    unsigned int epoch = try_advance();
+    for (int i = 0; i < 3; ++i) {
+        Limbo* limbo = &rec->limbo[i];
+        if (limbo->count && epoch - limbo->epoch >= 2)
+            flush_limbo(limbo);
+    }
+    free_orphans(epoch);
+}
+
+void ebr_retire(void* ptr, void (*free_fn)(void*))
+{
+    EbrRecord* rec = get_record();
+    unsigned int epoch = atomic_load(&global_epoch);
+    Limbo* limbo = &rec->limbo[epoch % 3];
+    // A non-empty bucket of an older epoch is at least three epochs old.
+    if (limbo->count && limbo->epoch != epoch)
+        flush_limbo(limbo);
+    if (limbo->count == limbo->capacity) {
+        size_t capacity = limbo->capacity ? 2 * limbo->capacity : EBR_COLLECT_INTERVAL;
+        Retired* items = realloc(limbo->items, capacity * sizeof(Retired));
+        if (!items)
+            fatal("Malloc failure.");
+        limbo->items = items;
+        limbo->capacity = capacity;
+    }
+    limbo->epoch = epoch;
+    limbo->items[limbo->count].ptr = ptr;
+    limbo->items[limbo->count].free_fn = free_fn;
+    limbo->count++;
+
+    if (++rec->since_collect >= EBR_COLLECT_INTERVAL) {
+        rec->since_collect = 0;
+        collect(rec);
+    }
+}
+
+void ebr_synchronize(void)
+{
+    EbrRecord* rec = get_record();
+    unsigned int target = atomic_load(&global_epoch) + 2;
+    while ((int)(try_advance() - target) < 0)
+        sched_yield();
+    for (int i = 0; i < 3; ++i) {
+        if (rec->limbo[i].count)
+            flush_limbo(&rec->limbo[i]);
+    }
+    free_orphans(target);
+}
+
+bool ebr_defer(void* ptr, void (*free_fn)(void*))
+{
+    Retired* item = malloc(sizeof(Retired));
+    if (!item)
+        fatal("Malloc failure.");
+    item->ptr = ptr;
+    item->free_fn = free_fn;
+    if (hand_over(item, 1))
+        return true;
+    free(item);
+    return false;
+}
+
+static void* reclaimer_main(void* arg)
+{
+    (void)arg;
+    if (pthread_mutex_lock(&reclaimer_lock) != 0)
+        syserr("lock failed");
+    for (;;) {
+        while (!reclaimer_queue && reclaimer_running) {
+            if (pthread_cond_wait(&reclaimer_wakeup, &reclaimer_lock) != 0)
+                syserr("cond wait failed");
+        }
+        Limbo* batch = reclaimer_queue;
+        reclaimer_queue = NULL;
+        if (!batch && !reclaimer_running)
+            break;
+        if (pthread_mutex_unlock(&reclaimer_lock) != 0)
+            syserr("mutex unlock failed");
+        // The queue is LIFO; its order does not matter.
+        while (batch) {
+            Limbo* next = batch->next;
+            free_items(batch->items, batch->count);
+            free(batch->items);
+            free(batch);
+            batch = next;
+        }
+        if (pthread_mutex_lock(&reclaimer_lock) != 0)
+            syserr("lock failed");
+    }
+    if (pthread_mutex_unlock(&reclaimer_lock) != 0)
+        syserr("mutex unlock failed");
+    return NULL;
+}
+
+void ebr_reclaimer_start(void)
+{
+    if (pthread_mutex_lock(&reclaimer_lock) != 0)
+        syserr("lock failed");
+    if (!reclaimer_running) {
+        reclaimer_running = true;
+        if (pthread_create(&reclaimer_thread, NULL, reclaimer_main, NULL) != 0)
+            syserr("pthread_create failed");
+    }
+    if (pthread_mutex_unlock(&reclaimer_lock) != 0)
+        syserr("mutex unlock failed");
+}
+
+void ebr_reclaimer_stop(void)
+{
+    if (pthread_mutex_lock(&reclaimer_lock) != 0)
+        syserr("lock failed");
+    bool running = reclaimer_running;
+    reclaimer_running = false;
+    if (pthread_cond_signal(&reclaimer_wakeup) != 0)
+        syserr("cond signal failed");
+    if (pthread_mutex_unlock(&reclaimer_lock) != 0)
+        syserr("mutex unlock failed");
+    if (running && pthread_join(reclaimer_thread, NULL) != 0)
+        syserr("pthread_join failed");
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <stdbool.h>
+
+// Epoch-based reclamation.
+// Threads that read shared structures without locks do so inside a read
+// section (ebr_enter ... ebr_exit). Memory unlinked from such structures is
+// handed to ebr_retire instead of being freed, and the free function is only
+// called once every thread that could still see it has left its section.
+//
+// Entering and leaving a section only writes the calling thread's own
+// record. Sections may be nested.
+
+// Start a read section.
+void ebr_enter(void);
+
+// End a read section started with ebr_enter.
+void ebr_exit(void);
+
+// Call `free_fn(ptr)` once no read section that started before this call is
+// still running. Can be called inside or outside a read section.
+void ebr_retire(void* ptr, void (*free_fn)(void*));
+
+// Wait until all read sections running at the time of the call have ended,
+// then free everything retired by this thread before the call (or hand it to
+// the reclaimer thread, see ebr_reclaimer_start).
+// Must not be called inside a read section.
+void ebr_synchronize(void);
+
+// Start a background thread that calls the free functions of retired
+// objects. While it runs, threads only hand it whole batches of garbage
+// that became safe to free, which keeps freeing off their critical paths.
+// Does nothing if the thread is already running.
+void ebr_reclaimer_start(void);
+
+// Stop the reclaimer thread once it has freed everything handed to it.
+// Garbage retired afterwards is freed by the retiring threads again.
+void ebr_reclaimer_stop(void);
+
+// If the reclaimer thread is running, hand it `free_fn(ptr)` to call as soon
+// as possible (without waiting for read sections) and return true.
+// Otherwise return false, and the caller should free `ptr` itself.
+bool ebr_defer(void* ptr, void (*free_fn)(void*));
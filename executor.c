@@ -0,0 +1,264 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "executor.h"
+
+// A submitted operation, with copies of its paths. After it completes
+// without a callback, it waits on the completion queue.
+typedef struct Pending {
+    struct Pending* next;
+    TreeCallback callback;
+    void* arg;
+    int result;
+    TreeOpType type;
+    char* target; // Points into `paths`, or NULL.
+    char paths[]; // The path, then the target.
+} Pending;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    Pending* head; // Queue of the worker, in submission order.
+    Pending* tail;
+    bool stopping;
+    pthread_t thread;
+    TreeExecutor* executor;
+} Worker;
+
+struct TreeExecutor {
+    Tree* tree;
+    int nthreads;
+    Worker* workers;
+    pthread_mutex_t completions_lock;
+    pthread_cond_t completed;
+    Pending* completions_head;
+    Pending* completions_tail;
+    size_t awaiting; // Submitted without a callback and not completed yet.
+};
+
+static void lock(pthread_mutex_t* mutex)
+{
+    if (pthread_mutex_lock(mutex) != 0)
+        syserr("lock failed");
+}
+
+static void unlock(pthread_mutex_t* mutex)
+{
+    if (pthread_mutex_unlock(mutex) != 0)
+        syserr("mutex unlock failed");
+}
+
+// The worker for operations on `path`: chosen by the path of its parent,
+// i.e. up to the '/' before the last name.
+static Worker* route(TreeExecutor* executor, const char* path)
+{
+    size_t end = strlen(path);
+    end = end >= 2 ? end - 2 : 0;
+    while (end > 0 && path[end] != '/')
+        end--;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i <= end && path[i]; ++i)
+        hash = (hash ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+    return &executor->workers[(hash ^ hash >> 32) % executor->nthreads];
+}
+
+// Add the completed operations `first`..`last` to the completion queue.
+static void complete(TreeExecutor* executor, Pending* first, Pending* last, size_t count)
+{
+    last->next = NULL;
+    lock(&executor->completions_lock);
+    if (executor->completions_tail)
+        executor->completions_tail->next = first;
+    else
+        executor->completions_head = first;
+    executor->completions_tail = last;
+    executor->awaiting -= count;
+    if (pthread_cond_broadcast(&executor->completed) != 0)
+        syserr("cond broadcast failed");
+    unlock(&executor->completions_lock);
+}
+
+static void* worker_main(void* arg)
+{
+    Worker* worker = arg;
+    TreeExecutor* executor = worker->executor;
+    TreeOp* ops = NULL;
+    int* results = NULL;
+    size_t capacity = 0;
+    for (;;) {
+        lock(&worker->lock);
+        while (!worker->head && !worker->stopping) {
+            if (pthread_cond_wait(&worker->wakeup, &worker->lock) != 0)
+                syserr("cond wait failed");
+        }
+        Pending* pending = worker->head;
+        worker->head = worker->tail = NULL;
+        unlock(&worker->lock);
+        if (!pending)
+            break;
+
+        // Everything queued so far goes into one batch.
+        size_t n = 0;
+        for (Pending* p = pending; p; p = p->next) {
+            if (n == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                ops = realloc(ops, capacity * sizeof(TreeOp));
+                results = realloc(results, capacity * sizeof(int));
+                if (!ops || !results)
+                    fatal("Malloc failure.");
+            }
+            ops[n++] = (TreeOp){ p->type, p->paths, p->target };
+        }
+        tree_apply_batch(executor->tree, ops, n, results);
+
+        Pending *first = NULL, *last = NULL;
+        size_t count = 0, i = 0;
+        while (pending) {
+            Pending* next = pending->next;
+            pending->result = results[i++];
+            if (pending->callback) {
+                pending->callback(pending->arg, pending->result);
+                free(pending);
+            } else {
+                if (last)
+                    last->next = pending;
+                else
+                    first = pending;
+                last = pending;
+                count++;
+            }
+            pending = next;
+        }
+        if (first)
+            complete(executor, first, last, count);
+    }
+    free(ops);
+    free(results);
+    return NULL;
+}
+
+TreeExecutor* tree_executor_new(Tree* tree, int nthreads)
+{
+    if (nthreads < 1)
+        nthreads = 1;
+    TreeExecutor* executor = malloc(sizeof(TreeExecutor));
+    Worker* workers = calloc(nthreads, sizeof(Worker));
+    if (!executor || !workers)
+        fatal("Malloc failure.");
+    executor->tree = tree;
+    executor->nthreads = nthreads;
+    executor->workers = workers;
+    if (pthread_mutex_init(&executor->completions_lock, NULL) != 0 ||
+        pthread_cond_init(&executor->completed, NULL) != 0)
+        syserr("mutex init failed");
+    executor->completions_head = executor->completions_tail = NULL;
+    executor->awaiting = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        Worker* worker = &workers[i];
+        if (pthread_mutex_init(&worker->lock, NULL) != 0 ||
+            pthread_cond_init(&worker->wakeup, NULL) != 0)
+            syserr("mutex init failed");
+        worker->executor = executor;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+            syserr("pthread_create failed");
+    }
+    return executor;
+}
+
+void tree_submit(TreeExecutor* executor, const TreeOp* op, TreeCallback callback,
+                 void* arg)
+{
+    size_t path_size = strlen(op->path) + 1;
+    size_t target_size = op->target ? strlen(op->target) + 1 : 0;
+    Pending* pending = malloc(sizeof(Pending) + path_size + target_size);
+    if (!pending)
+        fatal("Malloc failure.");
+    pending->next = NULL;
+    pending->callback = callback;
+    pending->arg = arg;
+    pending->type = op->type;
+    memcpy(pending->paths, op->path, path_size);
+    pending->target = NULL;
+    if (op->target) {
+        pending->target = pending->paths + path_size;
+        memcpy(pending->target, op->target, target_size);
+    }
+
+    if (!callback) {
+        lock(&executor->completions_lock);
+        executor->awaiting++;
+        unlock(&executor->completions_lock);
+    }
+    Worker* worker = route(executor, op->path);
+    lock(&worker->lock);
+    bool idle = !worker->head;
+    if (worker->tail)
+        worker->tail->next = pending;
+    else
+        worker->head = pending;
+    worker->tail = pending;
+    // A worker with a nonempty queue is already awake.
+    if (idle && pthread_cond_signal(&worker->wakeup) != 0)
+        syserr("cond signal failed");
+    unlock(&worker->lock);
+}
+
+size_t tree_executor_poll(TreeExecutor* executor, TreeCompletion* out, size_t max,
+                          bool wait)
+{
+    lock(&executor->completions_lock);
+    while (wait && max && !executor->completions_head && executor->awaiting) {
+        if (pthread_cond_wait(&executor->completed, &executor->completions_lock) != 0)
+            syserr("cond wait failed");
+    }
+    size_t n = 0;
+    Pending* taken = executor->completions_head;
+    Pending* done = taken;
+    while (n < max && done) {
+        out[n++] = (TreeCompletion){ done->arg, done->result };
+        done = done->next;
+    }
+    executor->completions_head = done;
+    if (!done)
+        executor->completions_tail = NULL;
+    unlock(&executor->completions_lock);
+    // Free the taken completions outside the lock.
+    for (size_t i = 0; i < n; ++i) {
+        Pending* next = taken->next;
+        free(taken);
+        taken = next;
+    }
+    return n;
+}
+
+void tree_executor_free(TreeExecutor* executor)
+{
+    for (int i = 0; i < executor->nthreads; ++i) {
+        Worker* worker = &executor->workers[i];
+        lock(&worker->lock);
+        worker->stopping = true;
+        if (pthread_cond_signal(&worker->wakeup) != 0)
+            syserr("cond signal failed");
+        unlock(&worker->lock);
+    }
+    // A worker leaves only once its queue is empty.
+    for (int i = 0; i < executor->nthreads; ++i) {
+        Worker* worker = &executor->workers[i];
+        if (pthread_join(worker->thread, NULL) != 0)
+            syserr("pthread_join failed");
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->wakeup);
+    }
+    while (executor->completions_head) {
+        Pending* next = executor->completions_head->next;
+        free(executor->completions_head);
+        executor->completions_head = next;
+    }
+    pthread_mutex_destroy(&executor->completions_lock);
+    pthread_cond_destroy(&executor->completed);
+    free(executor->workers);
+    free(executor);
+}
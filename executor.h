@@ -0,0 +1,59 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "Tree.h"
+
+// Asynchronous execution of tree_create, tree_remove and tree_move.
+//
+// tree_submit queues an operation and returns at once; a pool of worker
+// threads executes it. Every operation goes to the worker chosen by the
+// path of its parent folder (of the source, for moves), so all operations
+// in one folder are executed by one worker, in submission order. A worker
+// takes everything queued for it and executes it with tree_apply_batch,
+// which enters each parent folder as a writer once for all of its
+// operations. Callers therefore never sleep on a contended folder: at most
+// one worker waits there, with the whole backlog of that folder.
+//
+// Operations in different folders are not ordered with respect to each
+// other, as if they were called from different threads; a caller that
+// needs, say, a create of /a/b/ to see an earlier create of /a/ waits for
+// the first one's completion before submitting the second.
+//
+// The result (as returned by the synchronous call) is delivered either to a
+// callback, called on the worker thread, or to the completion queue, from
+// which tree_executor_poll takes it. The number of operations in flight is
+// not limited.
+
+typedef struct TreeExecutor TreeExecutor;
+
+// Called on a worker thread with the `arg` given to tree_submit and the
+// operation's result. It must not block for long and must not call
+// tree_executor_free.
+typedef void (*TreeCallback)(void* arg, int result);
+
+typedef struct {
+    void* arg; // As given to tree_submit.
+    int result;
+} TreeCompletion;
+
+// Start `nthreads` workers executing operations on `tree`. The tree must
+// stay alive until tree_executor_free.
+TreeExecutor* tree_executor_new(Tree* tree, int nthreads);
+
+// Queue `op` (its paths are copied). When it completes, `callback(arg,
+// result)` is called, or, if `callback` is NULL, {arg, result} is added to
+// the completion queue.
+void tree_submit(TreeExecutor* executor, const TreeOp* op, TreeCallback callback,
+                 void* arg);
+
+// Move up to `max` completions from the completion queue to `out`, oldest
+// first, and return their number. If `wait` and the queue is empty, first
+// wait until an operation completes there; return 0 at once if none is in
+// flight.
+size_t tree_executor_poll(TreeExecutor* executor, TreeCompletion* out, size_t max,
+                          bool wait);
+
+// Wait for all submitted operations to complete, stop the workers and free
+// the executor. Completions not yet polled are dropped.
+void tree_executor_free(TreeExecutor* executor);
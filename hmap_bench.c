@@ -0,0 +1,68 @@
+// Microbenchmark of HashMap lookups: average cost of a successful hmap_get
+// for maps holding 10 up to 10^6 keys. With a growing table the cost should
+// stay roughly flat instead of following the number of keys.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "HashMap.h"
+#include "err.h"
+
+#define MAX_KEYS 1000000
+#define LOOKUPS 2000000
+#define KEY_LENGTH 8
+
+static char keys[MAX_KEYS][KEY_LENGTH + 1];
+
+// Write the `i`-th key, a base-26 number spelled with 'a'-'z'.
+static void make_key(char* key, size_t i)
+{
+    for (int j = KEY_LENGTH - 1; j >= 0; --j) {
+        key[j] = 'a' + i % 26;
+        i /= 26;
+    }
+    key[KEY_LENGTH] = '\0';
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        syserr("clock_gettime failed");
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void)
+{
+    for (size_t i = 0; i < MAX_KEYS; ++i)
+        make_key(keys[i], i * 7919); // Spread keys over the key space.
+
+    printf("%10s %14s %14s\n", "children", "insert ns/op", "lookup ns/op");
+    for (size_t n = 10; n <= MAX_KEYS; n *= 10) {
+        HashMap* map = hmap_new();
+        if (!map)
+            fatal("hmap_new failed");
+
+        double start = now_ns();
+        for (size_t i = 0; i < n; ++i)
+            hmap_insert(map, keys[i], keys[i]);
+        double insert_ns = (now_ns() - start) / n;
+
+        unsigned int seed = 1;
+        size_t found = 0;
+        start = now_ns();
+        for (size_t i = 0; i < LOOKUPS; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            if (hmap_get(map, keys[seed % n]))
+                found++;
+        }
+        double lookup_ns = (now_ns() - start) / LOOKUPS;
+        if (found != LOOKUPS)
+            fatal("lookup missed a key");
+
+        printf("%10zu %14.1f %14.1f\n", n, insert_ns, lookup_ns);
+        hmap_free(map);
+    }
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "path_utils.h"
+
+#define IMAGE_MAGIC "TREEIMG"
+#define IMAGE_VERSION 3
+
+typedef struct {
+    char magic[8]; // IMAGE_MAGIC, null-terminated.
+    uint32_t version;
+    uint32_t n_nodes;
+    uint64_t names_size;
+    uint64_t journal_lsn;
+} ImageHeader;
+
+static int compare_names(const Image* image, const ImageNode* a, const ImageNode* b)
+{
+    size_t common = a->name_length < b->name_length ? a->name_length : b->name_length;
+    int cmp = memcmp(image->names + a->name_offset, image->names + b->name_offset, common);
+    if (cmp != 0)
+        return cmp;
+    return a->name_length < b->name_length ? -1 : a->name_length > b->name_length;
+}
+
+static bool is_name_valid(const Image* image, const ImageNode* node, uint64_t names_size)
+{
+    if (node->name_length < 1 || node->name_length > MAX_FOLDER_NAME_LENGTH ||
+        (uint64_t)node->name_offset + node->name_length > names_size)
+        return false;
+    const char* name = image->names + node->name_offset;
+    for (uint32_t k = 0; k < node->name_length; ++k) {
+        if (name[k] < 'a' || name[k] > 'z')
+            return false;
+    }
+    return true;
+}
+
+// Check everything promised in image.h, in one pass over the table. Every
+// node except the root is checked when its parent claims its range.
+static bool is_image_valid(const Image* image, uint64_t names_size)
+{
+    const ImageNode* nodes = image->nodes;
+    if (nodes[0].name_length != 0)
+        return false;
+    uint64_t claimed = 1; // Nodes [1, claimed) are children of earlier nodes.
+    for (uint32_t i = 0; i < image->n_nodes; ++i) {
+        if (i >= claimed) // Nobody before i has it as a child.
+            return false;
+        const ImageNode* node = &nodes[i];
+        if (!node->child_count)
+            continue;
+        if (node->first_child != claimed || node->child_count > image->n_nodes - claimed)
+            return false;
+        claimed += node->child_count;
+        for (uint32_t j = node->first_child; j < claimed; ++j) {
+            if (!is_name_valid(image, &nodes[j], names_size) ||
+                (j > node->first_child && compare_names(image, &nodes[j - 1], &nodes[j]) >= 0))
+                return false;
+        }
+    }
+    if (claimed != image->n_nodes)
+        return false;
+    // Children come after their parent, so a pass from the end sees every
+    // subtree before its root.
+    for (uint32_t i = image->n_nodes; i-- > 0;) {
+        const ImageNode* node = &nodes[i];
+        uint64_t descendants = 0;
+        uint32_t height = 0;
+        for (uint32_t j = node->first_child; j < node->first_child + node->child_count; ++j) {
+            descendants += nodes[j].descendants + 1;
+            if (nodes[j].height + 1 > height)
+                height = nodes[j].height + 1;
+        }
+        if (node->descendants != descendants || node->height != height)
+            return false;
+    }
+    return true;
+}
+
+// Fill in the subtree sizes and heights of a table in breadth-first order.
+static void compute_aggregates(ImageNode* nodes, uint32_t n_nodes)
+{
+    for (uint32_t i = n_nodes; i-- > 0;) {
+        ImageNode* node = &nodes[i];
+        node->descendants = 0;
+        node->height = 0;
+        for (uint32_t j = node->first_child; j < node->first_child + node->child_count; ++j) {
+            node->descendants += nodes[j].descendants + 1;
+            if (nodes[j].height + 1 > node->height)
+                node->height = nodes[j].height + 1;
+        }
+    }
+}
+
+Image* image_open(const char* file)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(ImageHeader) + sizeof(ImageNode)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    void* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int error = errno;
+    close(fd);
+    if (base == MAP_FAILED) {
+        errno = error;
+        return NULL;
+    }
+
+    const ImageHeader* header = base;
+    Image* image = malloc(sizeof(Image));
+    if (!image) {
+        munmap(base, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    image->base = base;
+    image->size = size;
+    image->n_nodes = header->n_nodes;
+    image->journal_lsn = header->journal_lsn;
+    image->nodes = (const ImageNode*)((const char*)base + sizeof(ImageHeader));
+    uint64_t table_size = (uint64_t)header->n_nodes * sizeof(ImageNode);
+    image->names = (const char*)image->nodes + table_size;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+        header->version != IMAGE_VERSION || header->n_nodes == 0 ||
+        table_size > size - sizeof(ImageHeader) ||
+        header->names_size != size - sizeof(ImageHeader) - table_size ||
+        !is_image_valid(image, header->names_size)) {
+        image_close(image);
+        errno = EINVAL;
+        return NULL;
+    }
+    return image;
+}
+
+void image_close(Image* image)
+{
+    munmap(image->base, image->size);
+    free(image);
+}
+
+int image_write(const char* file, ImageNode* nodes, uint32_t n_nodes,
+                const char* names, size_t names_size, uint64_t journal_lsn)
+{
+    compute_aggregates(nodes, n_nodes);
+    // Write to a temporary file and rename it, so that the old image stays
+    // intact until the new one is complete.
+    size_t length = strlen(file);
+    char* temporary = malloc(length + sizeof(".tmp"));
+    if (!temporary)
+        return ENOMEM;
+    memcpy(temporary, file, length);
+    memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+    FILE* out = fopen(temporary, "wb");
+    if (!out) {
+        int error = errno;
+        free(temporary);
+        return error;
+    }
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.n_nodes = n_nodes;
+    header.names_size = names_size;
+    header.journal_lsn = journal_lsn;
+    int error = 0;
+    errno = 0;
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(nodes, sizeof(ImageNode), n_nodes, out) != n_nodes ||
+        (names_size && fwrite(names, 1, names_size, out) != names_size))
+        error = errno ? errno : EIO;
+    // The image must be on disk before it replaces the old one, or a crash
+    // could leave neither.
+    if (!error && (fflush(out) != 0 || fsync(fileno(out)) != 0))
+        error = errno;
+    if (fclose(out) != 0 && !error)
+        error = errno;
+    if (!error && rename(temporary, file) != 0)
+        error = errno;
+    if (error)
+        unlink(temporary);
+    free(temporary);
+    return error;
+}
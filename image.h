@@ -0,0 +1,53 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// A compact, read-only image of a folder tree, written by tree_save and
+// mapped into memory by tree_load.
+//
+// The file holds a header, a table of nodes and a blob of names. Nodes are
+// in breadth-first order with the root first, so the children of every node
+// form a contiguous range of the table, sorted by name. Names are not
+// null-terminated. All numbers are in the byte order of the machine that
+// wrote the image.
+//
+// Every node also records the size and height of its subtree, so that a
+// tree loaded lazily knows them without visiting the subtree.
+//
+// image_open checks the whole structure once, so readers can then follow
+// child ranges and names without any checks: every range lies inside the
+// table and starts after its parent (the image is a tree), every name lies
+// inside the blob and is a valid folder name, names in a range are
+// strictly increasing, and subtree sizes and heights agree with the ranges.
+
+typedef struct {
+    uint32_t first_child; // Index of the first child in the table.
+    uint32_t child_count;
+    uint32_t name_offset; // In the name blob.
+    uint32_t name_length; // 0 only for the root.
+    uint32_t descendants; // Number of nodes in the subtree, without the node.
+    uint32_t height; // Longest path down from the node (0 for a leaf).
+} ImageNode;
+
+typedef struct {
+    void* base; // The mapping of the whole file.
+    size_t size;
+    const ImageNode* nodes; // nodes[0] is the root.
+    uint32_t n_nodes;
+    const char* names;
+    uint64_t journal_lsn; // Position in the journal (journal.h) the image includes.
+} Image;
+
+// Map the image in `file`. Returns NULL and sets errno if the file cannot be
+// read (EINVAL if it is not a well-formed image).
+Image* image_open(const char* file);
+
+// Unmap an image returned by image_open.
+void image_close(Image* image);
+
+// Write an image with the given node table and name blob to `file`, noting
+// that it includes the journal up to `journal_lsn` (0 if none). The
+// descendants and height fields of the nodes are filled in here. Returns 0
+// or an errno value.
+int image_write(const char* file, ImageNode* nodes, uint32_t n_nodes,
+                const char* names, size_t names_size, uint64_t journal_lsn);
@@ -0,0 +1,379 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "journal.h"
+
+// A record in the file: this header, the path and then (if has_target) the
+// target, both null-terminated. Numbers are in the byte order of the
+// machine that wrote the journal.
+typedef struct {
+    uint32_t size; // Of the whole record, including this header.
+    uint32_t checksum; // Of everything after this field.
+    uint64_t lsn;
+    uint16_t path_length;
+    uint16_t target_length;
+    uint8_t type;
+    uint8_t has_target;
+    uint8_t padding[2];
+} RecordHeader;
+
+#define CHECKSUM_START offsetof(RecordHeader, lsn)
+
+struct Journal {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup; // Signalled to the flusher.
+    pthread_cond_t flushed; // Broadcast when durable_lsn grows.
+
+    // Records appended since the flusher took the last batch. While it
+    // writes that batch, its buffer is not here, and the flusher gives it
+    // back afterwards as the spare one, so neither is ever reallocated
+    // under the writer's feet.
+    char* pending;
+    size_t pending_size, pending_capacity;
+    char* spare;
+    size_t spare_capacity;
+    struct timespec first_pending; // When the first pending record came.
+
+    uint64_t last_lsn; // Of the last appended record.
+    uint64_t durable_lsn; // All records up to this one are on disk.
+
+    unsigned max_delay_us;
+    size_t max_batch_bytes;
+    bool closing;
+    pthread_t flusher;
+};
+
+// FNV-1a.
+static uint32_t checksum(const char* data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Walk the complete records at the start of `data`, calling `apply` (if not
+// NULL) for those with LSNs greater than `after`. Sets *last to the LSN of
+// the last complete record (it must come in with 0) and returns the number
+// of bytes they take; the first torn or damaged record ends the walk.
+static size_t scan(const char* data, size_t size, uint64_t after,
+                   void (*apply)(void*, int, const char*, const char*), void* arg,
+                   uint64_t* last)
+{
+    size_t offset = 0;
+    while (size - offset >= sizeof(RecordHeader)) {
+        RecordHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        if (header.size < sizeof(header) || header.size > size - offset ||
+            checksum(data + offset + CHECKSUM_START, header.size - CHECKSUM_START) !=
+                header.checksum)
+            break;
+        size_t strings = (size_t)header.path_length + 1;
+        if (header.has_target)
+            strings += (size_t)header.target_length + 1;
+        const char* path = data + offset + sizeof(header);
+        const char* target = header.has_target ? path + header.path_length + 1 : NULL;
+        if (header.size - sizeof(header) != strings || path[header.path_length] != '\0' ||
+            (target && target[header.target_length] != '\0') || header.lsn <= *last)
+            break;
+        if (apply && header.lsn > after)
+            apply(arg, header.type, path, target);
+        *last = header.lsn;
+        offset += header.size;
+    }
+    return offset;
+}
+
+// Read the whole file open as `fd`. Returns 0 or an errno value.
+static int read_all(int fd, char** data, size_t* size)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return errno;
+    *size = st.st_size;
+    *data = malloc(*size ? *size : 1);
+    if (!*data)
+        return ENOMEM;
+    size_t done = 0;
+    while (done < *size) {
+        ssize_t n = pread(fd, *data + done, *size - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            int error = n < 0 ? errno : EIO;
+            free(*data);
+            return error;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Make the directory entry of a new file durable.
+static int sync_directory(const char* file)
+{
+    const char* slash = strrchr(file, '/');
+    char* directory = slash ? strndup(file, slash == file ? 1 : slash - file)
+                            : strdup(".");
+    if (!directory)
+        return ENOMEM;
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    free(directory);
+    if (fd < 0)
+        return errno;
+    int error = fsync(fd) != 0 ? errno : 0;
+    close(fd);
+    return error;
+}
+
+static void write_all(int fd, const char* data, size_t size)
+{
+    while (size) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            syserr("journal write failed");
+        data += n;
+        size -= n;
+    }
+}
+
+static bool batch_full(const Journal* journal)
+{
+    return journal->max_batch_bytes && journal->pending_size >= journal->max_batch_bytes;
+}
+
+// Writes pending records in batches (see journal.h). A batch waits for
+// more records until its window closes, unless it is already full.
+static void* flusher_main(void* arg)
+{
+    Journal* journal = arg;
+    if (pthread_mutex_lock(&journal->lock) != 0)
+        syserr("lock failed");
+    for (;;) {
+        while (!journal->pending_size && !journal->closing) {
+            if (pthread_cond_wait(&journal->wakeup, &journal->lock) != 0)
+                syserr("cond wait failed");
+        }
+        if (!journal->pending_size)
+            break;
+        struct timespec deadline = journal->first_pending;
+        deadline.tv_sec += journal->max_delay_us / 1000000;
+        deadline.tv_nsec += (long)(journal->max_delay_us % 1000000) * 1000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (journal->max_delay_us && !journal->closing && !batch_full(journal)) {
+            int error = pthread_cond_timedwait(&journal->wakeup, &journal->lock, &deadline);
+            if (error == ETIMEDOUT)
+                break;
+            if (error != 0)
+                syserr("cond wait failed");
+        }
+
+        char* batch = journal->pending;
+        size_t size = journal->pending_size, capacity = journal->pending_capacity;
+        uint64_t lsn = journal->last_lsn;
+        journal->pending = journal->spare;
+        journal->pending_capacity = journal->spare_capacity;
+        journal->pending_size = 0;
+        journal->spare = NULL;
+        if (pthread_mutex_unlock(&journal->lock) != 0)
+            syserr("mutex unlock failed");
+
+        write_all(journal->fd, batch, size);
+        if (fdatasync(journal->fd) != 0)
+            syserr("journal sync failed");
+
+        if (pthread_mutex_lock(&journal->lock) != 0)
+            syserr("lock failed");
+        journal->spare = batch;
+        journal->spare_capacity = capacity;
+        journal->durable_lsn = lsn;
+        if (pthread_cond_broadcast(&journal->flushed) != 0)
+            syserr("cond broadcast failed");
+    }
+    if (pthread_mutex_unlock(&journal->lock) != 0)
+        syserr("mutex unlock failed");
+    return NULL;
+}
+
+Journal* journal_open(const char* file, uint64_t after, unsigned max_delay_us,
+                      size_t max_batch_bytes)
+{
+    int fd = open(file, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return NULL;
+    char* data;
+    size_t size;
+    int error = read_all(fd, &data, &size);
+    if (error) {
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+    uint64_t last = 0;
+    size_t valid = scan(data, size, 0, NULL, NULL, &last);
+    free(data);
+    // Cut off a record torn by a crash, so that new records follow the
+    // complete ones.
+    if (valid < size && (ftruncate(fd, valid) != 0 || fsync(fd) != 0))
+        error = errno;
+    if (!error)
+        error = sync_directory(file);
+    if (error) {
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+
+    Journal* journal = malloc(sizeof(Journal));
+    if (!journal)
+        fatal("Malloc failure.");
+    journal->fd = fd;
+    pthread_condattr_t attr;
+    if (pthread_mutex_init(&journal->lock, NULL) != 0 ||
+        pthread_condattr_init(&attr) != 0 ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+        pthread_cond_init(&journal->wakeup, &attr) != 0 ||
+        pthread_cond_init(&journal->flushed, NULL) != 0 ||
+        pthread_condattr_destroy(&attr) != 0)
+        syserr("journal init failed");
+    journal->pending = NULL;
+    journal->pending_size = journal->pending_capacity = 0;
+    journal->spare = NULL;
+    journal->spare_capacity = 0;
+    journal->last_lsn = journal->durable_lsn = last > after ? last : after;
+    journal->max_delay_us = max_delay_us;
+    journal->max_batch_bytes = max_batch_bytes;
+    journal->closing = false;
+    if (pthread_create(&journal->flusher, NULL, flusher_main, journal) != 0)
+        syserr("pthread_create failed");
+    return journal;
+}
+
+void journal_close(Journal* journal)
+{
+    journal_lock(journal);
+    journal->closing = true;
+    if (pthread_cond_signal(&journal->wakeup) != 0)
+        syserr("cond signal failed");
+    journal_unlock(journal);
+    if (pthread_join(journal->flusher, NULL) != 0)
+        syserr("pthread_join failed");
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->wakeup);
+    pthread_cond_destroy(&journal->flushed);
+    free(journal->pending);
+    free(journal->spare);
+    free(journal);
+}
+
+void journal_lock(Journal* journal)
+{
+    if (pthread_mutex_lock(&journal->lock) != 0)
+        syserr("lock failed");
+}
+
+void journal_unlock(Journal* journal)
+{
+    if (pthread_mutex_unlock(&journal->lock) != 0)
+        syserr("mutex unlock failed");
+}
+
+uint64_t journal_append(Journal* journal, int type, const char* path, const char* target)
+{
+    RecordHeader header;
+    memset(&header, 0, sizeof(header));
+    size_t path_length = strlen(path);
+    size_t target_length = target ? strlen(target) : 0;
+    if (path_length > UINT16_MAX || target_length > UINT16_MAX)
+        fatal("journal record too long");
+    header.size = sizeof(header) + path_length + 1 + (target ? target_length + 1 : 0);
+    header.lsn = ++journal->last_lsn;
+    header.path_length = path_length;
+    header.target_length = target_length;
+    header.type = type;
+    header.has_target = target != NULL;
+
+    size_t needed = journal->pending_size + header.size;
+    if (needed > journal->pending_capacity) {
+        size_t capacity = journal->pending_capacity ? journal->pending_capacity : 4096;
+        while (capacity < needed)
+            capacity *= 2;
+        char* pending = realloc(journal->pending, capacity);
+        if (!pending)
+            fatal("Malloc failure.");
+        journal->pending = pending;
+        journal->pending_capacity = capacity;
+    }
+    char* record = journal->pending + journal->pending_size;
+    memcpy(record + sizeof(header), path, path_length + 1);
+    if (target)
+        memcpy(record + sizeof(header) + path_length + 1, target, target_length + 1);
+    memcpy(record, &header, sizeof(header));
+    header.checksum = checksum(record + CHECKSUM_START, header.size - CHECKSUM_START);
+    memcpy(record + offsetof(RecordHeader, checksum), &header.checksum,
+           sizeof(header.checksum));
+
+    // The flusher sleeps until a batch starts, and then until it is full or
+    // its window closes.
+    bool starts_batch = journal->pending_size == 0;
+    journal->pending_size = needed;
+    if (starts_batch)
+        clock_gettime(CLOCK_MONOTONIC, &journal->first_pending);
+    if (starts_batch || (batch_full(journal) && needed - header.size < journal->max_batch_bytes)) {
+        if (pthread_cond_signal(&journal->wakeup) != 0)
+            syserr("cond signal failed");
+    }
+    return header.lsn;
+}
+
+uint64_t journal_position(Journal* journal)
+{
+    return journal->last_lsn;
+}
+
+void journal_wait(Journal* journal, uint64_t lsn)
+{
+    journal_lock(journal);
+    while (journal->durable_lsn < lsn) {
+        if (pthread_cond_wait(&journal->flushed, &journal->lock) != 0)
+            syserr("cond wait failed");
+    }
+    journal_unlock(journal);
+}
+
+int journal_replay(const char* file, uint64_t after,
+                   void (*apply)(void* arg, int type, const char* path, const char* target),
+                   void* arg)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return errno;
+    char* data;
+    size_t size;
+    int error = read_all(fd, &data, &size);
+    close(fd);
+    if (error)
+        return error;
+    uint64_t last = 0;
+    scan(data, size, after, apply, arg, &last);
+    free(data);
+    return 0;
+}
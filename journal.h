@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// An append-only journal (write-ahead log) with group commit.
+//
+// A record is a small type number with one or two strings (for example an
+// operation and its paths). Records get consecutive sequence numbers (LSNs),
+// starting after the last record already in the file, so a position in the
+// journal can be stored elsewhere (for example in an image of the data it
+// describes) and the records after it replayed later.
+//
+// Appending only copies the record into memory, so it can be done inside
+// critical sections of the caller. A background thread writes pending
+// records and syncs them to disk in batches: a batch is written once
+// `max_delay_us` microseconds have passed since its first record, or
+// earlier if it has reached `max_batch_bytes` (when nonzero). Threads that
+// need their records to be durable wait for that with journal_wait, after
+// leaving their critical sections, and all of them share one sync.
+//
+// Every record carries a checksum. A record torn by a crash ends the
+// journal: reading stops there, and journal_open cuts it off.
+
+typedef struct Journal Journal;
+
+// Open (or create) the journal in `file` for appending. New records get
+// LSNs greater than both the last one in the file and `after`. Returns NULL
+// and sets errno on failure.
+Journal* journal_open(const char* file, uint64_t after, unsigned max_delay_us,
+                      size_t max_batch_bytes);
+
+// Write all pending records, stop the background thread and free the
+// journal.
+void journal_close(Journal* journal);
+
+// The journal lock orders appends. Callers that need records in the same
+// order as their own changes make both while holding it.
+void journal_lock(Journal* journal);
+void journal_unlock(Journal* journal);
+
+// Append a record and return its LSN. `target` may be NULL.
+// Must be called with the journal lock held.
+uint64_t journal_append(Journal* journal, int type, const char* path, const char* target);
+
+// Return the LSN of the last appended record (0 if none).
+// Must be called with the journal lock held.
+uint64_t journal_position(Journal* journal);
+
+// Wait until the record with the given LSN (and all before it) is on disk.
+void journal_wait(Journal* journal, uint64_t lsn);
+
+// Call `apply(arg, type, path, target)` for every complete record in `file`
+// with an LSN greater than `after`, in order (`target` is NULL if the record
+// has none). Returns 0 or an errno value.
+int journal_replay(const char* file, uint64_t after,
+                   void (*apply)(void* arg, int type, const char* path, const char* target),
+                   void* arg);
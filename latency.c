@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "err.h"
+#include "latency.h"
+
+// A histogram as recorded: only its shard's owner writes it, but collectors
+// read it at the same time, hence relaxed atomics.
+typedef struct {
+    atomic_ullong count;
+    atomic_ullong sum_ns;
+    atomic_ullong buckets[LATENCY_BUCKETS];
+} SharedHistogram;
+
+// Histograms are allocated on first use, as most slots of most threads
+// stay empty.
+typedef struct Shard {
+    _Atomic(SharedHistogram*) slots[LATENCY_SLOTS];
+    atomic_bool in_use; // Owned by a running thread.
+    struct Shard* next;
+} Shard;
+
+static _Atomic(Shard*) shards = NULL;
+static _Thread_local Shard* self = NULL;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+static void release_shard(void* arg)
+{
+    Shard* shard = arg;
+    atomic_store(&shard->in_use, false);
+    self = NULL;
+}
+
+static void make_key(void)
+{
+    if (pthread_key_create(&thread_key, release_shard) != 0)
+        syserr("pthread_key_create failed");
+}
+
+static Shard* get_shard(void)
+{
+    if (self)
+        return self;
+    Shard* shard;
+    for (shard = atomic_load(&shards); shard; shard = shard->next) {
+        bool expected = false;
+        if (!atomic_load(&shard->in_use) &&
+            atomic_compare_exchange_strong(&shard->in_use, &expected, true))
+            break;
+    }
+    if (!shard) {
+        shard = calloc(1, sizeof(Shard));
+        if (!shard)
+            fatal("Malloc failure.");
+        atomic_init(&shard->in_use, true);
+        shard->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &shard->next, shard))
+            ;
+    }
+    pthread_once(&key_once, make_key);
+    if (pthread_setspecific(thread_key, shard) != 0)
+        syserr("pthread_setspecific failed");
+    self = shard;
+    return shard;
+}
+
+static int bucket_of(uint64_t value)
+{
+    if (value < LATENCY_SUB_BUCKETS)
+        return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > LATENCY_MAX_EXPONENT)
+        return LATENCY_BUCKETS - 1;
+    int sub = (int)(value >> (exponent - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return (exponent - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+// The middle of the range of values in `bucket`.
+static uint64_t bucket_value(int bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+    int exponent = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+    uint64_t width = 1ULL << (exponent - LATENCY_SUB_BITS);
+    return (1ULL << exponent) + sub * width + width / 2;
+}
+
+// Only the owner writes, so there is no need for a read-modify-write.
+static void add(atomic_ullong* counter, uint64_t value)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+uint64_t latency_now(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        syserr("clock_gettime failed");
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void latency_record(unsigned slot, uint64_t ns)
+{
+    Shard* shard = get_shard();
+    SharedHistogram* histogram =
+        atomic_load_explicit(&shard->slots[slot], memory_order_relaxed);
+    if (!histogram) {
+        histogram = calloc(1, sizeof(SharedHistogram));
+        if (!histogram)
+            fatal("Malloc failure.");
+        atomic_store_explicit(&shard->slots[slot], histogram, memory_order_release);
+    }
+    add(&histogram->count, 1);
+    add(&histogram->sum_ns, ns);
+    add(&histogram->buckets[bucket_of(ns)], 1);
+}
+
+void latency_add(LatencyHistogram* histogram, uint64_t ns)
+{
+    histogram->count++;
+    histogram->sum_ns += ns;
+    histogram->buckets[bucket_of(ns)]++;
+}
+
+void latency_collect(LatencyHistogram* out, unsigned n)
+{
+    memset(out, 0, n * sizeof(LatencyHistogram));
+    for (Shard* shard = atomic_load(&shards); shard; shard = shard->next) {
+        for (unsigned slot = 0; slot < n; ++slot) {
+            SharedHistogram* histogram =
+                atomic_load_explicit(&shard->slots[slot], memory_order_acquire);
+            if (!histogram)
+                continue;
+            out[slot].count += atomic_load_explicit(&histogram->count, memory_order_relaxed);
+            out[slot].sum_ns += atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed);
+            for (int i = 0; i < LATENCY_BUCKETS; ++i)
+                out[slot].buckets[i] +=
+                    atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        }
+    }
+}
+
+void latency_subtract(LatencyHistogram* histogram, const LatencyHistogram* earlier)
+{
+    histogram->count -= earlier->count;
+    histogram->sum_ns -= earlier->sum_ns;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i)
+        histogram->buckets[i] -= earlier->buckets[i];
+}
+
+uint64_t latency_quantile(const LatencyHistogram* histogram, double quantile)
+{
+    // The count is read separately from the buckets, so use their sum.
+    uint64_t count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i)
+        count += histogram->buckets[i];
+    if (!count)
+        return 0;
+    double exact_rank = quantile * count;
+    uint64_t rank = (uint64_t)exact_rank;
+    if (rank < exact_rank || rank < 1)
+        rank++;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            return bucket_value(i);
+    }
+    return bucket_value(LATENCY_BUCKETS - 1);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+
+// Latency histograms recorded in per-thread shards.
+//
+// Buckets are log-linear ("HDR" style): values below LATENCY_SUB_BUCKETS
+// nanoseconds are exact, larger ones fall into LATENCY_SUB_BUCKETS buckets
+// per power of two, so a bucket is within 1 / LATENCY_SUB_BUCKETS of the
+// values in it. Values from 2^(LATENCY_MAX_EXPONENT + 1) ns (about two
+// minutes) up go into the last bucket.
+//
+// There are LATENCY_SLOTS independent histograms; the caller decides what
+// each slot counts. Every thread records into its own shard with plain
+// loads and stores (no read-modify-write), to memory no other thread
+// writes, so recording costs a few instructions and no cache-line
+// transfers. Shards of exited threads are kept and reused by new threads,
+// so nothing recorded is lost. latency_collect adds up all shards; it can
+// run concurrently with recording, and then sees each recent value or not.
+
+#define LATENCY_SLOTS 64
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXPONENT 36
+#define LATENCY_BUCKETS \
+    ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+// Current time in nanoseconds (CLOCK_MONOTONIC).
+uint64_t latency_now(void);
+
+// Record a latency of `ns` nanoseconds in histogram `slot` of this thread.
+void latency_record(unsigned slot, uint64_t ns);
+
+// Record a latency of `ns` nanoseconds in `histogram`, which the caller
+// owns and does not share (e.g. one per benchmark thread).
+void latency_add(LatencyHistogram* histogram, uint64_t ns);
+
+// Store in out[i] the sum over all shards of histogram i, for i < n.
+void latency_collect(LatencyHistogram* out, unsigned n);
+
+// Subtract `earlier` from `histogram`, both collected from the same slot,
+// `earlier` first.
+void latency_subtract(LatencyHistogram* histogram, const LatencyHistogram* earlier);
+
+// Return the value (in the middle of its bucket) below which a `quantile`
+// fraction of the recorded values lie, or 0 if there are none.
+uint64_t latency_quantile(const LatencyHistogram* histogram, double quantile);
@@ -1,4 +1,11 @@
 #include "HashMap.h"
+#include "Tree.h"
+#include "executor.h"
+#include "path_utils.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +14,198 @@
 #include <unistd.h>
 
 
+// Test obciążeniowy: wątki wykonują losowe create, remove, move i list na
+// małym zbiorze ścieżek, więc przeniesienia często trafiają na siebie i na
+// inne operacje, a pisarze na czytelników w uprzywilejowanych folderach.
+// Na końcu liczba folderów musi się zgadzać z liczbą udanych create
+// i remove (przeniesienie nie może zgubić ani zapętlić poddrzewa).
+// Wątki pracują na dwóch drzewach, więc przeniesienia w różnych drzewach
+// się przeplatają.
+#define STRESS_THREADS 4
+#define STRESS_TREES 2
+#define STRESS_OPS 20000
+
+static Tree *stress_trees[STRESS_TREES];
+
+typedef struct {
+	Tree *tree;
+	long balance; // udane create minus udane remove
+} StressWorker;
+
+static void random_path(unsigned int *seed, char *path)
+{
+	const char *tops[] = {"/p/", "/q/", "/r/"};
+	strcpy(path, tops[rand_r(seed) % 3]);
+	int depth = rand_r(seed) % 3;
+	for (int i = 0; i < depth; ++i) {
+		size_t length = strlen(path);
+		path[length] = 'a' + rand_r(seed) % 4;
+		path[length + 1] = '/';
+		path[length + 2] = '\0';
+	}
+}
+
+static void *stress_worker(void *arg)
+{
+	StressWorker *worker = arg;
+	Tree *tree = worker->tree;
+	unsigned int seed = (unsigned int)(size_t)arg;
+	char path[32], target[32];
+	for (int i = 0; i < STRESS_OPS; ++i) {
+		random_path(&seed, path);
+		switch (rand_r(&seed) % 4) {
+		case 0:
+			if (tree_create(tree, path) == 0)
+				worker->balance++;
+			break;
+		case 1:
+			if (tree_remove(tree, path) == 0)
+				worker->balance--;
+			break;
+		case 2:
+			free(tree_list(tree, path));
+			break;
+		default:
+			random_path(&seed, target);
+			tree_move(tree, path, target);
+		}
+	}
+	return NULL;
+}
+
+// Zliczanie alokacji: malloc, calloc i realloc programu zastępujemy
+// funkcjami, które liczą wywołania w bieżącym wątku. Tylko z glibc
+// (__libc_malloc) i bez sanitizerów, które same zastępują malloc.
+#if defined(TREE_USE_SLAB) && defined(__GLIBC__) && \
+	!defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define COUNT_ALLOCATIONS
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static _Thread_local long allocations;
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	allocations++;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+// Wykonuje na drzewie tree rundę create, move i remove, po której drzewo
+// wraca do stanu sprzed niej.
+static void allocation_round(Tree *tree)
+{
+	char path[32], target[32];
+	for (int i = 0; i < 20; ++i) {
+		sprintf(path, "/a/b/c/%c/", 'a' + i);
+		assert(tree_create(tree, path) == 0);
+		assert(tree_create(tree, path) == EEXIST);
+	}
+	for (int i = 0; i < 20; ++i) {
+		sprintf(path, "/a/b/c/%c/", 'a' + i);
+		sprintf(target, "/d/%c/", 'a' + i);
+		assert(tree_move(tree, path, target) == 0);
+	}
+	for (int i = 0; i < 20; ++i) {
+		sprintf(target, "/d/%c/", 'a' + i);
+		assert(tree_remove(tree, target) == 0);
+		assert(tree_remove(tree, target) == ENOENT);
+	}
+	assert(tree_create(tree, "/a/x/y/") == ENOENT);
+	assert(tree_move(tree, "/a/x/", "/d/x/") == ENOENT);
+}
+
+// Wywołanie zwrotne z tree_submit: liczy udane operacje.
+static void count_success(void *arg, int result)
+{
+	if (result == 0)
+		atomic_fetch_add((atomic_int *)arg, 1);
+}
+
+static long count_folders(Tree *tree, char *path)
+{
+	char *list = tree_list(tree, path);
+	assert(list);
+	long count = 1;
+	size_t length = strlen(path);
+	char *name = list;
+	while (*name) {
+		char *end = strchr(name, ',');
+		if (end)
+			*end = '\0';
+		sprintf(path + length, "%s/", name);
+		count += count_folders(tree, path);
+		path[length] = '\0';
+		if (!end)
+			break;
+		name = end + 1;
+	}
+	free(list);
+	return count;
+}
+
+// Sprawdza tree_stat w każdym folderze poddrzewa path z policzonymi
+// rozmiarem i wysokością. Zwraca liczbę folderów poddrzewa (z path).
+static long check_stat(Tree *tree, char *path, int *height)
+{
+	char *list = tree_list(tree, path);
+	assert(list);
+	long count = 1;
+	*height = 0;
+	size_t length = strlen(path);
+	char *name = list;
+	while (*name) {
+		char *end = strchr(name, ',');
+		if (end)
+			*end = '\0';
+		sprintf(path + length, "%s/", name);
+		int child_height;
+		count += check_stat(tree, path, &child_height);
+		if (child_height + 1 > *height)
+			*height = child_height + 1;
+		path[length] = '\0';
+		if (!end)
+			break;
+		name = end + 1;
+	}
+	free(list);
+	TreeStat stat;
+	assert(tree_stat(tree, path, &stat) == 0);
+	assert(stat.descendants == (size_t)count - 1 && stat.height == *height);
+	return count;
+}
+
+// Sprawdza tokenize_path z tokenize_path_scalar, is_path_valid i split_path.
+static void check_tokenize(const char *path)
+{
+	static PathComponent fast[MAX_PATH_COMPONENTS], slow[MAX_PATH_COMPONENTS];
+	int n = tokenize_path(path, fast);
+	assert(n == tokenize_path_scalar(path, slow));
+	assert((n >= 0) == is_path_valid(path));
+	char component[MAX_FOLDER_NAME_LENGTH + 1];
+	const char *subpath = path;
+	for (int i = 0; i < n; ++i) {
+		assert(fast[i].name == slow[i].name && fast[i].length == slow[i].length);
+		assert(fast[i].hash == hmap_hash(fast[i].name, fast[i].length));
+		subpath = split_path(subpath, component);
+		assert(strlen(component) == fast[i].length &&
+		       strncmp(component, fast[i].name, fast[i].length) == 0);
+	}
+	assert(n < 0 || split_path(subpath, NULL) == NULL);
+}
 
 int main(void)
 {
@@ -28,6 +227,509 @@ int main(void)
 	list_content = tree_list(tree, "/b/");
 	assert(strcmp(list_content, "c") == 0);
 	free(list_content);
+
+	// Czasy operacji są zbierane osobno dla każdego rodzaju wyniku.
+	tree_stats_reset();
+	assert(tree_create(tree, "/h/") == 0);
+	assert(tree_create(tree, "/h/") == EEXIST);
+	assert(tree_remove(tree, "/h/") == 0);
+	assert(tree_list(tree, "/h/") == NULL);
+	TreeStats *stats = tree_stats_snapshot();
+	assert(tree_stats_count(stats, TREE_STATS_CREATE, TREE_STATS_OK) == 1);
+	assert(tree_stats_count(stats, TREE_STATS_CREATE, TREE_STATS_EEXIST) == 1);
+	assert(tree_stats_count(stats, TREE_STATS_REMOVE, TREE_STATS_OK) == 1);
+	assert(tree_stats_count(stats, TREE_STATS_LIST, TREE_STATS_ENOENT) == 1);
+	assert(tree_stats_count(stats, TREE_STATS_LIST, TREE_STATS_OK) == 0);
+	assert(tree_stats_quantile(stats, TREE_STATS_MOVE, TREE_STATS_OK, 0.5) == 0);
+	assert(tree_stats_quantile(stats, TREE_STATS_CREATE, TREE_STATS_OK, 0.5) ==
+	       tree_stats_quantile(stats, TREE_STATS_CREATE, TREE_STATS_OK, 1));
+	tree_stats_free(stats);
+
+	// Ścieżki w pamięci podręcznej są unieważniane przez przeniesienie przodka.
+	unsigned long hits, misses, hits_before;
+	assert(tree_create(tree, "/b/c/e/") == 0);
+	assert(tree_create(tree, "/b/c/e/f/") == 0);
+	tree_cache_stats(&hits_before, &misses);
+	list_content = tree_list(tree, "/b/c/e/");
+	assert(strcmp(list_content, "f") == 0);
+	free(list_content);
+	list_content = tree_list(tree, "/b/c/e/");
+	free(list_content);
+	tree_cache_stats(&hits, &misses);
+	assert(hits > hits_before);
+	assert(tree_move(tree, "/b/c/", "/a/c/") == 0);
+	assert(tree_list(tree, "/b/c/e/") == NULL);
+	assert(tree_create(tree, "/b/c/") == 0);
+	assert(tree_create(tree, "/b/c/e/") == 0);
+	list_content = tree_list(tree, "/b/c/e/");
+	assert(strcmp(list_content, "") == 0);
+	free(list_content);
+	list_content = tree_list(tree, "/a/c/e/");
+	assert(strcmp(list_content, "f") == 0);
+	free(list_content);
+	assert(tree_remove(tree, "/a/c/e/f/") == 0);
+	assert(tree_list(tree, "/a/c/e/f/") == NULL);
+
+	// Partia daje te same wyniki co kolejne wywołania.
+	TreeOp ops[] = {
+		{TREE_OP_CREATE, "/x/y/", NULL},
+		{TREE_OP_CREATE, "/x/", NULL},
+		{TREE_OP_CREATE, "/x/y/", NULL},
+		{TREE_OP_CREATE, "/x/z/", NULL},
+		{TREE_OP_CREATE, "/x/y/", NULL},
+		{TREE_OP_MOVE, "/x/z/", "/x/y/z/"},
+		{TREE_OP_REMOVE, "/x/", NULL},
+		{TREE_OP_REMOVE, "/x/y/z/", NULL},
+		{TREE_OP_REMOVE, "/x/y/", NULL},
+		{TREE_OP_CREATE, "x", NULL},
+	};
+	int expected[] = {ENOENT, 0, 0, 0, EEXIST, 0, ENOTEMPTY, 0, 0, EINVAL};
+	int results[sizeof(ops) / sizeof(ops[0])];
+	tree_stats_reset();
+	tree_apply_batch(tree, ops, sizeof(ops) / sizeof(ops[0]), results);
+	for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i)
+		assert(results[i] == expected[i]);
+	// Czasy operacji z partii są liczone pojedynczo.
+	stats = tree_stats_snapshot();
+	assert(tree_stats_count(stats, TREE_STATS_CREATE, TREE_STATS_OK) == 3);
+	assert(tree_stats_count(stats, TREE_STATS_CREATE, TREE_STATS_ENOENT) == 1);
+	assert(tree_stats_count(stats, TREE_STATS_CREATE, TREE_STATS_EEXIST) == 1);
+	assert(tree_stats_count(stats, TREE_STATS_CREATE, TREE_STATS_EINVAL) == 1);
+	assert(tree_stats_count(stats, TREE_STATS_REMOVE, TREE_STATS_OK) == 2);
+	assert(tree_stats_count(stats, TREE_STATS_REMOVE, TREE_STATS_ENOTEMPTY) == 1);
+	assert(tree_stats_count(stats, TREE_STATS_MOVE, TREE_STATS_OK) == 1);
+	tree_stats_free(stats);
+	list_content = tree_list(tree, "/x/");
+	assert(strcmp(list_content, "") == 0);
+	free(list_content);
+
+	// Wczytywanie hurtowe pomija te same ścieżki co kolejne tree_create:
+	// "/x/" istnieje, "/x/b/c/" jest przed swoim rodzicem, a "/q/" nie ma.
+	const char *bulk[] = {"/x/b/c/", "/x/", "/x/b/", "/x/b/", "/m/", "/x/b/c/",
+	                      "/q/r/", "/m/n/", "/", "m"};
+	tree_stats_reset();
+	assert(tree_bulk_load(tree, bulk, sizeof(bulk) / sizeof(bulk[0]), 2) == 4);
+	stats = tree_stats_snapshot();
+	assert(tree_stats_count(stats, TREE_STATS_BULK_LOAD, TREE_STATS_OK) == 1);
+	assert(tree_stats_count(stats, TREE_STATS_CREATE, TREE_STATS_OK) == 0);
+	assert(tree_stats_count(stats, TREE_STATS_CREATE, TREE_STATS_OTHER) == 0);
+	tree_stats_free(stats);
+	list_content = tree_list(tree, "/x/b/");
+	assert(strcmp(list_content, "c") == 0);
+	free(list_content);
+	list_content = tree_list(tree, "/m/");
+	assert(strcmp(list_content, "n") == 0);
+	free(list_content);
+	char stat_path[MAX_PATH_LENGTH + 1] = "/";
+	int height;
+	check_stat(tree, stat_path, &height);
+	assert(tree_remove(tree, "/m/n/") == 0 && tree_remove(tree, "/m/") == 0);
+	assert(tree_remove(tree, "/x/b/c/") == 0 && tree_remove(tree, "/x/b/") == 0);
+
+	// tree_create_path tworzy też brakujące foldery na drodze.
+	assert(tree_create_path(tree, "/m/n/o/") == 0);
+	assert(tree_create_path(tree, "/m/n/o/") == EEXIST);
+	assert(tree_create_path(tree, "/m/p/") == 0);
+	assert(tree_create_path(tree, "m") == EINVAL);
+	list_content = tree_list(tree, "/m/");
+	assert(strcmp(list_content, "n,p") == 0);
+	free(list_content);
+	list_content = tree_list(tree, "/m/n/");
+	assert(strcmp(list_content, "o") == 0);
+	free(list_content);
+
+	// tree_stat podaje rozmiar i wysokość poddrzewa bez przechodzenia go.
+	TreeStat stat;
+	assert(tree_stat(tree, "/m/", &stat) == 0);
+	assert(stat.descendants == 3 && stat.height == 2);
+	assert(tree_move(tree, "/m/n/", "/m/p/n/") == 0);
+	assert(tree_stat(tree, "/m/", &stat) == 0);
+	assert(stat.descendants == 3 && stat.height == 3);
+	assert(tree_stat(tree, "/m/p/", &stat) == 0);
+	assert(stat.descendants == 2 && stat.height == 2);
+	assert(tree_move(tree, "/m/p/n/", "/n/") == 0);
+	assert(tree_stat(tree, "/m/", &stat) == 0);
+	assert(stat.descendants == 1 && stat.height == 1);
+	assert(tree_move(tree, "/n/", "/m/n/") == 0);
+	assert(tree_stat(tree, "/m/q/", &stat) == ENOENT);
+	assert(tree_stat(tree, "m", &stat) == EINVAL);
+	assert(tree_remove(tree, "/m/n/o/") == 0);
+	assert(tree_stat(tree, "/m/", &stat) == 0);
+	assert(stat.descendants == 2 && stat.height == 1);
+	assert(tree_remove(tree, "/m/n/") == 0);
+	assert(tree_remove(tree, "/m/p/") == 0 && tree_remove(tree, "/m/") == 0);
+
+	// Operacje asynchroniczne: w jednym folderze wykonywane w kolejności
+	// zgłoszenia, wyniki przez kolejkę zakończonych lub wywołanie zwrotne.
+	TreeExecutor *executor = tree_executor_new(tree, 3);
+	assert(tree_create(tree, "/e/") == 0);
+	char async_paths[26 * 26][8];
+	for (int i = 0; i < 26 * 26; ++i) {
+		sprintf(async_paths[i], "/e/%c%c/", 'a' + i / 26, 'a' + i % 26);
+		tree_submit(executor, &(TreeOp){TREE_OP_CREATE, async_paths[i], NULL},
+		            NULL, async_paths[i]);
+	}
+	tree_submit(executor, &(TreeOp){TREE_OP_CREATE, "/e/aa/", NULL}, NULL, NULL);
+	tree_submit(executor, &(TreeOp){TREE_OP_CREATE, "e", NULL}, NULL, NULL);
+	TreeCompletion completions[100];
+	size_t completed = 0, failed = 0, polled;
+	while ((polled = tree_executor_poll(executor, completions, 100, true))) {
+		for (size_t i = 0; i < polled; ++i) {
+			if (completions[i].arg) {
+				assert(completions[i].result == 0);
+				completed++;
+			} else {
+				assert(completions[i].result == EEXIST ||
+				       completions[i].result == EINVAL);
+				failed++;
+			}
+		}
+	}
+	assert(completed == 26 * 26 && failed == 2);
+	assert(tree_executor_poll(executor, completions, 100, true) == 0);
+	atomic_int removed = 0;
+	for (int i = 0; i < 26 * 26; ++i)
+		tree_submit(executor, &(TreeOp){TREE_OP_REMOVE, async_paths[i], NULL},
+		            count_success, &removed);
+	tree_executor_free(executor);
+	assert(atomic_load(&removed) == 26 * 26);
+	assert(tree_remove(tree, "/e/") == 0);
+
+	// Poza pierwszymi operacjami (które przydzielają np. histogramy czasów
+	// i pamięć slabów) create, remove i move nie przydzielają pamięci, także
+	// gdy synowie folderu mają wiele różnych wysokości (tu /a/b/).
+	Tree *quiet = tree_new();
+	assert(tree_create_path(quiet, "/a/b/c/") == 0);
+	assert(tree_create_path(quiet, "/a/b/p/q/r/") == 0);
+	assert(tree_create_path(quiet, "/a/b/s/t/") == 0);
+	assert(tree_create(quiet, "/d/") == 0);
+	for (int i = 0; i < 10; ++i)
+		allocation_round(quiet);
+#ifdef COUNT_ALLOCATIONS
+	allocations = 0;
+#endif
+	for (int i = 0; i < 100; ++i)
+		allocation_round(quiet);
+#ifdef COUNT_ALLOCATIONS
+	assert(allocations == 0);
+#endif
+	assert(check_stat(quiet, stat_path, &height) == 10 && height == 5);
+	tree_free(quiet);
+
+	// Listy są posortowane, można wypisać przedział lub nazwy z prefiksem.
+	const char *names[] = {"ab", "b", "abc", "a", "ba", "c"};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		char path[16];
+		sprintf(path, "/x/%s/", names[i]);
+		assert(tree_create(tree, path) == 0);
+	}
+	list_content = tree_list(tree, "/x/");
+	assert(strcmp(list_content, "a,ab,abc,b,ba,c") == 0);
+	free(list_content);
+	list_content = tree_list_range(tree, "/x/", "ab", "ba");
+	assert(strcmp(list_content, "ab,abc,b") == 0);
+	free(list_content);
+	list_content = tree_list_range(tree, "/x/", NULL, "b");
+	assert(strcmp(list_content, "a,ab,abc") == 0);
+	free(list_content);
+	list_content = tree_list_range(tree, "/x/", "bb", NULL);
+	assert(strcmp(list_content, "c") == 0);
+	free(list_content);
+	list_content = tree_list_prefix(tree, "/x/", "ab");
+	assert(strcmp(list_content, "ab,abc") == 0);
+	free(list_content);
+	list_content = tree_list_prefix(tree, "/x/", "d");
+	assert(strcmp(list_content, "") == 0);
+	free(list_content);
+	assert(tree_list_prefix(tree, "/y/", "a") == NULL);
+
+	// Lista dużego folderu jest współdzielona aż do jego zmiany.
+	for (char c = 'd'; c <= 'z'; ++c) {
+		char path[16];
+		sprintf(path, "/x/%c/", c);
+		assert(tree_create(tree, path) == 0);
+	}
+	const char *shared = tree_list_shared(tree, "/x/");
+	const char *shared_again = tree_list_shared(tree, "/x/");
+	assert(shared == shared_again);
+	tree_list_release(shared_again);
+	assert(tree_create(tree, "/x/d/") == EEXIST);
+	assert(tree_remove(tree, "/x/z/") == 0);
+	shared_again = tree_list_shared(tree, "/x/");
+	assert(shared != shared_again);
+	assert(strncmp(shared, shared_again, strlen(shared_again)) == 0);
+	assert(strcmp(shared + strlen(shared_again), ",z") == 0);
+	tree_list_release(shared);
+	tree_list_release(shared_again);
+	assert(tree_list_shared(tree, "/y/") == NULL);
+
+	// Kursor zwraca nazwy porcjami, rosnąco, każdą najwyżej raz.
+	assert(tree_list_open(tree, "/y/") == NULL);
+	TreeListCursor *cursor = tree_list_open(tree, "/x/");
+	char chunk[8];
+	assert(tree_list_next(cursor, chunk, 1) == -1);
+	assert(tree_list_next(cursor, chunk, sizeof(chunk)) == 2);
+	assert(strcmp(chunk, "a,ab") == 0);
+	assert(tree_remove(tree, "/x/b/") == 0);
+	assert(tree_create(tree, "/x/aa/") == 0);
+	assert(tree_move(tree, "/x/", "/w/") == 0);
+	size_t total = 2;
+	int count;
+	while ((count = tree_list_next(cursor, chunk, sizeof(chunk))) > 0)
+		total += count;
+	assert(count == 0);
+	tree_list_close(cursor);
+	// Z 28 nazw ubyło b, a aa nie wróciła, bo jest przed kursorem.
+	assert(total == 27);
+
+	// Migawka nie widzi zmian wykonanych po jej utworzeniu.
+	assert(tree_create(tree, "/s/") == 0);
+	assert(tree_create(tree, "/s/a/") == 0);
+	assert(tree_create(tree, "/s/a/b/") == 0);
+	TreeSnapshot *snapshot = tree_snapshot(tree);
+	assert(tree_remove(tree, "/s/a/b/") == 0);
+	assert(tree_move(tree, "/s/a/", "/s/c/") == 0);
+	assert(tree_create(tree, "/s/c/d/") == 0);
+	TreeSnapshot *later = tree_snapshot(tree);
+	assert(tree_remove(tree, "/s/c/d/") == 0);
+	list_content = tree_snapshot_list(snapshot, "/s/");
+	assert(strcmp(list_content, "a") == 0);
+	free(list_content);
+	list_content = tree_snapshot_list(snapshot, "/s/a/");
+	assert(strcmp(list_content, "b") == 0);
+	free(list_content);
+	assert(tree_snapshot_list(snapshot, "/s/c/") == NULL);
+	tree_snapshot_release(snapshot);
+	list_content = tree_snapshot_list(later, "/s/c/");
+	assert(strcmp(list_content, "d") == 0);
+	free(list_content);
+	tree_snapshot_release(later);
+	list_content = tree_list(tree, "/s/c/");
+	assert(strcmp(list_content, "") == 0);
+	free(list_content);
+
+	// Drzewo wczytane z obrazu ma tę samą zawartość i da się je zmieniać.
+	const char *image_file = "main_test.img";
+	assert(tree_save(tree, image_file) == 0);
+	Tree *loaded = tree_load(image_file);
+	assert(loaded);
+	list_content = tree_list(loaded, "/w/");
+	char *original = tree_list(tree, "/w/");
+	assert(strcmp(list_content, original) == 0);
+	free(list_content);
+	free(original);
+	assert(tree_create(loaded, "/a/c/e/f/") == 0);
+	assert(tree_move(loaded, "/s/c/", "/a/c/e/f/c/") == 0);
+	assert(tree_remove(loaded, "/w/a/") == 0);
+	list_content = tree_list(loaded, "/a/c/e/f/");
+	assert(strcmp(list_content, "c") == 0);
+	free(list_content);
+	check_stat(loaded, stat_path, &height);
+	assert(tree_save(loaded, image_file) == 0);
+	tree_free(loaded);
+	loaded = tree_load(image_file);
+	// Agregaty pochodzą z obrazu, więc zgadzają się przed rozwinięciem.
+	assert(tree_stat(loaded, "/", &stat) == 0);
+	assert(stat.descendants == (size_t)check_stat(loaded, stat_path, &height) - 1);
+	list_content = tree_list(loaded, "/a/c/e/f/");
+	assert(strcmp(list_content, "c") == 0);
+	free(list_content);
+	assert(tree_list(loaded, "/w/a/") == NULL);
+	tree_free(loaded);
+	FILE *image = fopen(image_file, "r+b");
+	assert(image && fputc('X', image) != EOF && fclose(image) == 0);
+	assert(tree_load(image_file) == NULL && errno == EINVAL);
+	assert(unlink(image_file) == 0);
 	tree_free(tree);
+
+	// Po awarii drzewo odtwarza się z ostatniego obrazu i dziennika; obraz
+	// pamięta, ile wpisów dziennika już zawiera.
+	const char *journal_file = "main_test.journal";
+	unlink(journal_file);
+	Tree *durable = tree_recover(NULL, journal_file, 100, 0);
+	assert(durable);
+	assert(tree_create(durable, "/j/") == 0);
+	assert(tree_create(durable, "/k/") == 0);
+	assert(tree_save(durable, image_file) == 0);
+	assert(tree_create(durable, "/j/a/") == 0);
+	assert(tree_move(durable, "/k/", "/j/a/k/") == 0);
+	assert(tree_remove(durable, "/j/a/k/") == 0);
+	assert(tree_create(durable, "/j/b/") == 0);
+	assert(tree_create_path(durable, "/j/b/c/d/") == 0);
+	assert(tree_remove(durable, "/x/") == ENOENT);
+	tree_free(durable);
+	// Wpis przerwany przez awarię jest pomijany i obcinany.
+	FILE *journal = fopen(journal_file, "ab");
+	assert(journal && fputs("torn", journal) != EOF && fclose(journal) == 0);
+	for (int i = 0; i < 2; ++i) {
+		// Z obrazem i bez niego (cały dziennik od pustego drzewa).
+		durable = tree_recover(i ? NULL : image_file, journal_file, 0, 0);
+		assert(durable);
+		list_content = tree_list(durable, "/");
+		assert(strcmp(list_content, i ? "c,j" : "j") == 0);
+		free(list_content);
+		list_content = tree_list(durable, "/j/");
+		assert(strcmp(list_content, "a,b") == 0);
+		free(list_content);
+		list_content = tree_list(durable, "/j/b/c/");
+		assert(strcmp(list_content, "d") == 0);
+		free(list_content);
+		if (!i)
+			assert(tree_create(durable, "/c/") == 0);
+		tree_free(durable);
+	}
+	assert(unlink(image_file) == 0);
+	assert(unlink(journal_file) == 0);
+
+	// Uprzywilejowani czytelnicy widzą zmiany pisarzy, którzy cofają tryb.
+	Tree *biased = tree_new();
+	tree_set_reader_bias(biased, 2);
+	assert(tree_create(biased, "/a/") == 0);
+	for (int i = 0; i < 3; ++i) {
+		list_content = tree_list(biased, "/a/");
+		assert(strcmp(list_content, i ? "b" : "") == 0);
+		free(list_content);
+		list_content = tree_list(biased, "/");
+		assert(strcmp(list_content, "a") == 0);
+		free(list_content);
+		if (!i)
+			assert(tree_create(biased, "/a/b/") == 0);
+	}
+	assert(tree_move(biased, "/a/b/", "/c/") == 0);
+	list_content = tree_list(biased, "/");
+	assert(strcmp(list_content, "a,c") == 0);
+	free(list_content);
+	tree_free(biased);
+
+	for (int t = 0; t < STRESS_TREES; ++t) {
+		stress_trees[t] = tree_new();
+		tree_set_reader_bias(stress_trees[t], 2);
+		assert(tree_create(stress_trees[t], "/p/") == 0);
+		assert(tree_create(stress_trees[t], "/q/") == 0);
+		assert(tree_create(stress_trees[t], "/r/") == 0);
+	}
+	pthread_t threads[STRESS_THREADS];
+	StressWorker workers[STRESS_THREADS];
+	for (int i = 0; i < STRESS_THREADS; ++i) {
+		workers[i] = (StressWorker){stress_trees[i % STRESS_TREES], 0};
+		assert(pthread_create(&threads[i], NULL, stress_worker, &workers[i]) == 0);
+	}
+	long expected_folders[STRESS_TREES];
+	for (int t = 0; t < STRESS_TREES; ++t)
+		expected_folders[t] = 4; // "/" i trzy foldery na początku
+	for (int i = 0; i < STRESS_THREADS; ++i) {
+		assert(pthread_join(threads[i], NULL) == 0);
+		expected_folders[i % STRESS_TREES] += workers[i].balance;
+	}
+	char stress_path[4096] = "/";
+	for (int t = 0; t < STRESS_TREES; ++t) {
+		assert(count_folders(stress_trees[t], stress_path) == expected_folders[t]);
+		assert(check_stat(stress_trees[t], stress_path, &height) == expected_folders[t]);
+	}
+	Tree *stress_tree = stress_trees[0];
+	tree_free(stress_trees[1]);
+
+	// Z TREE_CONTENTION_STATS widać foldery, o które wątki rywalizowały.
+	TreeContention *report = tree_contention_report(stress_tree, 3);
+#ifdef TREE_CONTENTION_STATS
+	assert(report && report[0].path);
+	for (TreeContention *entry = report; entry->path; ++entry) {
+		assert(entry - report < 3 && entry->waits <= entry->acquisitions);
+		list_content = tree_list(stress_tree, entry->path);
+		assert(list_content);
+		free(list_content);
+	}
+#else
+	assert(!report);
+#endif
+	tree_contention_free(report);
+	tree_contention_reset();
+
+	// Po przeniesieniu ścieżki w drzewie bywają dłuższe niż MAX_PATH_LENGTH;
+	// raport i tak przechodzi po nich wszystkich.
+	static char long_path[MAX_PATH_LENGTH + 1];
+	Tree *long_tree = tree_new();
+	for (int i = 0; i < 1500; ++i)
+		memcpy(long_path + 2 * i, "/a", 2);
+	strcpy(long_path + 3000, "/");
+	assert(tree_create_path(long_tree, long_path) == 0);
+	for (int i = 0; i < 1000; ++i)
+		memcpy(long_path + 2 * i, "/b", 2);
+	strcpy(long_path + 2000, "/");
+	assert(tree_create_path(long_tree, long_path) == 0);
+	strcpy(long_path + 2000, "/c/");
+	assert(tree_move(long_tree, "/a/", long_path) == 0);
+	report = tree_contention_report(long_tree, 3);
+#ifdef TREE_CONTENTION_STATS
+	assert(report && report[0].path);
+	for (TreeContention *entry = report; entry->path; ++entry)
+		assert(entry - report < 3 && entry->path[0] == '/');
+#else
+	assert(!report);
+#endif
+	tree_contention_free(report);
+	tree_free(long_tree);
+	tree_contention_reset();
+
+	// Ścieżki różnej długości, pod różnymi przesunięciami względem
+	// wyrównania, także z niedozwolonymi znakami i na granicach długości.
+	static char path_buffer[MAX_PATH_LENGTH + 64];
+	unsigned int seed = 7;
+	const char bytes[] = "/az{`A0\x80\xff";
+	for (int i = 0; i < 20000; ++i) {
+		char *path = path_buffer + rand_r(&seed) % 32;
+		int length = i % 10 == 0 ? MAX_PATH_LENGTH - 8 + rand_r(&seed) % 16
+		                         : rand_r(&seed) % 600;
+		int slashes = 2 + rand_r(&seed) % 300;
+		for (int j = 0; j < length; ++j)
+			path[j] = rand_r(&seed) % slashes == 0 ? '/' : 'a' + rand_r(&seed) % 26;
+		if (length > 0 && rand_r(&seed) % 50 != 0)
+			path[0] = '/';
+		if (length > 1 && rand_r(&seed) % 4 != 0)
+			path[length - 1] = '/';
+		if (length > 0 && rand_r(&seed) % 10 == 0)
+			path[rand_r(&seed) % length] = bytes[rand_r(&seed) % (sizeof(bytes) - 1)];
+		path[length] = '\0';
+		check_tokenize(path);
+	}
+	for (int name = MAX_FOLDER_NAME_LENGTH - 1; name <= MAX_FOLDER_NAME_LENGTH + 1; ++name) {
+		for (int length = MAX_PATH_LENGTH - 1; length <= MAX_PATH_LENGTH + 1; ++length) {
+			for (int j = 0; j < length; ++j)
+				path_buffer[j] = j % (name + 1) == 0 ? '/' : 'q';
+			path_buffer[length - 1] = '/';
+			path_buffer[length] = '\0';
+			check_tokenize(path_buffer);
+		}
+	}
+	check_tokenize("/");
+	check_tokenize("");
+	check_tokenize("//");
+	check_tokenize("/a");
+
+	// Drzewo głębsze niż najdłuższa ścieżka (budowane przenoszeniem) jest
+	// zwalniane bez rekurencji, tu przez wątek zwalniający.
+	tree_reclaimer_start();
+	tree_free(stress_tree);
+	Tree *deep = tree_new();
+	assert(tree_create(deep, "/t/") == 0);
+	for (int i = 0; i < 100000; ++i) {
+		assert(tree_create(deep, "/n/") == 0);
+		assert(tree_move(deep, "/t/", "/n/t/") == 0);
+		assert(tree_move(deep, "/n/", "/t/") == 0);
+	}
+	tree_free(deep);
+	// Nowe drzewo może dostać adres korzenia zwolnionego drzewa, zanim
+	// wątek zwalniający zwolni resztę; nie widzi jednak jego ścieżek z dcache.
+	for (int i = 0; i < 300; ++i) {
+		Tree *old = tree_new();
+		assert(tree_create_path(old, "/a/b/c/") == 0);
+		free(tree_list(old, "/a/b/c/"));
+		tree_free(old);
+		Tree *fresh = tree_new();
+		assert(tree_list(fresh, "/a/b/c/") == NULL);
+		assert(tree_create(fresh, "/a/b/c/") == ENOENT);
+		tree_free(fresh);
+	}
+	tree_reclaimer_stop();
     return 0;
 }
@@ -28,6 +28,242 @@ bool is_path_valid(const char *path) {
     return true;
 }
 
+int tokenize_path_scalar(const char *path, PathComponent *components) {
+    if (path[0] != '/')
+        return -1;
+    int n = 0;
+    const char *name_start = path + 1;
+    unsigned int hash = HMAP_HASH_INIT;
+    for (const char *p = name_start;; ++p) {
+        char c = *p;
+        if (c >= 'a' && c <= 'z') {
+            hash = hmap_hash_step(hash, c);
+        } else if (c == '/') {
+            size_t len = p - name_start;
+            // The final '/' of a valid path is at most at MAX_PATH_LENGTH - 1,
+            // which also bounds the number of components.
+            if (len == 0 || len > MAX_FOLDER_NAME_LENGTH ||
+                p - path >= MAX_PATH_LENGTH)
+                return -1;
+            components[n].name = name_start;
+            components[n].length = len;
+            components[n].hash = hmap_hash_finish(hash);
+            n++;
+            name_start = p + 1;
+            hash = HMAP_HASH_INIT;
+        } else if (c == '\0' && p == name_start) {
+            return n;
+        } else {
+            return -1;
+        }
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#include <immintrin.h>
+#include <stdint.h>
+
+// The vector kernels look at the path in aligned blocks, classifying every
+// byte at once as '/', 'a'-'z', '\0' or other, and only visit the '/'
+// positions one by one. They fill in the names and lengths of the
+// components; the hashes are computed afterwards (see hash_components).
+//
+// An aligned block never crosses a page boundary, so reading the bytes of
+// the first and the last block that are not part of the path is harmless,
+// but the sanitizers would report it.
+#define NO_SANITIZE __attribute__((no_sanitize("address", "thread")))
+
+typedef struct {
+    const char *path;
+    PathComponent *components;
+    int n;
+    size_t last_slash; // Offset of the '/' before the current name.
+} Scan;
+
+// Process a block: bit i of each mask describes byte `base + i` of the path.
+// Returns 1 if the path ends in the block, 0 if it goes on, -1 if it is not
+// valid.
+static inline int scan_block(Scan *scan, size_t base, uint32_t slashes,
+                             uint32_t others, uint32_t nuls) {
+    if (nuls) {
+        uint32_t before_end = (nuls & -nuls) - 1;
+        slashes &= before_end;
+        others &= before_end;
+    }
+    if (others)
+        return -1;
+    while (slashes) {
+        size_t p = base + __builtin_ctz(slashes);
+        slashes &= slashes - 1;
+        size_t len = p - scan->last_slash - 1;
+        // As in tokenize_path_scalar, this also bounds the number of
+        // components.
+        if (len == 0 || len > MAX_FOLDER_NAME_LENGTH || p >= MAX_PATH_LENGTH)
+            return -1;
+        scan->components[scan->n].name = scan->path + scan->last_slash + 1;
+        scan->components[scan->n].length = len;
+        scan->n++;
+        scan->last_slash = p;
+    }
+    if (nuls)
+        return base + __builtin_ctz(nuls) == scan->last_slash + 1 ? 1 : -1;
+    // A valid path ends at offset MAX_PATH_LENGTH at the latest.
+    return base > MAX_PATH_LENGTH ? -1 : 0;
+}
+
+// Compute the hashes of the components. FNV-1a is a chain of dependent
+// multiplications, so hash four names at a time, interleaved.
+static void hash_components(PathComponent *components, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        PathComponent *c = components + i;
+        size_t common = c[0].length;
+        for (int k = 1; k < 4; ++k)
+            if (c[k].length < common)
+                common = c[k].length;
+        unsigned int h[4] = {HMAP_HASH_INIT, HMAP_HASH_INIT, HMAP_HASH_INIT,
+                             HMAP_HASH_INIT};
+        for (size_t j = 0; j < common; ++j) {
+            h[0] = hmap_hash_step(h[0], c[0].name[j]);
+            h[1] = hmap_hash_step(h[1], c[1].name[j]);
+            h[2] = hmap_hash_step(h[2], c[2].name[j]);
+            h[3] = hmap_hash_step(h[3], c[3].name[j]);
+        }
+        for (int k = 0; k < 4; ++k) {
+            for (size_t j = common; j < c[k].length; ++j)
+                h[k] = hmap_hash_step(h[k], c[k].name[j]);
+            c[k].hash = hmap_hash_finish(h[k]);
+        }
+    }
+    for (; i < n; ++i) {
+        unsigned int hash = HMAP_HASH_INIT;
+        for (size_t j = 0; j < components[i].length; ++j)
+            hash = hmap_hash_step(hash, components[i].name[j]);
+        components[i].hash = hmap_hash_finish(hash);
+    }
+}
+
+NO_SANITIZE static int tokenize_path_sse2(const char *path,
+                                      PathComponent *components) {
+    if (path[0] != '/')
+        return -1;
+    Scan scan = {path, components, 0, 0};
+    size_t skip = (uintptr_t)path % 16;
+    const __m128i *block = (const __m128i *)(path - skip);
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i zero = _mm_setzero_si128();
+    // Signed comparisons: bytes from 0x80 up are negative, below 'a'.
+    const __m128i below_a = _mm_set1_epi8('a' - 1);
+    const __m128i above_z = _mm_set1_epi8('z' + 1);
+    for (size_t base = -skip;; base += 16, block++) {
+        __m128i bytes = _mm_load_si128(block);
+        __m128i slashes = _mm_cmpeq_epi8(bytes, slash);
+        __m128i nuls = _mm_cmpeq_epi8(bytes, zero);
+        __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(bytes, below_a),
+                                        _mm_cmpgt_epi8(above_z, bytes));
+        __m128i known = _mm_or_si128(_mm_or_si128(slashes, nuls), letters);
+        uint32_t slash_mask = _mm_movemask_epi8(slashes);
+        uint32_t nul_mask = _mm_movemask_epi8(nuls);
+        uint32_t other_mask = ~_mm_movemask_epi8(known) & 0xffff;
+        size_t start = base;
+        if (base == -skip) {
+            // Drop the bytes before the path and its first '/'.
+            slash_mask = slash_mask >> skip & ~1u;
+            nul_mask >>= skip;
+            other_mask >>= skip;
+            start = 0;
+        }
+        int result = scan_block(&scan, start, slash_mask, other_mask, nul_mask);
+        if (result < 0)
+            return -1;
+        if (result > 0)
+            break;
+    }
+    hash_components(components, scan.n);
+    return scan.n;
+}
+
+NO_SANITIZE __attribute__((target("avx2"))) static int
+tokenize_path_avx2(const char *path, PathComponent *components) {
+    if (path[0] != '/')
+        return -1;
+    Scan scan = {path, components, 0, 0};
+    size_t skip = (uintptr_t)path % 32;
+    const __m256i *block = (const __m256i *)(path - skip);
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i below_a = _mm256_set1_epi8('a' - 1);
+    const __m256i above_z = _mm256_set1_epi8('z' + 1);
+    for (size_t base = -skip;; base += 32, block++) {
+        __m256i bytes = _mm256_load_si256(block);
+        __m256i slashes = _mm256_cmpeq_epi8(bytes, slash);
+        __m256i nuls = _mm256_cmpeq_epi8(bytes, zero);
+        __m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, below_a),
+                                           _mm256_cmpgt_epi8(above_z, bytes));
+        __m256i known = _mm256_or_si256(_mm256_or_si256(slashes, nuls), letters);
+        uint32_t slash_mask = _mm256_movemask_epi8(slashes);
+        uint32_t nul_mask = _mm256_movemask_epi8(nuls);
+        uint32_t other_mask = ~(uint32_t)_mm256_movemask_epi8(known);
+        size_t start = base;
+        if (base == -skip) {
+            slash_mask = slash_mask >> skip & ~1u;
+            nul_mask >>= skip;
+            other_mask >>= skip;
+            start = 0;
+        }
+        int result = scan_block(&scan, start, slash_mask, other_mask, nul_mask);
+        if (result < 0)
+            return -1;
+        if (result > 0)
+            break;
+    }
+    // GCC does not clear the upper halves before the call below, and SSE
+    // code running with them dirty is very slow.
+    _mm256_zeroupper();
+    hash_components(components, scan.n);
+    return scan.n;
+}
+
+static int (*tokenize_impl)(const char *, PathComponent *) = tokenize_path_sse2;
+
+// Pick the kernel once, before main; SSE2 is part of x86-64.
+__attribute__((constructor)) static void choose_tokenizer(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        tokenize_impl = tokenize_path_avx2;
+}
+
+// Whether the path ends within its first SHORT_BLOCKS aligned 16-byte
+// blocks.
+#define SHORT_BLOCKS 4
+
+NO_SANITIZE static inline bool is_short(const char *path) {
+    size_t skip = (uintptr_t)path % 16;
+    const __m128i *block = (const __m128i *)(path - skip);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t nuls = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(block), zero)) >> skip;
+    for (int i = 1; !nuls && i < SHORT_BLOCKS; ++i)
+        nuls = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(block + i), zero));
+    return nuls;
+}
+
+int tokenize_path(const char *path, PathComponent *components) {
+    // Up to a cache line or so, the scalar loop is as fast: the time goes
+    // into the hashes either way.
+    if (is_short(path))
+        return tokenize_path_scalar(path, components);
+    return tokenize_impl(path, components);
+}
+
+#else
+
+int tokenize_path(const char *path, PathComponent *components) {
+    return tokenize_path_scalar(path, components);
+}
+
+#endif
+
 const char *split_path(const char *path, char *component) {
     const char *subpath = strchr(path + 1,
                                  '/'); // Pointer to second '/' character.
@@ -68,58 +304,87 @@ char *make_path_to_parent(const char *path, char *component) {
     return result;
 }
 
-// A wrapper for using strcmp in qsort.
-// The arguments here are actually pointers to (const char*).
-static int compare_string_pointers(const void *p1, const void *p2) {
-    return strcmp(*(const char **) p1, *(const char **) p2);
-}
-
 const char **make_map_contents_array(HashMap *map) {
     size_t n_keys = hmap_size(map);
     const char **result = calloc(n_keys + 1, sizeof(char *));
-    HashMapIterator it = hmap_iterator(map);
+    if (!result)
+        fatal("Malloc failure");
+    HashMapIterator it = hmap_iterator(map); // Keys come sorted.
     const char **key = result;
     void *value = NULL;
     while (hmap_next(map, &it, key, &value)) {
         key++;
     }
     *key = NULL; // Set last array element to NULL.
-    qsort(result, n_keys, sizeof(char *), compare_string_pointers);
     return result;
 }
 
-char *make_map_contents_string(HashMap *map) {
-    const char **keys = make_map_contents_array(map);
+// Whether key belongs to the listing: it is less than `to` (if not NULL)
+// and starts with `prefix` (if not NULL).
+static bool in_listing(const char *key, const char *to, const char *prefix,
+                       size_t prefix_len) {
+    return (!to || strcmp(key, to) < 0) &&
+           (!prefix || strncmp(key, prefix, prefix_len) == 0);
+}
+
+// Join the keys from `from` on, as long as they belong to the listing.
+// Keys come sorted, so the keys that belong to it are consecutive and
+// the time is proportional to the result. The result starts `offset` bytes
+// into the returned buffer.
+static char *join_keys(HashMap *map, HashMapIterator from, const char *to,
+                       const char *prefix, size_t offset) {
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    const char *key;
+    void *value;
 
-    unsigned int result_size = 0; // Including ending null character.
-    for (const char **key = keys; *key; ++key)
-        result_size += strlen(*key) + 1;
+    size_t result_size = offset; // Including ending null character.
+    HashMapIterator it = from;
+    while (hmap_next(map, &it, &key, &value) &&
+           in_listing(key, to, prefix, prefix_len))
+        result_size += strlen(key) + 1;
 
-    // Return empty string if map is empty.
-    if (!result_size) {
+    // Return empty string if there are no keys.
+    if (result_size == offset) {
         // Note we can't just return "", as it can't be free'd.
-        char *result = malloc(1);
+        char *result = malloc(offset + 1);
         if (!result)
             fatal("Malloc failure");
-        *result = '\0';
-        free(keys);
+        result[offset] = '\0';
         return result;
     }
 
     char *result = malloc(result_size);
     if (!result)
         fatal("Malloc failure");
-    char *position = result;
-    for (const char **key = keys; *key; ++key) {
-        size_t keylen = strlen(*key);
+    char *position = result + offset;
+    it = from;
+    while (hmap_next(map, &it, &key, &value) &&
+           in_listing(key, to, prefix, prefix_len)) {
+        size_t keylen = strlen(key);
         assert(position + keylen <= result + result_size);
-        strcpy(position, *key); // NOLINT: array size already checked.
+        memcpy(position, key, keylen);
         position += keylen;
         *position = ',';
         position++;
     }
     position--;
     *position = '\0';
-    free(keys);
     return result;
 }
+
+char *make_map_contents_string(HashMap *map) {
+    return join_keys(map, hmap_iterator(map), NULL, NULL, 0);
+}
+
+char *make_map_contents_buffer(HashMap *map, size_t offset) {
+    return join_keys(map, hmap_iterator(map), NULL, NULL, offset);
+}
+
+char *make_map_range_string(HashMap *map, const char *from, const char *to) {
+    HashMapIterator it = from ? hmap_lower_bound(map, from) : hmap_iterator(map);
+    return join_keys(map, it, to, NULL, 0);
+}
+
+char *make_map_prefix_string(HashMap *map, const char *prefix) {
+    return join_keys(map, hmap_lower_bound(map, prefix), NULL, prefix, 0);
+}
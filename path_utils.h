@@ -9,6 +9,16 @@
 // Max length of folder name (excluding terminating null character).
 #define MAX_FOLDER_NAME_LENGTH 255
 
+// Max number of components of a valid path.
+#define MAX_PATH_COMPONENTS ((MAX_PATH_LENGTH - 1) / 2)
+
+// A folder name inside a path.
+typedef struct {
+    const char* name; // Points into the path, not null-terminated.
+    size_t length;
+    unsigned int hash; // hmap_hash(name, length).
+} PathComponent;
+
 // Return whether a path is valid.
 // Valid paths are '/'-separated sequences of folder names, always starting and ending with '/'.
 // Valid paths have length at most MAX_PATH_LENGTH (and at least 1). Valid folder names are are
@@ -30,6 +40,18 @@ bool is_path_valid(const char* path);
 //         printf("%s", component);
 const char* split_path(const char* path, char* component);
 
+// Validate `path` and split it into components.
+// `components` should have room for MAX_PATH_COMPONENTS elements.
+// Returns the number of components (0 for "/"), or -1 if the path is not
+// valid (see `is_path_valid`).
+// On x86-64 this runs an SSE2 or, if the CPU has it, AVX2 kernel, which
+// classifies a whole block of bytes at once and only stops at the '/'s.
+int tokenize_path(const char* path, PathComponent* components);
+
+// Same as tokenize_path, one byte at a time. Used where there is no vector
+// kernel, and to check the kernels against.
+int tokenize_path_scalar(const char* path, PathComponent* components);
+
 // Return a copy of the subpath obtained by removing the last component.
 // The caller should free the result, unless it is NULL.
 // Args:
@@ -50,3 +72,16 @@ const char** make_map_contents_array(HashMap* map);
 // The result has no trailing comma. An empty map yields an empty string.
 // The caller should free the result.
 char* make_map_contents_string(HashMap* map);
+
+// Like make_map_contents_string, but the string starts `offset` bytes into
+// the returned buffer, leaving room for a header of the caller.
+char* make_map_contents_buffer(HashMap* map, size_t offset);
+
+// Like make_map_contents_string, but only with keys k such that
+// from <= k < to (in the order of strcmp). NULL `from` or `to` means no
+// bound on that side. Takes time proportional to the result (plus
+// O(log n) to find its start).
+char* make_map_range_string(HashMap* map, const char* from, const char* to);
+
+// Like make_map_contents_string, but only with keys starting with `prefix`.
+char* make_map_prefix_string(HashMap* map, const char* prefix);
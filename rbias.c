@@ -0,0 +1,158 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "err.h"
+#include "rbias.h"
+
+#define CACHE_LINE 64
+
+// The visible readers of one thread: the addresses of the locks it holds
+// biased (NULL in free slots). Only the owner writes the slots; revoking
+// writers read them.
+typedef struct Record {
+    alignas(CACHE_LINE) _Atomic(const void*) slots[RBIAS_SLOTS];
+    alignas(CACHE_LINE) atomic_bool in_use; // Owned by a running thread.
+    struct Record* next;
+} Record;
+
+static _Atomic(Record*) records = NULL;
+static _Thread_local Record* self = NULL;
+_Thread_local unsigned int rbias_held = 0;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+static void release_record(void* arg)
+{
+    Record* record = arg;
+    atomic_store(&record->in_use, false);
+    self = NULL;
+}
+
+static void make_key(void)
+{
+    if (pthread_key_create(&thread_key, release_record) != 0)
+        syserr("pthread_key_create failed");
+}
+
+static Record* get_record(void)
+{
+    if (self)
+        return self;
+    Record* record;
+    for (record = atomic_load(&records); record; record = record->next) {
+        bool expected = false;
+        if (!atomic_load(&record->in_use) &&
+            atomic_compare_exchange_strong(&record->in_use, &expected, true))
+            break;
+    }
+    if (!record) {
+        record = aligned_alloc(CACHE_LINE, sizeof(Record));
+        if (!record)
+            fatal("Malloc failure.");
+        for (int i = 0; i < RBIAS_SLOTS; ++i)
+            atomic_init(&record->slots[i], NULL);
+        atomic_init(&record->in_use, true);
+        record->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &record->next, record))
+            ;
+    }
+    pthread_once(&key_once, make_key);
+    if (pthread_setspecific(thread_key, record) != 0)
+        syserr("pthread_setspecific failed");
+    self = record;
+    return record;
+}
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        syserr("clock_gettime failed");
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+bool rbias_read_lock_slow(ReaderBias* bias, const void* lock)
+{
+    Record* record = get_record();
+    for (int i = 0; i < RBIAS_SLOTS; ++i) {
+        if (atomic_load_explicit(&record->slots[i], memory_order_relaxed))
+            continue;
+        atomic_store_explicit(&record->slots[i], lock, memory_order_relaxed);
+        // Pairs with the fence in rbias_revoke_slow (as in Dekker's
+        // algorithm): either the writer sees our slot and waits for us, or we
+        // see the bias turned off.
+        atomic_thread_fence(memory_order_seq_cst);
+        // Acquire: the reader that turned the bias on had the underlying
+        // lock after the last writer.
+        if (atomic_load_explicit(&bias->biased, memory_order_acquire)) {
+            rbias_held++;
+            return true;
+        }
+        atomic_store_explicit(&record->slots[i], NULL, memory_order_relaxed);
+        return false;
+    }
+    return false;
+}
+
+bool rbias_read_unlock_slow(const void* lock)
+{
+    Record* record = self;
+    for (int i = 0; i < RBIAS_SLOTS; ++i) {
+        if (atomic_load_explicit(&record->slots[i], memory_order_relaxed) == lock) {
+            atomic_store_explicit(&record->slots[i], NULL, memory_order_release);
+            rbias_held--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void rbias_revoke_slow(ReaderBias* bias, const void* lock)
+{
+    uint64_t start = now();
+    atomic_store_explicit(&bias->biased, false, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (Record* record = atomic_load(&records); record; record = record->next) {
+        for (int i = 0; i < RBIAS_SLOTS; ++i) {
+            while (atomic_load_explicit(&record->slots[i], memory_order_acquire) == lock)
+                sched_yield();
+        }
+    }
+    uint64_t end = now();
+    uint64_t inhibit = RBIAS_INHIBIT_FACTOR * (end - start);
+    if (inhibit < RBIAS_MIN_INHIBIT_NS)
+        inhibit = RBIAS_MIN_INHIBIT_NS;
+    atomic_store_explicit(&bias->inhibit_until, end + inhibit, memory_order_relaxed);
+}
+
+bool rbias_try_revoke_slow(ReaderBias* bias, const void* lock)
+{
+    atomic_store_explicit(&bias->biased, false, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    // Keep the bias off for a while, so the caller's next attempt does not
+    // meet new biased readers.
+    atomic_store_explicit(&bias->inhibit_until, now() + RBIAS_MIN_INHIBIT_NS,
+                          memory_order_relaxed);
+    for (Record* record = atomic_load(&records); record; record = record->next) {
+        for (int i = 0; i < RBIAS_SLOTS; ++i) {
+            if (atomic_load_explicit(&record->slots[i], memory_order_acquire) == lock)
+                return false;
+        }
+    }
+    return true;
+}
+
+void rbias_enable_slow(ReaderBias* bias)
+{
+    // The writer that set inhibit_until released the underlying lock before
+    // we took it, so we see its value.
+    if (now() < atomic_load_explicit(&bias->inhibit_until, memory_order_relaxed))
+        return;
+    atomic_store_explicit(&bias->biased, true, memory_order_release);
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Reader bias for a reader-writer lock (after BRAVO, Dice and Kogan 2019).
+//
+// A biased lock lets readers in without touching the lock word: a reader
+// publishes the lock's address in a free slot of its own thread's record
+// (one cache line that only this thread writes) and, if the bias is still
+// on, holds the lock. A writer first takes the underlying lock as usual,
+// which keeps new readers on the slow path out, then turns the bias off
+// ("revokes" it) and waits until no record holds the lock's address.
+//
+// Revocation scans the records of all threads, so it is much more
+// expensive than a plain write lock. After a revocation the bias stays off
+// for RBIAS_INHIBIT_FACTOR times as long as the revocation took (at least
+// RBIAS_MIN_INHIBIT_NS): locks that are written often spend most of their
+// time unbiased, so the bias follows the observed read/write ratio.
+//
+// The underlying lock is the caller's; the functions below only take its
+// address as a key. A thread may hold up to RBIAS_SLOTS locks biased at a
+// time; beyond that readers take the slow path.
+
+#define RBIAS_SLOTS 8
+#define RBIAS_INHIBIT_FACTOR 9
+#define RBIAS_MIN_INHIBIT_NS 100000
+
+typedef struct {
+    atomic_bool biased;
+    atomic_ullong inhibit_until; // CLOCK_MONOTONIC ns before which the bias stays off.
+} ReaderBias;
+
+static inline void rbias_init(ReaderBias* bias)
+{
+    atomic_init(&bias->biased, false);
+    atomic_init(&bias->inhibit_until, 0);
+}
+
+// Number of locks this thread holds biased.
+extern _Thread_local unsigned int rbias_held;
+
+// Slow paths, see rbias.c.
+bool rbias_read_lock_slow(ReaderBias* bias, const void* lock);
+bool rbias_read_unlock_slow(const void* lock);
+void rbias_revoke_slow(ReaderBias* bias, const void* lock);
+bool rbias_try_revoke_slow(ReaderBias* bias, const void* lock);
+void rbias_enable_slow(ReaderBias* bias);
+
+// Try to enter `lock` as a biased reader. Returns whether it did; if not,
+// the caller takes the underlying read lock.
+static inline bool rbias_read_lock(ReaderBias* bias, const void* lock)
+{
+    if (!atomic_load_explicit(&bias->biased, memory_order_relaxed))
+        return false;
+    return rbias_read_lock_slow(bias, lock);
+}
+
+// Leave `lock` if this thread holds it biased. Returns whether it did; if
+// not, the caller releases the underlying read lock.
+static inline bool rbias_read_unlock(const void* lock)
+{
+    return rbias_held && rbias_read_unlock_slow(lock);
+}
+
+// Called by a writer right after taking the underlying write lock: turns
+// the bias off and waits for the biased readers to leave.
+static inline void rbias_revoke(ReaderBias* bias, const void* lock)
+{
+    if (atomic_load_explicit(&bias->biased, memory_order_relaxed))
+        rbias_revoke_slow(bias, lock);
+}
+
+// Like rbias_revoke, but does not wait: returns false if biased readers
+// are still inside. The bias stays off either way.
+static inline bool rbias_try_revoke(ReaderBias* bias, const void* lock)
+{
+    if (!atomic_load_explicit(&bias->biased, memory_order_relaxed))
+        return true;
+    return rbias_try_revoke_slow(bias, lock);
+}
+
+// Called by a reader holding the underlying read lock (so no writer is
+// inside): turns the bias on, unless a recent revocation inhibits it.
+static inline void rbias_enable(ReaderBias* bias)
+{
+    if (!atomic_load_explicit(&bias->biased, memory_order_relaxed))
+        rbias_enable_slow(bias);
+}
@@ -0,0 +1,139 @@
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "rwlock.h"
+
+// Readers and writers sleep on the state word itself; the bitsets let an
+// unlock wake only the kind of thread that can make progress.
+#define WAKE_READERS 1u
+#define WAKE_WRITERS 2u
+
+static void futex_wait(RWLock* lock, unsigned int state, unsigned int bitset)
+{
+    // Returns immediately if the word no longer holds `state`, so a wake-up
+    // sent after the caller read the state is never lost.
+    if (syscall(SYS_futex, &lock->state, FUTEX_WAIT_BITSET_PRIVATE, state, NULL, NULL,
+                bitset) != 0 &&
+        errno != EAGAIN && errno != EINTR)
+        syserr("futex wait failed");
+}
+
+static void futex_wake(RWLock* lock, int count, unsigned int bitset)
+{
+    if (syscall(SYS_futex, &lock->state, FUTEX_WAKE_BITSET_PRIVATE, count, NULL, NULL,
+                bitset) < 0)
+        syserr("futex wake failed");
+}
+
+// Whether a writer may enter in `state`. Writers never enter during a read
+// phase, which is what lets the readers admitted by the last writer through.
+static bool writer_may_enter(unsigned int state)
+{
+    return !(state & (RWLOCK_WRITER | RWLOCK_READERS_MASK | RWLOCK_READ_PHASE));
+}
+
+// Called by whoever drops the last active reader.
+static void wake_writer_if_free(RWLock* lock, unsigned int state)
+{
+    if ((state & RWLOCK_WAITING_WRITERS_MASK) && writer_may_enter(state))
+        futex_wake(lock, 1, WAKE_WRITERS);
+}
+
+void rwlock_read_lock_slow(RWLock* lock)
+{
+    // The fast path has already counted us as an active reader. Either
+    // turn that into a waiting reader or, if the lock became free for
+    // readers in the meantime, keep it.
+    unsigned int state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    unsigned int new_state;
+    do {
+        if ((state & RWLOCK_READERS_MASK) == 0)
+            fatal("Too many readers on a lock.");
+        if (rwlock_reader_may_enter(state - RWLOCK_READER))
+            return;
+        if ((state & RWLOCK_WAITING_READERS_MASK) == RWLOCK_WAITING_READERS_MASK)
+            fatal("Too many readers waiting on a lock.");
+        new_state = state - RWLOCK_READER + RWLOCK_WAITING_READER;
+    } while (!atomic_compare_exchange_weak_explicit(&lock->state, &state, new_state,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+    // A writer may have gone to sleep seeing our transient reader count.
+    if ((new_state & RWLOCK_READERS_MASK) == 0)
+        wake_writer_if_free(lock, new_state);
+
+    state = new_state;
+    for (;;) {
+        futex_wait(lock, state, WAKE_READERS);
+        state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+        while (rwlock_reader_may_enter(state)) {
+            new_state = state - RWLOCK_WAITING_READER + RWLOCK_READER;
+            // The last reader of the group ends the read phase.
+            if (!(new_state & RWLOCK_WAITING_READERS_MASK))
+                new_state &= ~RWLOCK_READ_PHASE;
+            if (atomic_compare_exchange_weak_explicit(&lock->state, &state, new_state,
+                                                      memory_order_acquire,
+                                                      memory_order_relaxed))
+                return;
+        }
+    }
+}
+
+void rwlock_read_unlock_slow(RWLock* lock)
+{
+    // The fast path has already left; a writer is waiting for it.
+    wake_writer_if_free(lock, atomic_load_explicit(&lock->state, memory_order_relaxed));
+}
+
+void rwlock_write_lock_slow(RWLock* lock)
+{
+    unsigned int state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    bool waiting = false; // Whether we are counted as a waiting writer.
+    for (;;) {
+        if (writer_may_enter(state)) {
+            unsigned int new_state = state | RWLOCK_WRITER;
+            if (waiting)
+                new_state -= RWLOCK_WAITING_WRITER;
+            if (atomic_compare_exchange_weak_explicit(&lock->state, &state, new_state,
+                                                      memory_order_acquire,
+                                                      memory_order_relaxed))
+                return;
+            continue;
+        }
+        if (!waiting) {
+            if ((state & RWLOCK_WAITING_WRITERS_MASK) == RWLOCK_WAITING_WRITERS_MASK)
+                fatal("Too many writers waiting on a lock.");
+            // From now on arriving readers queue up behind us.
+            if (!atomic_compare_exchange_weak_explicit(&lock->state, &state,
+                                                       state + RWLOCK_WAITING_WRITER,
+                                                       memory_order_relaxed,
+                                                       memory_order_relaxed))
+                continue;
+            state += RWLOCK_WAITING_WRITER;
+            waiting = true;
+        }
+        futex_wait(lock, state, WAKE_WRITERS);
+        state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    }
+}
+
+void rwlock_write_unlock_slow(RWLock* lock)
+{
+    unsigned int state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    unsigned int new_state;
+    do {
+        new_state = state & ~RWLOCK_WRITER;
+        // Readers that waited for us go first, all of them together.
+        if (state & RWLOCK_WAITING_READERS_MASK)
+            new_state |= RWLOCK_READ_PHASE;
+    } while (!atomic_compare_exchange_weak_explicit(&lock->state, &state, new_state,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    if (new_state & RWLOCK_READ_PHASE)
+        futex_wake(lock, INT_MAX, WAKE_READERS);
+    else if (new_state & RWLOCK_WAITING_WRITERS_MASK)
+        futex_wake(lock, 1, WAKE_WRITERS);
+}
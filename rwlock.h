@@ -0,0 +1,109 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// A reader-writer lock in a single 32-bit word, sleeping on a futex when
+// contended.
+//
+// Fairness is that of the Tree reader/writer protocols: a reader that
+// arrives while a writer is active or waiting waits, so writers do not
+// starve; when a writer leaves and readers are waiting, all of them are
+// admitted as a group (a "read phase") before the next writer.
+//
+// Uncontended read_lock, read_unlock, write_lock and write_unlock are each a
+// single atomic read-modify-write.
+//
+// Limits: 2047 concurrent readers, 1023 waiting readers and 511 waiting
+// writers per lock.
+typedef struct {
+    atomic_uint state;
+} RWLock;
+
+// Layout of the state word.
+#define RWLOCK_READER 1u // Active readers, bits 0-10.
+#define RWLOCK_READERS_MASK 0x7ffu
+#define RWLOCK_WAITING_READER (1u << 11) // Waiting readers, bits 11-20.
+#define RWLOCK_WAITING_READERS_MASK (0x3ffu << 11)
+#define RWLOCK_WAITING_WRITER (1u << 21) // Waiting writers, bits 21-29.
+#define RWLOCK_WAITING_WRITERS_MASK (0x1ffu << 21)
+#define RWLOCK_WRITER (1u << 30) // A writer is active.
+#define RWLOCK_READ_PHASE (1u << 31) // Waiting readers are being admitted.
+
+static inline void rwlock_init(RWLock* lock)
+{
+    atomic_init(&lock->state, 0);
+}
+
+// Slow paths, see rwlock.c.
+void rwlock_read_lock_slow(RWLock* lock);
+void rwlock_read_unlock_slow(RWLock* lock);
+void rwlock_write_lock_slow(RWLock* lock);
+void rwlock_write_unlock_slow(RWLock* lock);
+
+// Whether a reader may enter in `state`.
+static inline bool rwlock_reader_may_enter(unsigned int state)
+{
+    return !(state & RWLOCK_WRITER) &&
+           (!(state & RWLOCK_WAITING_WRITERS_MASK) || (state & RWLOCK_READ_PHASE));
+}
+
+static inline void rwlock_read_lock(RWLock* lock)
+{
+    unsigned int state = atomic_fetch_add_explicit(&lock->state, RWLOCK_READER,
+                                                   memory_order_acquire);
+    if (!rwlock_reader_may_enter(state) ||
+        (state & RWLOCK_READERS_MASK) == RWLOCK_READERS_MASK)
+        rwlock_read_lock_slow(lock);
+}
+
+// Enter as a reader only if that needs no waiting. Returns whether it did.
+static inline bool rwlock_try_read_lock(RWLock* lock)
+{
+    unsigned int state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    while (rwlock_reader_may_enter(state) &&
+           (state & RWLOCK_READERS_MASK) != RWLOCK_READERS_MASK) {
+        if (atomic_compare_exchange_weak_explicit(&lock->state, &state,
+                                                  state + RWLOCK_READER,
+                                                  memory_order_acquire,
+                                                  memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+static inline void rwlock_read_unlock(RWLock* lock)
+{
+    unsigned int state = atomic_fetch_sub_explicit(&lock->state, RWLOCK_READER,
+                                                   memory_order_release);
+    // The last reader hands the lock over to a waiting writer.
+    if ((state & RWLOCK_READERS_MASK) == RWLOCK_READER &&
+        (state & RWLOCK_WAITING_WRITERS_MASK))
+        rwlock_read_unlock_slow(lock);
+}
+
+static inline void rwlock_write_lock(RWLock* lock)
+{
+    unsigned int expected = 0;
+    if (!atomic_compare_exchange_strong_explicit(&lock->state, &expected, RWLOCK_WRITER,
+                                                 memory_order_acquire,
+                                                 memory_order_relaxed))
+        rwlock_write_lock_slow(lock);
+}
+
+// Enter as the writer only if the lock is free. Returns whether it did.
+static inline bool rwlock_try_write_lock(RWLock* lock)
+{
+    unsigned int expected = 0;
+    return atomic_compare_exchange_strong_explicit(&lock->state, &expected, RWLOCK_WRITER,
+                                                   memory_order_acquire,
+                                                   memory_order_relaxed);
+}
+
+static inline void rwlock_write_unlock(RWLock* lock)
+{
+    unsigned int expected = RWLOCK_WRITER;
+    if (!atomic_compare_exchange_strong_explicit(&lock->state, &expected, 0,
+                                                 memory_order_release,
+                                                 memory_order_relaxed))
+        rwlock_write_unlock_slow(lock);
+}
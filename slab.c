@@ -0,0 +1,192 @@
+#include <stdlib.h>
+
+#include "slab.h"
+#include "err.h"
+
+#ifdef TREE_USE_SLAB
+
+// Maximum number of distinct caches in the program.
+#define SLAB_MAX_CACHES 32
+
+// Objects moved between a thread and its cache at once.
+#define SLAB_BATCH 64
+
+// Minimal size of a chunk carved into objects.
+#define SLAB_CHUNK_SIZE (64 * 1024)
+
+// A free object. In a batch held by the cache, the first object also links
+// to the next batch.
+typedef struct FreeObject FreeObject;
+
+struct FreeObject {
+    FreeObject* next;
+    FreeObject* next_batch;
+};
+
+typedef struct {
+    FreeObject* head;
+    size_t count;
+} FreeList;
+
+static _Thread_local FreeList local_lists[SLAB_MAX_CACHES];
+
+static atomic_int n_caches = 0;
+static SlabCache* caches[SLAB_MAX_CACHES];
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+static void push_batch(SlabCache* cache, FreeObject* batch)
+{
+    if (pthread_mutex_lock(&cache->lock) != 0)
+        syserr("lock failed");
+    batch->next_batch = cache->batches;
+    cache->batches = batch;
+    if (pthread_mutex_unlock(&cache->lock) != 0)
+        syserr("mutex unlock failed");
+}
+
+// Give everything cached by an exiting thread back to the caches.
+static void flush_thread(void* unused)
+{
+    (void)unused;
+    int n = atomic_load(&n_caches);
+    for (int i = 0; i < n; ++i) {
+        if (local_lists[i].head)
+            push_batch(caches[i], local_lists[i].head);
+        local_lists[i].head = NULL;
+        local_lists[i].count = 0;
+    }
+}
+
+static void make_key(void)
+{
+    if (pthread_key_create(&thread_key, flush_thread) != 0)
+        syserr("pthread_key_create failed");
+}
+
+static int cache_id(SlabCache* cache)
+{
+    int id = atomic_load_explicit(&cache->id, memory_order_acquire);
+    if (id >= 0)
+        return id;
+    if (pthread_mutex_lock(&cache->lock) != 0)
+        syserr("lock failed");
+    id = atomic_load_explicit(&cache->id, memory_order_relaxed);
+    if (id < 0) {
+        id = atomic_fetch_add(&n_caches, 1);
+        if (id >= SLAB_MAX_CACHES)
+            fatal("Too many slab caches.");
+        caches[id] = cache;
+        // Objects are at least two pointers big and pointer aligned; with
+        // sizes rounded to the alignment, aligned chunks give aligned objects.
+        if (cache->object_size < sizeof(FreeObject))
+            cache->object_size = sizeof(FreeObject);
+        if (cache->alignment < 16)
+            cache->alignment = 16;
+        cache->object_size = (cache->object_size + cache->alignment - 1) & ~(cache->alignment - 1);
+        atomic_store_explicit(&cache->id, id, memory_order_release);
+    }
+    if (pthread_mutex_unlock(&cache->lock) != 0)
+        syserr("mutex unlock failed");
+    return id;
+}
+
+// Fill an empty thread list with one batch, taken from the cache or carved
+// from a chunk.
+static void refill(SlabCache* cache, FreeList* list)
+{
+    if (pthread_once(&key_once, make_key) != 0)
+        syserr("pthread_once failed");
+    // Registers flush_thread for this thread; the value only has to be non-NULL.
+    if (pthread_setspecific(thread_key, local_lists) != 0)
+        syserr("pthread_setspecific failed");
+
+    if (pthread_mutex_lock(&cache->lock) != 0)
+        syserr("lock failed");
+    FreeObject* batch = cache->batches;
+    if (batch) {
+        cache->batches = batch->next_batch;
+        list->head = batch;
+        // Batches flushed by exiting threads can have any length.
+        list->count = 0;
+        for (FreeObject* object = batch; object; object = object->next)
+            list->count++;
+    } else {
+        size_t size = cache->object_size;
+        if (cache->chunk_left < size * SLAB_BATCH) {
+            size_t chunk_size = size * SLAB_BATCH;
+            if (chunk_size < SLAB_CHUNK_SIZE)
+                chunk_size = SLAB_CHUNK_SIZE;
+            cache->chunk = aligned_alloc(cache->alignment, chunk_size);
+            if (!cache->chunk)
+                fatal("Malloc failure.");
+            cache->chunk_left = chunk_size;
+        }
+        FreeObject* head = NULL;
+        for (int i = 0; i < SLAB_BATCH; ++i) {
+            FreeObject* object = (FreeObject*)cache->chunk;
+            cache->chunk += size;
+            cache->chunk_left -= size;
+            object->next = head;
+            head = object;
+        }
+        list->head = head;
+        list->count = SLAB_BATCH;
+    }
+    if (pthread_mutex_unlock(&cache->lock) != 0)
+        syserr("mutex unlock failed");
+}
+
+void* slab_alloc(SlabCache* cache)
+{
+    FreeList* list = &local_lists[cache_id(cache)];
+    if (!list->head)
+        refill(cache, list);
+    FreeObject* object = list->head;
+    list->head = object->next;
+    list->count--;
+    return object;
+}
+
+void slab_free(SlabCache* cache, void* object)
+{
+    if (!object)
+        return;
+    FreeList* list = &local_lists[cache_id(cache)];
+    FreeObject* freed = object;
+    freed->next = list->head;
+    list->head = freed;
+    if (++list->count < 2 * SLAB_BATCH)
+        return;
+
+    // Keep one batch locally and give the rest back.
+    FreeObject* last = list->head;
+    for (int i = 1; i < SLAB_BATCH; ++i)
+        last = last->next;
+    FreeObject* batch = last->next;
+    last->next = NULL;
+    list->count = SLAB_BATCH;
+    push_batch(cache, batch);
+}
+
+#else // !TREE_USE_SLAB
+
+void* slab_alloc(SlabCache* cache)
+{
+    size_t alignment = cache->alignment;
+    void* object = alignment <= _Alignof(max_align_t)
+        ? malloc(cache->object_size)
+        : aligned_alloc(alignment, (cache->object_size + alignment - 1) & ~(alignment - 1));
+    if (!object)
+        fatal("Malloc failure.");
+    return object;
+}
+
+void slab_free(SlabCache* cache, void* object)
+{
+    (void)cache;
+    free(object);
+}
+
+#endif
@@ -0,0 +1,40 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// A thread-caching allocator for fixed-size objects.
+// Every thread keeps a private free list per cache, so allocation and freeing
+// normally touch no shared state. Lists that grow too long are handed back
+// to the cache in batches, and empty lists are refilled with whole batches.
+// Memory is carved from large chunks and never returned to the system.
+//
+// When built without TREE_USE_SLAB, slab_alloc and slab_free are plain
+// malloc and free, which makes the allocator easy to A/B.
+typedef struct SlabCache SlabCache;
+
+// Static initializer for a cache of objects of `size` bytes:
+//     static SlabCache cache = SLAB_CACHE_INITIALIZER(sizeof(Foo));
+#define SLAB_CACHE_INITIALIZER(size) \
+    SLAB_CACHE_ALIGNED_INITIALIZER(size, _Alignof(max_align_t))
+
+// The same for objects that need a stricter (power of two) alignment:
+//     static SlabCache cache = SLAB_CACHE_ALIGNED_INITIALIZER(sizeof(Foo), _Alignof(Foo));
+#define SLAB_CACHE_ALIGNED_INITIALIZER(size, alignment) \
+    { (size), (alignment), PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, -1 }
+
+// Return an uninitialized object from `cache`. Never returns NULL.
+void* slab_alloc(SlabCache* cache);
+
+// Return `object` (allocated from `cache` by any thread) to the cache.
+void slab_free(SlabCache* cache, void* object);
+
+struct SlabCache {
+    size_t object_size;
+    size_t alignment;
+    pthread_mutex_t lock; // Protects the fields below.
+    void* batches; // Full batches returned by threads.
+    char* chunk; // Unused tail of the last chunk.
+    size_t chunk_left;
+    atomic_int id; // Index of the per-thread free list, -1 until first use.
+};
@@ -0,0 +1,472 @@
+// Multi-threaded workload benchmark of the Tree operations.
+//
+// Builds a complete tree of the given depth and fan-out, then runs threads
+// for a fixed time, each picking operations from a weighted mix and target
+// folders with uniform or Zipfian popularity. Creates and removes work on a
+// few leaf names below the chosen folder and moves carry such a leaf
+// between two chosen folders, so the shape of the tree stays the same
+// during the run. Reports throughput and p50/p99/p999 latency per
+// operation type, as a table and optionally as JSON.
+//
+// Usage: tree_bench [-t threads] [-d seconds] [-m mix] [-D depth]
+//                   [-F fan-out] [-z theta] [-s seed] [-b levels] [-j file]
+// where mix is a list like "list=70,create=10,remove=10,move=10" and a
+// theta of 0 means uniform popularity. -b turns on reader bias
+// (tree_set_reader_bias) in the given number of top levels. "-j -" writes
+// JSON to stdout.
+// Built with TREE_CONTENTION_STATS, it also lists the most contended
+// folders.
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Tree.h"
+#include "err.h"
+#include "latency.h"
+
+#define MAX_THREADS 256
+#define MAX_DEPTH 32
+#define MAX_FOLDERS 20000000
+#define PATH_CAPACITY 512
+#define REPORT_FOLDERS 10
+
+// Leaf names used by creates, removes and moves. Folders of the prebuilt
+// tree use only 'a'-'y', so they never collide with a leaf.
+#define LEAVES 4
+
+typedef enum { OP_LIST, OP_CREATE, OP_REMOVE, OP_MOVE, N_OPS } OpType;
+
+static const char* op_names[N_OPS] = { "list", "create", "remove", "move" };
+
+typedef struct {
+    int threads;
+    double seconds;
+    unsigned weights[N_OPS];
+    int depth;
+    int fanout;
+    double theta;
+    unsigned long long seed;
+    int bias;
+    const char* json;
+} Config;
+
+typedef struct {
+    unsigned long long rng;
+    uint64_t count[N_OPS];
+    uint64_t ok[N_OPS];
+    LatencyHistogram latency[N_OPS]; // see latency.h
+} Worker;
+
+static Config config = {
+    .threads = 4,
+    .seconds = 5,
+    .weights = { 70, 10, 10, 10 },
+    .depth = 3,
+    .fanout = 10,
+    .theta = 0,
+    .seed = 1,
+    .json = NULL,
+};
+
+static Tree* tree;
+static char** folders; // Paths of all prebuilt folders except "/".
+static size_t n_folders;
+static size_t* by_rank; // by_rank[r] is the folder of popularity rank r.
+static double* zipf_cdf; // NULL for uniform popularity.
+static unsigned total_weight;
+static pthread_barrier_t start_barrier;
+static atomic_bool stop;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        syserr("clock_gettime failed");
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// xorshift64*, good enough for picking operations and paths.
+static unsigned long long next_random(unsigned long long* state)
+{
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+// Write the name of the `i`-th child of a folder, in base 25 with 'a'-'y'.
+static size_t child_name(char* name, size_t i)
+{
+    char digits[16];
+    size_t n = 0;
+    do {
+        digits[n++] = 'a' + i % 25;
+        i /= 25;
+    } while (i);
+    for (size_t k = 0; k < n; ++k)
+        name[k] = digits[n - 1 - k];
+    return n;
+}
+
+// Fill `folders` with the paths of a complete tree, level by level.
+static void make_folders(void)
+{
+    size_t level_size = 1, total = 0;
+    for (int d = 0; d < config.depth; ++d) {
+        level_size *= config.fanout;
+        total += level_size;
+        if (total > MAX_FOLDERS)
+            fatal("Tree of depth %d and fan-out %d is too large.", config.depth,
+                  config.fanout);
+    }
+    folders = malloc(total * sizeof(char*));
+    if (!folders)
+        fatal("Malloc failure.");
+    size_t level_begin = 0, level_end = 0;
+    for (int d = 0; d < config.depth; ++d) {
+        size_t parents_begin = level_begin, parents_end = level_end;
+        level_begin = n_folders;
+        for (size_t p = parents_begin; p < (d ? parents_end : 1); ++p) {
+            const char* parent = d ? folders[p] : "/";
+            size_t length = strlen(parent);
+            for (int c = 0; c < config.fanout; ++c) {
+                char* path = malloc(length + 18);
+                if (!path)
+                    fatal("Malloc failure.");
+                memcpy(path, parent, length);
+                size_t name_length = child_name(path + length, c);
+                path[length + name_length] = '/';
+                path[length + name_length + 1] = '\0';
+                folders[n_folders++] = path;
+            }
+        }
+        level_end = n_folders;
+    }
+}
+
+// Assign popularity ranks to folders in random order, so that hot folders
+// are spread over the tree, and precompute the Zipf distribution of ranks.
+static void make_popularity(void)
+{
+    by_rank = malloc(n_folders * sizeof(size_t));
+    if (!by_rank)
+        fatal("Malloc failure.");
+    unsigned long long rng = config.seed * 0x9e3779b97f4a7c15ULL + 1;
+    for (size_t i = 0; i < n_folders; ++i) {
+        size_t j = next_random(&rng) % (i + 1);
+        by_rank[i] = by_rank[j];
+        by_rank[j] = i;
+    }
+    if (config.theta <= 0)
+        return;
+    zipf_cdf = malloc(n_folders * sizeof(double));
+    if (!zipf_cdf)
+        fatal("Malloc failure.");
+    double sum = 0;
+    for (size_t i = 0; i < n_folders; ++i) {
+        sum += pow(i + 1, -config.theta);
+        zipf_cdf[i] = sum;
+    }
+    for (size_t i = 0; i < n_folders; ++i)
+        zipf_cdf[i] /= sum;
+}
+
+static const char* pick_folder(unsigned long long* rng)
+{
+    size_t rank;
+    if (!zipf_cdf) {
+        rank = next_random(rng) % n_folders;
+    } else {
+        double u = (next_random(rng) >> 11) * 0x1p-53;
+        size_t low = 0, high = n_folders - 1;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (zipf_cdf[middle] < u)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        rank = low;
+    }
+    return folders[by_rank[rank]];
+}
+
+static OpType pick_op(unsigned long long* rng)
+{
+    unsigned r = next_random(rng) % total_weight;
+    int op = 0;
+    while (r >= config.weights[op])
+        r -= config.weights[op++];
+    return op;
+}
+
+static void leaf_path(char* path, const char* folder, unsigned long long* rng)
+{
+    size_t length = strlen(folder);
+    memcpy(path, folder, length);
+    path[length] = 'z';
+    path[length + 1] = 'a' + next_random(rng) % LEAVES;
+    path[length + 2] = '/';
+    path[length + 3] = '\0';
+}
+
+static void* worker_main(void* arg)
+{
+    Worker* worker = arg;
+    char path[PATH_CAPACITY], target[PATH_CAPACITY];
+    pthread_barrier_wait(&start_barrier);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        OpType op = pick_op(&worker->rng);
+        const char* folder = pick_folder(&worker->rng);
+        bool ok;
+        double start;
+        switch (op) {
+        case OP_LIST: {
+            start = now_ns();
+            char* list = tree_list(tree, folder);
+            ok = list != NULL;
+            free(list);
+            break;
+        }
+        case OP_CREATE:
+            leaf_path(path, folder, &worker->rng);
+            start = now_ns();
+            ok = tree_create(tree, path) == 0;
+            break;
+        case OP_REMOVE:
+            leaf_path(path, folder, &worker->rng);
+            start = now_ns();
+            ok = tree_remove(tree, path) == 0;
+            break;
+        default:
+            leaf_path(path, folder, &worker->rng);
+            strcpy(target, pick_folder(&worker->rng));
+            strcat(target, path + strlen(folder));
+            start = now_ns();
+            ok = tree_move(tree, path, target) == 0;
+            break;
+        }
+        latency_add(&worker->latency[op], (uint64_t)(now_ns() - start));
+        worker->count[op]++;
+        worker->ok[op] += ok;
+    }
+    return NULL;
+}
+
+static void parse_mix(const char* mix)
+{
+    memset(config.weights, 0, sizeof(config.weights));
+    char* copy = strdup(mix);
+    if (!copy)
+        fatal("Malloc failure.");
+    char* save = NULL;
+    for (char* item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char* equals = strchr(item, '=');
+        if (!equals)
+            fatal("Bad mix entry \"%s\", expected name=weight.", item);
+        *equals = '\0';
+        int op = 0;
+        while (op < N_OPS && strcmp(item, op_names[op]) != 0)
+            op++;
+        if (op == N_OPS)
+            fatal("Unknown operation \"%s\" in mix.", item);
+        config.weights[op] = (unsigned)strtoul(equals + 1, NULL, 10);
+    }
+    free(copy);
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-d seconds] [-m mix] [-D depth] [-F fan-out]\n"
+            "          [-z theta] [-s seed] [-b levels] [-j file]\n"
+            "  -m  operation weights, default list=70,create=10,remove=10,move=10\n"
+            "  -z  Zipf exponent of folder popularity, 0 (default) for uniform\n"
+            "  -b  reader bias in this many top levels of the tree, default 0\n"
+            "  -j  also write results as JSON to file (\"-\" for stdout)\n",
+            program);
+    exit(1);
+}
+
+static void parse_args(int argc, char** argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:m:D:F:z:s:b:j:h")) != -1) {
+        switch (opt) {
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 'd':
+            config.seconds = atof(optarg);
+            break;
+        case 'm':
+            parse_mix(optarg);
+            break;
+        case 'D':
+            config.depth = atoi(optarg);
+            break;
+        case 'F':
+            config.fanout = atoi(optarg);
+            break;
+        case 'z':
+            config.theta = atof(optarg);
+            break;
+        case 's':
+            config.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            config.bias = atoi(optarg);
+            break;
+        case 'j':
+            config.json = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || config.threads < 1 || config.threads > MAX_THREADS ||
+        config.seconds <= 0 || config.depth < 1 || config.depth > MAX_DEPTH ||
+        config.fanout < 1 || config.theta < 0 || config.bias < 0)
+        usage(argv[0]);
+    for (int op = 0; op < N_OPS; ++op)
+        total_weight += config.weights[op];
+    if (!total_weight)
+        fatal("The operation mix is empty.");
+}
+
+static void write_json(FILE* out, const LatencyHistogram* latency, const uint64_t* count,
+                       const uint64_t* ok, double elapsed)
+{
+    uint64_t total = 0;
+    for (int op = 0; op < N_OPS; ++op)
+        total += count[op];
+    fprintf(out, "{\n  \"config\": {\"threads\": %d, \"seconds\": %g, \"depth\": %d, "
+                 "\"fanout\": %d, \"folders\": %zu, \"theta\": %g, \"seed\": %llu, "
+                 "\"bias\": %d, \"mix\": {",
+            config.threads, config.seconds, config.depth, config.fanout, n_folders,
+            config.theta, config.seed, config.bias);
+    for (int op = 0; op < N_OPS; ++op)
+        fprintf(out, "%s\"%s\": %u", op ? ", " : "", op_names[op], config.weights[op]);
+    fprintf(out, "}},\n  \"elapsed_s\": %.6f,\n  \"ops\": %llu,\n  \"ops_per_sec\": %.1f,\n"
+                 "  \"by_op\": {\n",
+            elapsed, (unsigned long long)total, total / elapsed);
+    for (int op = 0; op < N_OPS; ++op) {
+        fprintf(out, "    \"%s\": {\"ops\": %llu, \"ok\": %llu, \"ops_per_sec\": %.1f, "
+                     "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}%s\n",
+                op_names[op], (unsigned long long)count[op], (unsigned long long)ok[op],
+                count[op] / elapsed,
+                (unsigned long long)latency_quantile(&latency[op], 0.5),
+                (unsigned long long)latency_quantile(&latency[op], 0.99),
+                (unsigned long long)latency_quantile(&latency[op], 0.999),
+                op < N_OPS - 1 ? "," : "");
+    }
+    fprintf(out, "  }\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+    parse_args(argc, argv);
+    make_folders();
+    make_popularity();
+
+    tree = tree_new();
+    if (tree_bulk_load(tree, (const char**)folders, n_folders, config.threads) != n_folders)
+        fatal("Could not build the tree.");
+    tree_set_reader_bias(tree, config.bias);
+
+    Worker* workers = calloc(config.threads, sizeof(Worker));
+    pthread_t* threads = malloc(config.threads * sizeof(pthread_t));
+    if (!workers || !threads)
+        fatal("Malloc failure.");
+    if (pthread_barrier_init(&start_barrier, NULL, config.threads + 1) != 0)
+        syserr("pthread_barrier_init failed");
+    for (int i = 0; i < config.threads; ++i) {
+        workers[i].rng = (config.seed + i + 1) * 0x9e3779b97f4a7c15ULL;
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0)
+            syserr("pthread_create failed");
+    }
+    pthread_barrier_wait(&start_barrier);
+    double start = now_ns();
+    struct timespec duration = { (time_t)config.seconds,
+                                 (long)((config.seconds - (time_t)config.seconds) * 1e9) };
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR)
+        ;
+    atomic_store(&stop, true);
+    for (int i = 0; i < config.threads; ++i) {
+        if (pthread_join(threads[i], NULL) != 0)
+            syserr("pthread_join failed");
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    static LatencyHistogram latency[N_OPS];
+    uint64_t count[N_OPS] = { 0 }, ok[N_OPS] = { 0 }, total = 0;
+    for (int i = 0; i < config.threads; ++i) {
+        for (int op = 0; op < N_OPS; ++op) {
+            count[op] += workers[i].count[op];
+            ok[op] += workers[i].ok[op];
+            latency[op].count += workers[i].latency[op].count;
+            latency[op].sum_ns += workers[i].latency[op].sum_ns;
+            for (int b = 0; b < LATENCY_BUCKETS; ++b)
+                latency[op].buckets[b] += workers[i].latency[op].buckets[b];
+        }
+    }
+
+    printf("%d threads, %zu folders (depth %d, fan-out %d), %s popularity, %.2f s\n",
+           config.threads, n_folders, config.depth, config.fanout,
+           config.theta > 0 ? "Zipfian" : "uniform", elapsed);
+    printf("%-8s %12s %12s %6s %10s %10s %10s\n", "op", "ops", "ops/s", "ok%", "p50 us",
+           "p99 us", "p999 us");
+    for (int op = 0; op < N_OPS; ++op) {
+        total += count[op];
+        if (!count[op])
+            continue;
+        printf("%-8s %12llu %12.0f %6.1f %10.2f %10.2f %10.2f\n", op_names[op],
+               (unsigned long long)count[op], count[op] / elapsed, 100.0 * ok[op] / count[op],
+               latency_quantile(&latency[op], 0.5) / 1e3,
+               latency_quantile(&latency[op], 0.99) / 1e3,
+               latency_quantile(&latency[op], 0.999) / 1e3);
+    }
+    printf("%-8s %12llu %12.0f\n", "total", (unsigned long long)total, total / elapsed);
+
+    // Only built with TREE_CONTENTION_STATS.
+    TreeContention* report = tree_contention_report(tree, REPORT_FOLDERS);
+    if (report && report[0].path) {
+        printf("\n%-24s %12s %10s %12s %12s\n", "most contended", "entries", "waits",
+               "wait ms", "max wait us");
+        for (TreeContention* entry = report; entry->path; ++entry)
+            printf("%-24s %12llu %10llu %12.2f %12.2f\n", entry->path, entry->acquisitions,
+                   entry->waits, entry->wait_ns / 1e6, entry->max_wait_ns / 1e3);
+    }
+    tree_contention_free(report);
+
+    if (config.json) {
+        bool to_stdout = strcmp(config.json, "-") == 0;
+        FILE* out = to_stdout ? stdout : fopen(config.json, "w");
+        if (!out)
+            syserr("cannot open %s", config.json);
+        write_json(out, latency, count, ok, elapsed);
+        if (!to_stdout && fclose(out) != 0)
+            syserr("cannot write %s", config.json);
+    }
+
+    tree_contention_reset();
+    tree_free(tree);
+    for (size_t i = 0; i < n_folders; ++i)
+        free(folders[i]);
+    free(folders);
+    free(by_rank);
+    free(zipf_cdf);
+    free(workers);
+    free(threads);
+    return 0;
+}